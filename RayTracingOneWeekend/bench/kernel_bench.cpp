@@ -0,0 +1,362 @@
+// Times the renderer's hot kernels: ray tests against single primitives and BVHs, noise, textures and scattering.
+// Every kernel is run over a fixed set of inputs made from a fixed seed, so runs of different versions time the same
+// work. Results are printed as a table, and with --json also written as JSON to track across versions ("-" writes the
+// JSON to stdout and the table to stderr), e.g.
+//     cmake -S . -B build && cmake --build build --target kernel_bench
+//     build/kernel_bench --json results.json
+// --perf adds cycles, IPC, and cache and branch misses per operation from hardware counters where Linux allows it
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "aarect.h"
+#include "bvh.h"
+#include "bvh4.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "moving_sphere.h"
+#include "perf_counters.h"
+#include "perlin.h"
+#include "sphere.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct bench_result
+{
+    std::string name;
+    // What one operation is: a ray traced, a lookup or a scatter
+    const char* unit;
+    double ns_per_op;
+    long long ops;
+    // Hardware counts over every repetition, empty unless --perf found counters
+    perf_sample hardware;
+};
+
+struct bench_options
+{
+    // Only kernels whose name contains this are run
+    std::string filter;
+    // Each repetition runs for at least this long
+    double min_time = 0.1;
+    int repetitions = 5;
+    std::string json_path;
+    std::string image_path = "earthmap.jpg";
+    // Read hardware counters around each kernel
+    bool perf = false;
+};
+
+// Results feed into this so no kernel can be optimised away
+static volatile double sink;
+
+// Time a kernel that does batch operations per call. Calls are repeated until min_time has passed, and the fastest
+// of several repetitions is kept. Hardware counts, when there are counters, cover every repetition
+static bench_result time_kernel(const bench_options& options, const perf_counter_group& counters, const std::string& name, const char* unit,
+    int batch, const std::function<double()>& kernel)
+{
+    double best = 1e30;
+    long long total = 0;
+    perf_sample counters_start, counters_end;
+    counters.read(counters_start);
+    for (int repetition = 0; repetition < options.repetitions; repetition++)
+    {
+        long long ops = 0;
+        double sum = 0;
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed(0);
+        do
+        {
+            sum += kernel();
+            ops += batch;
+            elapsed = std::chrono::steady_clock::now() - start;
+        } while (elapsed.count() < options.min_time);
+
+        sink = sink + sum;
+        total += ops;
+        best = std::min(best, elapsed.count() * 1e9 / ops);
+    }
+
+    bench_result result{ name, unit, best, total, perf_sample() };
+    if (counters.read(counters_end))
+        result.hardware = counters_end.since(counters_start);
+    return result;
+}
+
+// Rays from points around the origin towards points near it, most of which pass through a unit sized object there
+static std::vector<ray> make_rays(int count, real spread)
+{
+    std::vector<ray> rays(count);
+    for (auto& r : rays)
+    {
+        auto origin = 4 * unit_vector(vec3::random(-1, 1));
+        auto target = spread * vec3::random(-1, 1);
+        r = ray(origin, target - origin, random_double());
+    }
+    return rays;
+}
+
+// Rays crossing a cube of side size from one face to a random point
+static std::vector<ray> make_scene_rays(int count, real size)
+{
+    std::vector<ray> rays(count);
+    for (auto& r : rays)
+    {
+        auto origin = point3(random_double(0, size), random_double(0, size), -1);
+        auto target = point3(random_double(0, size), random_double(0, size), size + 1);
+        r = ray(origin, target - origin, random_double());
+    }
+    return rays;
+}
+
+// count spheres of the given radius spread through a cube of side size
+static hittable_list make_sphere_scene(int count, real size, real radius, shared_ptr<material> mat)
+{
+    hittable_list world;
+    for (int i = 0; i < count; i++)
+        world.add(make_shared<sphere>(point3(random_double(0, size), random_double(0, size), random_double(0, size)), radius, mat));
+    return world;
+}
+
+// Ray tests of one object, counting the hits
+static double trace_all(const hittable& object, const std::vector<ray>& rays)
+{
+    hit_record rec;
+    double hits = 0;
+    for (const auto& r : rays)
+        hits += object.hit(r, 0.001, infinity, rec) ? rec.t : 0;
+    return hits;
+}
+
+static void write_json(FILE* out, const std::vector<bench_result>& results)
+{
+#if defined(RT_USE_AVX)
+    const char* simd = "avx";
+#elif defined(RT_USE_SSE)
+    const char* simd = "sse";
+#else
+    const char* simd = "none";
+#endif
+
+    std::fprintf(out, "{\n  \"schema\": 1,\n");
+    std::fprintf(out, "  \"config\": { \"real\": \"%s\", \"simd\": \"%s\", \"vec3_bytes\": %d, \"stats\": %s },\n",
+        sizeof(real) == 4 ? "float" : "double", simd, static_cast<int>(sizeof(vec3)), stats_enabled ? "true" : "false");
+    std::fprintf(out, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const auto& result = results[i];
+        std::fprintf(out, "    { \"name\": \"%s\", \"unit\": \"%s\", \"ns_per_op\": %.4f, \"ops_per_second\": %.1f",
+            result.name.c_str(), result.unit, result.ns_per_op, 1e9 / result.ns_per_op);
+        if (std::strcmp(result.unit, "ray") == 0)
+            std::fprintf(out, ", \"rays_per_second\": %.1f", 1e9 / result.ns_per_op);
+        if (!result.hardware.empty())
+        {
+            auto ops = static_cast<double>(result.ops);
+            std::fprintf(out, ", \"cycles_per_op\": %.3f, \"instructions_per_op\": %.3f, \"ipc\": %.3f, \"cache_misses_per_op\": %.5f, \"branch_misses_per_op\": %.5f",
+                result.hardware[perf_sample::cycles] / ops, result.hardware[perf_sample::instructions] / ops, result.hardware.ipc(),
+                result.hardware[perf_sample::cache_misses] / ops, result.hardware[perf_sample::branch_misses] / ops);
+        }
+        std::fprintf(out, ", \"ops\": %lld }%s\n", result.ops, i + 1 < results.size() ? "," : "");
+    }
+    std::fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char* argv[])
+{
+    bench_options options;
+    for (int a = 1; a < argc; a++)
+    {
+        std::string arg = argv[a];
+        if (arg == "--filter" && a + 1 < argc)
+            options.filter = argv[++a];
+        else if (arg == "--min-time" && a + 1 < argc)
+            options.min_time = std::atof(argv[++a]);
+        else if (arg == "--repetitions" && a + 1 < argc)
+            options.repetitions = std::max(1, std::atoi(argv[++a]));
+        else if (arg == "--json" && a + 1 < argc)
+            options.json_path = argv[++a];
+        else if (arg == "--image" && a + 1 < argc)
+            options.image_path = argv[++a];
+        else if (arg == "--perf")
+            options.perf = true;
+        else
+        {
+            std::fprintf(stderr, "Usage: %s [--filter <text>] [--min-time <seconds>] [--repetitions <n>] [--json <path|->] [--image <path>] [--perf]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Without counters the kernels are still timed, their reads just fail
+    perf_counter_group counters;
+    if (options.perf)
+    {
+        std::string error;
+        if (!counters.open(error))
+            std::fprintf(stderr, "Hardware counters unavailable: %s.\n", error.c_str());
+    }
+
+    set_random_seed(1);
+
+    // Inputs small enough to stay in cache, so the kernels are what gets timed rather than memory
+    const int batch = 4096;
+    auto rays = make_rays(batch, 1.5);
+    auto white = make_shared<lambertian>(colour(0.73, 0.73, 0.73));
+
+    // The table goes to stderr when the JSON goes to stdout, so the JSON can be piped on its own
+    FILE* table = options.json_path == "-" ? stderr : stdout;
+
+    std::vector<bench_result> results;
+    auto run = [&](const std::string& name, const char* unit, const std::function<double()>& kernel) {
+        if (name.find(options.filter) == std::string::npos)
+            return;
+
+        results.push_back(time_kernel(options, counters, name, unit, batch, kernel));
+        const auto& result = results.back();
+        std::fprintf(table, "%-32s %9.2f ns/op %10.2f M%ss/s", name.c_str(), result.ns_per_op, 1e3 / result.ns_per_op, unit);
+        if (!result.hardware.empty())
+        {
+            auto ops = static_cast<double>(result.ops);
+            std::fprintf(table, " %9.1f cycles/op %5.2f IPC %8.4f cache misses/op %8.4f branch misses/op", result.hardware[perf_sample::cycles] / ops,
+                result.hardware.ipc(), result.hardware[perf_sample::cache_misses] / ops, result.hardware[perf_sample::branch_misses] / ops);
+        }
+        std::fprintf(table, "\n");
+        std::fflush(table);
+    };
+
+    // Primitives
+    aabb box(point3(-1, -1, -1), point3(1, 1, 1));
+    run("aabb::hit", "ray", [&] {
+        double hits = 0;
+        for (const auto& r : rays)
+            hits += box.hit(r, 0.001, infinity);
+        return hits;
+    });
+
+    sphere ball(point3(0, 0, 0), 1, white);
+    run("sphere::hit", "ray", [&] { return trace_all(ball, rays); });
+
+    moving_sphere moving(point3(0, -0.5, 0), point3(0, 0.5, 0), 0, 1, 1, white);
+    run("moving_sphere::hit", "ray", [&] { return trace_all(moving, rays); });
+
+    xy_rect rect(-1, 1, -1, 1, 0, white);
+    run("xy_rect::hit", "ray", [&] { return trace_all(rect, rays); });
+
+    // Acceleration structures over scenes of random spheres, the spheres' total volume is kept the same
+    for (int count : { 1000, 100000 })
+    {
+        const real size = 100;
+        auto world = make_sphere_scene(count, size, size * 0.3 / std::cbrt(static_cast<real>(count)), white);
+        auto scene_rays = make_scene_rays(batch, size);
+        auto suffix = " (" + std::to_string(count) + " spheres)";
+
+        bvh_node binary(world, 0, 1);
+        run("bvh_node::hit" + suffix, "ray", [&] { return trace_all(binary, scene_rays); });
+
+        bvh4 wide(binary);
+        run("bvh4::hit" + suffix, "ray", [&] { return trace_all(wide, scene_rays); });
+    }
+
+    // Noise and textures are looked up at the points where the rays hit the sphere, and materials scatter those rays.
+    // The hits found are repeated to fill the batch
+    std::vector<ray> hit_rays;
+    std::vector<hit_record> hits;
+    for (const auto& r : rays)
+    {
+        hit_record rec;
+        if (ball.hit(r, 0.001, infinity, rec))
+        {
+            hit_rays.push_back(r);
+            hits.push_back(rec);
+        }
+    }
+    for (size_t i = 0; hits.size() < static_cast<size_t>(batch); i++)
+    {
+        hit_rays.push_back(hit_rays[i]);
+        hits.push_back(hits[i]);
+    }
+
+    perlin noise;
+    run("perlin::noise", "lookup", [&] {
+        double sum = 0;
+        for (const auto& rec : hits)
+            sum += noise.noise(4 * rec.p);
+        return sum;
+    });
+    run("perlin::turb", "lookup", [&] {
+        double sum = 0;
+        for (const auto& rec : hits)
+            sum += noise.turb(4 * rec.p);
+        return sum;
+    });
+
+    std::vector<point3> noise_points;
+    for (const auto& rec : hits)
+        noise_points.push_back(4 * rec.p);
+    std::vector<real> noise_values(noise_points.size());
+    run("perlin::noise batch", "lookup", [&] {
+        noise.noise(noise_points.data(), noise_values.data(), noise_points.size());
+        return static_cast<double>(noise_values[0]);
+    });
+    run("perlin::turb batch", "lookup", [&] {
+        noise.turb(noise_points.data(), noise_values.data(), noise_points.size());
+        return static_cast<double>(noise_values[0]);
+    });
+
+    image_texture image(options.image_path.c_str());
+    run("image_texture::value", "lookup", [&] {
+        double sum = 0;
+        for (const auto& rec : hits)
+            sum += image.value(rec.u, rec.v, rec.p).x();
+        return sum;
+    });
+    // A footprint a few texels wide, blending two of the smaller mip levels
+    const real footprint = static_cast<real>(1.0 / 256);
+    run("image_texture::value mip", "lookup", [&] {
+        double sum = 0;
+        for (const auto& rec : hits)
+            sum += image.value(rec.u, rec.v, rec.p, footprint).x();
+        return sum;
+    });
+
+    lambertian diffuse(colour(0.5, 0.5, 0.5));
+    metal shiny(colour(0.7, 0.6, 0.5), 0.2);
+    dielectric glass(1.5);
+    const std::pair<const char*, const material*> materials[] = {
+        { "lambertian::scatter", &diffuse }, { "metal::scatter", &shiny }, { "dielectric::scatter", &glass }
+    };
+    for (const auto& entry : materials)
+    {
+        run(entry.first, "scatter", [&] {
+            double sum = 0;
+            colour attenuation;
+            ray scattered;
+            for (size_t i = 0; i < hits.size(); i++)
+            {
+                if (entry.second->scatter(hit_rays[i], hits[i], attenuation, scattered))
+                    sum += scattered.direction().x() + attenuation.y();
+            }
+            return sum;
+        });
+    }
+
+    if (!options.json_path.empty())
+    {
+        FILE* out = options.json_path == "-" ? stdout : std::fopen(options.json_path.c_str(), "w");
+        if (!out)
+        {
+            std::fprintf(stderr, "ERROR: Could not open '%s'.\n", options.json_path.c_str());
+            return 1;
+        }
+        write_json(out, results);
+        if (out != stdout)
+            std::fclose(out);
+    }
+
+    return 0;
+}
@@ -0,0 +1,116 @@
+// Times the vec3 operations the renderer leans on. vec3 is picked at compile time, so build this once as is for the
+// scalar version and once with RT_SIMD_VEC3 for the SIMD one (add RT_SINGLE_PRECISION for SSE floats, or target AVX
+// for doubles) and compare the two runs, e.g.
+//     g++ -std=c++17 -O2 -I../src vec3_bench.cpp -o vec3_scalar
+//     g++ -std=c++17 -O2 -I../src -DRT_SIMD_VEC3 -DRT_SINGLE_PRECISION vec3_bench.cpp -o vec3_simd
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+// Fastest of several runs of work over count items, in nanoseconds per item
+template <typename Work>
+static double time_per_item(int count, Work&& work)
+{
+    const int runs = 7;
+    double best = 1e30;
+    for (int run = 0; run < runs; run++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        work();
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count() / count);
+    }
+    return best;
+}
+
+int main()
+{
+#if defined(RT_VEC3_SSE)
+    const char* version = "SSE";
+#elif defined(RT_VEC3_AVX)
+    const char* version = "AVX";
+#else
+    const char* version = "scalar";
+#endif
+    std::printf("vec3: %s, %d bytes of %s\n", version, static_cast<int>(sizeof(vec3)), sizeof(real) == 4 ? "float" : "double");
+
+    // Small enough to stay in cache so the arithmetic is what gets timed
+    const int count = 4096;
+    const int repeats = 1000;
+    const int total = count * repeats;
+
+    std::vector<vec3> a(count), b(count), out(count);
+    for (int i = 0; i < count; i++)
+    {
+        a[i] = unit_vector(vec3::random(-1, 1));
+        b[i] = unit_vector(vec3::random(-1, 1));
+    }
+
+    // Results feed back into the next pass so nothing can be optimised away
+    real sink = 0;
+
+    auto report = [&](const char* name, double ns) {
+        std::printf("%-14s %6.2f ns\n", name, ns);
+    };
+
+    report("dot", time_per_item(total, [&] {
+        real sum = 0;
+        for (int r = 0; r < repeats; r++)
+            for (int i = 0; i < count; i++)
+                sum += dot(a[i], b[i]);
+        sink += sum;
+    }));
+
+    report("cross", time_per_item(total, [&] {
+        for (int r = 0; r < repeats; r++)
+            for (int i = 0; i < count; i++)
+                out[i] = cross(a[i], out[i] + b[i]);
+    }));
+
+    report("length", time_per_item(total, [&] {
+        real sum = 0;
+        for (int r = 0; r < repeats; r++)
+            for (int i = 0; i < count; i++)
+                sum += (a[i] + out[i]).length();
+        sink += sum;
+    }));
+
+    report("unit_vector", time_per_item(total, [&] {
+        for (int r = 0; r < repeats; r++)
+            for (int i = 0; i < count; i++)
+                out[i] = unit_vector(a[i] + 0.5 * out[i]);
+    }));
+
+    report("reflect", time_per_item(total, [&] {
+        for (int r = 0; r < repeats; r++)
+            for (int i = 0; i < count; i++)
+                out[i] = reflect(out[i] + a[i], b[i]);
+    }));
+
+    report("refract", time_per_item(total, [&] {
+        for (int r = 0; r < repeats; r++)
+            for (int i = 0; i < count; i++)
+                out[i] = refract(a[i], b[i], 0.5 + 0.25 * out[i].x());
+    }));
+
+    report("min/max", time_per_item(total, [&] {
+        vec3 low(infinity, infinity, infinity), high(-infinity, -infinity, -infinity);
+        for (int r = 0; r < repeats; r++)
+            for (int i = 0; i < count; i++)
+            {
+                low = component_min(low, a[i] + out[i]);
+                high = component_max(high, a[i] - out[i]);
+            }
+        sink += low.x() + high.y();
+    }));
+
+    for (const auto& v : out)
+        sink += v.z();
+    std::printf("(checksum %g)\n", static_cast<double>(sink));
+
+    return 0;
+}
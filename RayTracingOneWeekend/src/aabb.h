@@ -2,6 +2,7 @@
 #define AABB_H
 
 #include "rtweekend.h"
+#include "render_stats.h"
 
 // Bounding box class
 class aabb
@@ -13,14 +14,15 @@ public:
 	point3 min() const { return minimum; }
 	point3 max() const { return maximum; }
 
-	bool hit(const ray& r, double t_min, double t_max) const
+	bool hit(const ray& r, real t_min, real t_max) const
 	{
+		count_stat(stat_counter::box_tests);
 		for (int a = 0; a < 3; a++)
 		{
-			auto invD = 1.0f / r.direction()[a];
+			auto invD = 1.0 / r.direction()[a];
 			auto t0 = (min()[a] - r.origin()[a]) * invD;
 			auto t1 = (max()[a] - r.origin()[a]) * invD;
-			if (invD < 0.0f)
+			if (invD < 0.0)
 				std::swap(t0, t1);
 			t_min = t0 > t_min ? t0 : t_min;
 			t_max = t1 < t_max ? t1 : t_max;
@@ -30,6 +32,13 @@ public:
 		return true;
 	}
 
+	// Return the total area of the box's six faces
+	real surface_area() const
+	{
+		auto d = maximum - minimum;
+		return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+	}
+
 public:
 	point3 minimum;
 	point3 maximum;
@@ -38,14 +47,13 @@ public:
 // Create a box around two smaller boxes
 aabb surrounding_box(aabb box0, aabb box1)
 {
-	point3 small(fmin(box0.min().x(), box1.min().x()),
-		fmin(box0.min().y(), box1.min().y()),
-		fmin(box0.min().z(), box1.min().z()));
-	point3 big(fmax(box0.max().x(), box1.max().x()),
-		fmax(box0.max().y(), box1.max().y()),
-		fmax(box0.max().z(), box1.max().z()));
-
-	return aabb(small, big);
+	return aabb(component_min(box0.min(), box1.min()), component_max(box0.max(), box1.max()));
+}
+
+// A box containing nothing, surrounding it with any other box gives that box
+inline aabb empty_box()
+{
+	return aabb(point3(infinity, infinity, infinity), point3(-infinity, -infinity, -infinity));
 }
 
 #endif
\ No newline at end of file
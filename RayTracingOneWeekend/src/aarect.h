@@ -8,10 +8,13 @@ class xy_rect : public hittable
 {
 public:
 	xy_rect() {}
-	xy_rect(double _x0, double _x1, double _y0, double _y1, double _k, shared_ptr<material> mat) : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
+	xy_rect(real _x0, real _x1, real _y0, real _y1, real _k, shared_ptr<material> mat) : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual real pdf_value(const point3& origin, const vec3& direction) const override;
+	virtual vec3 random(const point3& origin) const override;
+	virtual shared_ptr<material> light_material() const override { return mp; }
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override
 	{
 		output_box = aabb(point3(x0, y0, k - 0.0001), point3(x1, y1, k + 0.0001));
 		return true;
@@ -19,7 +22,7 @@ public:
 
 public:
 	shared_ptr<material> mp;
-	double x0, x1, y0, y1, k;
+	real x0, x1, y0, y1, k;
 };
 
 class xz_rect : public hittable
@@ -27,18 +30,21 @@ class xz_rect : public hittable
 public:
 	xz_rect() {}
 
-	xz_rect(double _x0, double _x1, double _z0, double _z1, double _k, shared_ptr<material> mat) : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
+	xz_rect(real _x0, real _x1, real _z0, real _z1, real _k, shared_ptr<material> mat) : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual real pdf_value(const point3& origin, const vec3& direction) const override;
+	virtual vec3 random(const point3& origin) const override;
+	virtual shared_ptr<material> light_material() const override { return mp; }
 
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
 		output_box = aabb(point3(x0, k - 0.0001, z0), point3(x1, k + 0.0001, z1));
 		return true;
 	}
 
 public:
 	shared_ptr<material> mp;
-	double x0, x1, z0, z1, k;
+	real x0, x1, z0, z1, k;
 };
 
 class yz_rect : public hittable
@@ -46,23 +52,28 @@ class yz_rect : public hittable
 public:
 	yz_rect() {}
 
-	yz_rect(double _y0, double _y1, double _z0, double _z1, double _k, shared_ptr<material> mat) : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
+	yz_rect(real _y0, real _y1, real _z0, real _z1, real _k, shared_ptr<material> mat) : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual real pdf_value(const point3& origin, const vec3& direction) const override;
+	virtual vec3 random(const point3& origin) const override;
+	virtual shared_ptr<material> light_material() const override { return mp; }
 
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
 		output_box = aabb(point3(k - 0.0001, y0, z0), point3(k + 0.0001, y1, z1));
 		return true;
 	}
 
 public:
 	shared_ptr<material> mp;
-	double y0, y1, z0, z1, k;
+	real y0, y1, z0, z1, k;
 };
 
 
-bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool xy_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
+	count_stat(stat_counter::rect_tests);
+
 	auto t = (k - r.origin().z()) / (r.direction().z());
 
 	if (t < t_min || t > t_max)
@@ -76,17 +87,23 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
 
 	rec.u = (x - x0) / (x1 - x0);
 	rec.v = (y - y0) / (y1 - y0);
+	rec.uv_scale = 1 / sqrt((x1 - x0) * (y1 - y0));
 	rec.t = t;
 	auto outward_normal = vec3(0, 0, 1);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mp;
+	rec.mat_ptr = mp.get();
+	// Put the point exactly in the plane, so it has no error in the direction of the normal
 	rec.p = r.at(t);
+	rec.p[2] = k;
+	rec.p_error = 0;
 
 	return true;
 }
 
-bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool xz_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
+	count_stat(stat_counter::rect_tests);
+
 	auto t = (k - r.origin().y()) / r.direction().y();
 
 	if (t < t_min || t > t_max)
@@ -100,17 +117,22 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
 
 	rec.u = (x - x0) / (x1 - x0);
 	rec.v = (z - z0) / (z1 - z0);
+	rec.uv_scale = 1 / sqrt((x1 - x0) * (z1 - z0));
 	rec.t = t;
 	auto outward_normal = vec3(0, 1, 0);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mp;
+	rec.mat_ptr = mp.get();
 	rec.p = r.at(t);
+	rec.p[1] = k;
+	rec.p_error = 0;
 
 	return true;
 }
 
-bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool yz_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
+	count_stat(stat_counter::rect_tests);
+
 	auto t = (k - r.origin().x()) / r.direction().x();
 
 	if (t < t_min || t > t_max)
@@ -124,13 +146,73 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
 
 	rec.u = (y - y0) / (y1 - y0);
 	rec.v = (z - z0) / (z1 - z0);
+	rec.uv_scale = 1 / sqrt((y1 - y0) * (z1 - z0));
 	rec.t = t;
 	auto outward_normal = vec3(1, 0, 0);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mp;
+	rec.mat_ptr = mp.get();
 	rec.p = r.at(t);
+	rec.p[0] = k;
+	rec.p_error = 0;
 
 	return true;
 }
 
+real xy_rect::pdf_value(const point3& origin, const vec3& direction) const
+{
+	hit_record rec;
+	if (!this->hit(ray(origin, direction), 0, infinity, rec))
+		return 0.0;
+
+	auto area = (x1 - x0) * (y1 - y0);
+	auto distance_squared = rec.t * rec.t * direction.length_squared();
+	auto cosine = fabs(dot(direction, rec.normal) / direction.length());
+
+	return distance_squared / (cosine * area);
+}
+
+vec3 xy_rect::random(const point3& origin) const
+{
+	auto random_point = point3(random_double(x0, x1), random_double(y0, y1), k);
+	return random_point - origin;
+}
+
+real xz_rect::pdf_value(const point3& origin, const vec3& direction) const
+{
+	hit_record rec;
+	if (!this->hit(ray(origin, direction), 0, infinity, rec))
+		return 0.0;
+
+	auto area = (x1 - x0) * (z1 - z0);
+	auto distance_squared = rec.t * rec.t * direction.length_squared();
+	auto cosine = fabs(dot(direction, rec.normal) / direction.length());
+
+	return distance_squared / (cosine * area);
+}
+
+vec3 xz_rect::random(const point3& origin) const
+{
+	auto random_point = point3(random_double(x0, x1), k, random_double(z0, z1));
+	return random_point - origin;
+}
+
+real yz_rect::pdf_value(const point3& origin, const vec3& direction) const
+{
+	hit_record rec;
+	if (!this->hit(ray(origin, direction), 0, infinity, rec))
+		return 0.0;
+
+	auto area = (y1 - y0) * (z1 - z0);
+	auto distance_squared = rec.t * rec.t * direction.length_squared();
+	auto cosine = fabs(dot(direction, rec.normal) / direction.length());
+
+	return distance_squared / (cosine * area);
+}
+
+vec3 yz_rect::random(const point3& origin) const
+{
+	auto random_point = point3(k, random_double(y0, y1), random_double(z0, z1));
+	return random_point - origin;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,76 @@
+#ifndef ADAPTIVE_SAMPLING_H
+#define ADAPTIVE_SAMPLING_H
+
+#include "rtweekend.h"
+#include "vec3.h"
+
+#include <vector>
+
+// Running mean and variance of a pixel's samples, using Welford's method on sample luminance
+struct pixel_estimate
+{
+	colour sum = colour(0, 0, 0);
+	int count = 0;
+	double mean = 0;
+	double m2 = 0;
+
+	void add(const colour& sample)
+	{
+		sum += sample;
+		count++;
+
+		auto luminance = 0.2126 * sample.x() + 0.7152 * sample.y() + 0.0722 * sample.z();
+		auto delta = luminance - mean;
+		mean += delta / count;
+		m2 += delta * (luminance - mean);
+	}
+
+	double variance() const
+	{
+		return count > 1 ? m2 / (count - 1) : 0.0;
+	}
+
+	// True once the standard error of the mean is within threshold of the mean. The variance is taken to be at least
+	// variance_floor, so a pixel whose first few samples all happened to miss a small light keeps sampling. Dark pixels
+	// are given a little headroom so they do not run to the sample limit chasing tiny absolute errors
+	bool converged(double threshold, double variance_floor) const
+	{
+		if (count < 2)
+			return false;
+
+		auto tolerance = threshold * (mean + 0.01);
+		return fmax(variance(), variance_floor) <= tolerance * tolerance * count;
+	}
+
+	colour average() const
+	{
+		return count > 0 ? sum / count : colour(0, 0, 0);
+	}
+};
+
+// Average variance of a group of neighbouring pixels
+inline double pooled_variance(const std::vector<pixel_estimate>& estimates)
+{
+	double total = 0;
+	for (const auto& estimate : estimates)
+		total += estimate.variance();
+	return estimates.empty() ? 0.0 : total / estimates.size();
+}
+
+// Colour every pixel by the number of samples it took, from blue for min_samples to red for max_samples
+inline std::vector<colour> sample_heatmap(const std::vector<int>& counts, int min_samples, int max_samples)
+{
+	std::vector<colour> heatmap(counts.size());
+	auto range = max_samples > min_samples ? static_cast<double>(max_samples - min_samples) : 1.0;
+
+	for (size_t i = 0; i < counts.size(); i++)
+	{
+		auto t = clamp((counts[i] - min_samples) / range, 0.0, 1.0);
+		// Squared so the ramp is even once the writer gamma corrects it
+		heatmap[i] = colour(t * t, 0, (1 - t) * (1 - t));
+	}
+
+	return heatmap;
+}
+
+#endif
@@ -4,16 +4,18 @@
 #include "rtweekend.h"
 #include "aarect.h"
 #include "hittable_list.h"
+#include "scene_arena.h"
 
 class box : public hittable
 {
 public:
 	box() {}
-	box(const point3& p0, const point3& p1, shared_ptr<material> ptr);
+	// The sides are placed in the arena when one is given
+	box(const point3& p0, const point3& p1, shared_ptr<material> ptr, scene_arena* arena = nullptr);
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
 
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override
 	{
 		output_box = aabb(box_min, box_max);
 		return true;
@@ -25,21 +27,21 @@ public:
 	hittable_list sides;
 };
 
-box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr)
+box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr, scene_arena* arena)
 {
 	box_min = p0;
 	box_max = p1;
 
-	sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-	sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
+	sides.add(arena_make<xy_rect>(arena, p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
+	sides.add(arena_make<xy_rect>(arena, p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
 
-	sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-	sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
+	sides.add(arena_make<xz_rect>(arena, p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
+	sides.add(arena_make<xz_rect>(arena, p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
 
-	sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-	sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
+	sides.add(arena_make<yz_rect>(arena, p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
+	sides.add(arena_make<yz_rect>(arena, p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
 }
 
-bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const { return sides.hit(r, t_min, t_max, rec); }
+bool box::hit(const ray& r, real t_min, real t_max, hit_record& rec) const { return sides.hit(r, t_min, t_max, rec); }
 
 #endif
\ No newline at end of file
@@ -5,112 +5,148 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "bvh_builder.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <vector>
 
-// A bounding box node
+// A bounding volume hierarchy stored as a contiguous array of nodes in depth-first order
 class bvh_node : public hittable
 {
 public:
-	bvh_node();
-	bvh_node(const hittable_list& list, double time0, double time1) : bvh_node(list.objects, 0, list.objects.size(), time0, time1) {}
+	bvh_node() {}
+	bvh_node(const hittable_list& list, real time0, real time1) : bvh_node(list.objects, 0, list.objects.size(), time0, time1) {}
 
-	bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1);
+	bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, real time0, real time1);
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override;
 
 public:
-	shared_ptr<hittable> left;
-	shared_ptr<hittable> right;
+	std::vector<linear_bvh_node> nodes;
+	// The objects in leaf order, each leaf refers to a contiguous range
+	std::vector<shared_ptr<hittable>> primitives;
 	aabb box;
+
+	// Surface Area Heuristic cost of the tree, lower is better
+	double sah_cost = 0;
+
+	static const int max_leaf_size = 4;
+	// Deepest tree the traversal stack can handle
+	static const int max_depth = sah_bvh_builder::max_depth;
 };
 
-// Compare two hittable objcts to find the left or right one for different axes
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis)
+// Build the tree over a range of objects
+bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, real time0, real time1)
 {
-	aabb box_a;
-	aabb box_b;
+	if (start >= end)
+		return;
 
-	if(!a->bounding_box(0,0,box_a) || !b->bounding_box(0,0,box_b))
-		std::cerr << "No bounding box in bvh_node constructor.\n";
+	std::vector<bvh_build_primitive> build;
+	build.reserve(end - start);
 
-	return box_a.min().e[axis] < box_b.min().e[axis];
-}
+	for (size_t i = start; i < end; i++)
+	{
+		bvh_build_primitive prim;
+		if (!src_objects[i]->bounding_box(time0, time1, prim.bounds))
+			std::cerr << "No bounding box in bvh_node constructor.\n";
 
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-	return box_compare(a, b, 0);
-}
+		prim.centroid = 0.5 * (prim.bounds.min() + prim.bounds.max());
+		prim.index = static_cast<uint32_t>(i);
+		build.push_back(prim);
+	}
 
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-	return box_compare(a, b, 1);
-}
+	sah_bvh_builder builder(max_leaf_size);
+	sah_cost = builder.build(build, nodes);
+
+	// Store the objects in the order the builder left them so each leaf's range is contiguous
+	primitives.reserve(build.size());
+	for (const auto& prim : build)
+		primitives.push_back(src_objects[prim.index]);
 
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-	return box_compare(a, b, 2);
+	box = aabb(point3(nodes[0].bounds_min[0], nodes[0].bounds_min[1], nodes[0].bounds_min[2]),
+		point3(nodes[0].bounds_max[0], nodes[0].bounds_max[1], nodes[0].bounds_max[2]));
 }
 
-// Method for creating a bounding box tree that splits all objects into smaller and smaller bounding boxes
-bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1)
+// Walk the tree with an explicit stack, visiting the child nearest the ray origin first
+bool bvh_node::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
-	auto objects = src_objects;
+	if (nodes.empty())
+		return false;
 
-	int axis = random_int(0, 2);
-	auto comparator = (axis == 0) ? box_x_compare : (axis == 1) ? box_y_compare : box_z_compare;
+	const point3 origin = r.origin();
+	const vec3 inv_dir(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+	const bool dir_is_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
 
-	size_t object_span = end - start;
+	uint32_t stack[max_depth];
+	int stack_size = 0;
+	uint32_t current = 0;
+	bool hit_anything = false;
+	// Counted here and added once at the end to keep the loop free of stores
+	uint64_t visited = 0;
 
-	if (object_span == 1) 
+	while (true)
 	{
-		left = right = objects[start];
-	}
-	else if (object_span == 2)
-	{
-		if (comparator(objects[start], objects[start + 1]))
+		const auto& node = nodes[current];
+		visited++;
+
+		// Slab test against the node's bounds
+		auto node_t_min = t_min;
+		auto node_t_max = t_max;
+		for (int a = 0; a < 3; a++)
 		{
-			left = objects[start];
-			right = objects[start + 1];
+			auto t0 = (node.bounds_min[a] - origin[a]) * inv_dir[a];
+			auto t1 = (node.bounds_max[a] - origin[a]) * inv_dir[a];
+			if (dir_is_neg[a])
+				std::swap(t0, t1);
+			node_t_min = t0 > node_t_min ? t0 : node_t_min;
+			node_t_max = t1 < node_t_max ? t1 : node_t_max;
 		}
-		else
+
+		if (node_t_min <= node_t_max)
 		{
-			left = objects[start + 1];
-			right = objects[start];
+			if (node.primitive_count > 0)
+			{
+				for (uint32_t i = node.offset; i < node.offset + node.primitive_count; i++)
+				{
+					if (primitives[i]->hit(r, t_min, t_max, rec))
+					{
+						hit_anything = true;
+						t_max = rec.t;
+					}
+				}
+			}
+			else
+			{
+				if (dir_is_neg[node.axis])
+				{
+					stack[stack_size++] = current + 1;
+					current = node.offset;
+				}
+				else
+				{
+					stack[stack_size++] = node.offset;
+					current = current + 1;
+				}
+				continue;
+			}
 		}
-	}
-	else
-	{
-		std::sort(objects.begin() + start, objects.begin() + end, comparator);
 
-		auto mid = start + object_span / 2;
-		left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-		right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+		if (stack_size == 0)
+			break;
+		current = stack[--stack_size];
 	}
 
-	aabb box_left, box_right;
-
-	if (!left->bounding_box(time0, time1, box_left) || !right->bounding_box(time0, time1, box_right)
-		)
-		std::cerr << "No bounding box in bvh_node constructor.\n";
-
-	box = surrounding_box(box_left, box_right);
-}
-
-// Check if bouding box is hit
-bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
-{
-	if (!box.hit(r, t_min, t_max))
-		return false;
-
-	bool hit_left = left->hit(r, t_min, t_max, rec);
-	bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
-
-	return hit_left || hit_right;
+	count_stat(stat_counter::bvh_nodes, visited);
+	count_stat(stat_counter::box_tests, visited);
+	return hit_anything;
 }
 
-bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const
+bool bvh_node::bounding_box(real time0, real time1, aabb& output_box) const
 {
 	output_box = box;
-	return true;
+	return !nodes.empty();
 }
 
-#endif
\ No newline at end of file
+#endif
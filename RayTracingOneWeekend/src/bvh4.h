@@ -0,0 +1,672 @@
+#ifndef BVH4_H
+#define BVH4_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#ifdef RT_USE_SSE
+#include <xmmintrin.h>
+#endif
+
+// A node with four children whose bounds are stored structure-of-arrays so all four can be tested at once.
+// Unused children have inverted (empty) bounds so they never pass the slab test
+struct alignas(16) bvh4_node
+{
+	// [min or max][axis][child]
+	float bounds[2][3][4];
+	// Interior children: index of the child node. Leaves: index of the first primitive
+	uint32_t child[4];
+	// Number of primitives in a leaf child, 0 for interior children
+	uint32_t count[4];
+};
+
+static_assert(sizeof(bvh4_node) == 128, "bvh4_node should be 128 bytes");
+
+// A 4-wide BVH made by collapsing a binary bvh_node, every step through the tree tests four boxes with one slab test
+class bvh4 : public hittable
+{
+public:
+	bvh4() {}
+	bvh4(const hittable_list& list, real time0, real time1) : bvh4(bvh_node(list, time0, time1)) {}
+	bvh4(const bvh_node& binary);
+
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override;
+
+	// Packets are a multiple of the four SIMD lanes
+	static const int packet_groups = packet_size / 4;
+	static_assert(packet_size % 4 == 0, "Packets should fill whole SIMD registers");
+
+	virtual int hit_packet(const ray rays[packet_size], int ray_mask, real t_min, real closest[packet_size], hit_record recs[packet_size]) const override;
+
+public:
+	std::vector<bvh4_node> nodes;
+	// The objects in leaf order, each leaf refers to a contiguous range
+	std::vector<shared_ptr<hittable>> primitives;
+	aabb box;
+	// SAH cost of the binary tree this was collapsed from
+	double sah_cost = 0;
+
+	// Each node pushes at most three children more than it pops
+	static const int stack_size = 3 * bvh_node::max_depth + 1;
+
+public:
+	// A ray converted to the precision of the nodes with everything the slab test needs computed once
+	struct traversal_ray
+	{
+#ifdef RT_USE_SSE
+		__m128 origin[3];
+		__m128 inv_dir[3];
+#else
+		float origin[3];
+		float inv_dir[3];
+#endif
+		// 1 where the direction is negative, selects which bound is the near one per axis
+		int sign[3];
+
+		traversal_ray(const ray& r);
+	};
+
+	// Slab test the ray against all four children, returns a bit mask of the children hit and their entry distances
+	static int intersect_children(const bvh4_node& node, const traversal_ray& tr, float t_min, float t_max, float t_near[4]);
+
+	// A packet of rays stored structure-of-arrays in groups of four, one ray per SIMD lane
+	struct ray_packet
+	{
+#ifdef RT_USE_SSE
+		__m128 origin[3][packet_groups];
+		__m128 inv_dir[3][packet_groups];
+#else
+		float origin[3][packet_size];
+		float inv_dir[3][packet_size];
+#endif
+		// Per axis, 1 if every ray's direction is negative, 0 if every one is positive and -1 if they differ
+		int sign[3];
+		// True when the signs agree on every axis so the whole packet can be culled with interval arithmetic
+		bool coherent;
+
+		// Interval bounds over the packet per axis: the origin that gives the smallest entry and largest exit
+		// distance, and the range of reciprocal directions
+		float near_origin[3];
+		float far_origin[3];
+		float inv_dir_min[3];
+		float inv_dir_max[3];
+
+		ray_packet(const ray rays[packet_size]);
+	};
+
+	static int intersect_children_packet(const bvh4_node& node, const ray_packet& packet, int ray_mask, float t_min, const float t_max[packet_size],
+		int ray_masks[4], float t_near[4]);
+
+	// Conservatively test the whole packet against all four children at once, returns a mask of the children
+	// any ray of the packet might hit and a lower bound on each one's entry distance
+	static int intersect_children_interval(const bvh4_node& node, const ray_packet& packet, float t_min, float t_max, float t_near[4]);
+
+	static int order_children(int mask, const float t_near[4], int order[4]);
+
+	struct stack_entry
+	{
+		uint32_t index;
+		uint32_t count;
+		float t_near;
+	};
+
+	// Collapse the nodes of a binary tree made by sah_bvh_builder into four wide nodes, leaves keep their primitive ranges
+	static void collapse_tree(const std::vector<linear_bvh_node>& binary, std::vector<bvh4_node>& nodes);
+
+	// True if nodes are a tree collapse_tree could have made over primitive_count primitives. Nodes read from a file
+	// are checked with this before they are walked
+	static bool validate(const std::vector<bvh4_node>& nodes, size_t primitive_count);
+
+	// Walk a tree with an explicit stack, visiting the children each node test hits from nearest to furthest.
+	// Leaves are handed to leaf(first, count, t_max), which returns t_max shortened to any hit it found
+	template <typename Leaf>
+	static void traverse(const std::vector<bvh4_node>& nodes, const ray& r, real t_min, real t_max, Leaf&& leaf);
+
+	// Walk a tree once for a whole packet. A child is visited if any active ray hits it and only those rays carry on below it.
+	// Leaves are handed to leaf(first, count, ray_mask), which shortens closest for the rays it hits
+	template <typename Leaf>
+	static void traverse_packet(const std::vector<bvh4_node>& nodes, const ray_packet& packet, int ray_mask, real t_min, const real closest[packet_size],
+		Leaf&& leaf);
+
+private:
+	struct packet_entry
+	{
+		uint32_t index;
+		uint32_t count;
+		// Rays of the packet that hit this entry's box
+		int ray_mask;
+	};
+
+	static uint32_t collapse(const std::vector<linear_bvh_node>& binary, uint32_t binary_index, std::vector<bvh4_node>& nodes);
+};
+
+bvh4::traversal_ray::traversal_ray(const ray& r)
+{
+	for (int a = 0; a < 3; a++)
+	{
+		auto inv = static_cast<float>(1.0 / r.direction()[a]);
+		sign[a] = inv < 0;
+#ifdef RT_USE_SSE
+		origin[a] = _mm_set1_ps(static_cast<float>(r.origin()[a]));
+		inv_dir[a] = _mm_set1_ps(inv);
+#else
+		origin[a] = static_cast<float>(r.origin()[a]);
+		inv_dir[a] = inv;
+#endif
+	}
+}
+
+int bvh4::intersect_children(const bvh4_node& node, const traversal_ray& tr, float t_min, float t_max, float t_near[4])
+{
+#ifdef RT_USE_SSE
+	// Max and min return their second operand when either is NaN, keeping the running interval for 0 * inf
+	__m128 near_t = _mm_set1_ps(t_min);
+	__m128 far_t = _mm_set1_ps(t_max);
+
+	for (int a = 0; a < 3; a++)
+	{
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[tr.sign[a]][a]), tr.origin[a]), tr.inv_dir[a]);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1 - tr.sign[a]][a]), tr.origin[a]), tr.inv_dir[a]);
+		near_t = _mm_max_ps(t0, near_t);
+		far_t = _mm_min_ps(t1, far_t);
+	}
+
+	_mm_storeu_ps(t_near, near_t);
+	return _mm_movemask_ps(_mm_cmple_ps(near_t, far_t));
+#else
+	int mask = 0;
+	for (int c = 0; c < 4; c++)
+	{
+		auto near_t = t_min;
+		auto far_t = t_max;
+		for (int a = 0; a < 3; a++)
+		{
+			auto t0 = (node.bounds[tr.sign[a]][a][c] - tr.origin[a]) * tr.inv_dir[a];
+			auto t1 = (node.bounds[1 - tr.sign[a]][a][c] - tr.origin[a]) * tr.inv_dir[a];
+			near_t = t0 > near_t ? t0 : near_t;
+			far_t = t1 < far_t ? t1 : far_t;
+		}
+		t_near[c] = near_t;
+		mask |= (near_t <= far_t) << c;
+	}
+	return mask;
+#endif
+}
+
+bvh4::bvh4(const bvh_node& binary) : primitives(binary.primitives), box(binary.box), sah_cost(binary.sah_cost)
+{
+	collapse_tree(binary.nodes, nodes);
+}
+
+void bvh4::collapse_tree(const std::vector<linear_bvh_node>& binary, std::vector<bvh4_node>& nodes)
+{
+	if (binary.empty())
+		return;
+
+	nodes.reserve(binary.size() / 2 + 1);
+
+	// A root that is a leaf still needs a node above it
+	if (binary[0].primitive_count > 0)
+	{
+		nodes.emplace_back();
+		auto& root = nodes[0];
+		for (int c = 0; c < 4; c++)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				root.bounds[0][a][c] = c == 0 ? binary[0].bounds_min[a] : std::numeric_limits<float>::infinity();
+				root.bounds[1][a][c] = c == 0 ? binary[0].bounds_max[a] : -std::numeric_limits<float>::infinity();
+			}
+			root.child[c] = c == 0 ? binary[0].offset : 0;
+			root.count[c] = c == 0 ? binary[0].primitive_count : 0;
+		}
+		return;
+	}
+
+	collapse(binary, 0, nodes);
+}
+
+// Gather up to four descendants of a binary interior node by repeatedly opening the largest interior child,
+// then collapse each of them in turn. Returns the index of the new node
+uint32_t bvh4::collapse(const std::vector<linear_bvh_node>& bnodes, uint32_t binary_index, std::vector<bvh4_node>& nodes)
+{
+	auto area = [&](uint32_t i) {
+		auto dx = bnodes[i].bounds_max[0] - bnodes[i].bounds_min[0];
+		auto dy = bnodes[i].bounds_max[1] - bnodes[i].bounds_min[1];
+		auto dz = bnodes[i].bounds_max[2] - bnodes[i].bounds_min[2];
+		return dx * dy + dy * dz + dz * dx;
+	};
+
+	uint32_t children[4] = { binary_index + 1, bnodes[binary_index].offset, 0, 0 };
+	int child_count = 2;
+
+	while (child_count < 4)
+	{
+		int largest = -1;
+		for (int c = 0; c < child_count; c++)
+		{
+			if (bnodes[children[c]].primitive_count == 0 && (largest < 0 || area(children[c]) > area(children[largest])))
+				largest = c;
+		}
+		if (largest < 0)
+			break;
+
+		auto opened = children[largest];
+		children[largest] = opened + 1;
+		children[child_count++] = bnodes[opened].offset;
+	}
+
+	auto index = static_cast<uint32_t>(nodes.size());
+	nodes.emplace_back();
+
+	for (int c = 0; c < 4; c++)
+	{
+		// Collapsing a child appends to nodes, so only keep a reference to this node between those calls
+		uint32_t child = 0;
+		uint32_t count = 0;
+		if (c < child_count)
+		{
+			const auto& bnode = bnodes[children[c]];
+			count = bnode.primitive_count;
+			child = count > 0 ? bnode.offset : collapse(bnodes, children[c], nodes);
+		}
+
+		auto& node = nodes[index];
+		for (int a = 0; a < 3; a++)
+		{
+			node.bounds[0][a][c] = c < child_count ? bnodes[children[c]].bounds_min[a] : std::numeric_limits<float>::infinity();
+			node.bounds[1][a][c] = c < child_count ? bnodes[children[c]].bounds_max[a] : -std::numeric_limits<float>::infinity();
+		}
+		node.child[c] = child;
+		node.count[c] = count;
+	}
+
+	return index;
+}
+
+// Walk the nodes in index order checking what collapse_tree guarantees. A leaf child's range lies within the
+// primitives. An interior child comes after its parent, lies within nodes and belongs to no other child, so there are
+// no cycles and every node is reached from the root once. An unused child, index and count 0, has the inverted bounds
+// no ray can pass. No node is deeper than the traversal stacks, sized for bvh_node::max_depth, can hold
+bool bvh4::validate(const std::vector<bvh4_node>& nodes, size_t primitive_count)
+{
+	// Depth of every node reached so far, -1 for nodes no parent has claimed yet
+	std::vector<int> depth(nodes.size(), -1);
+	if (!nodes.empty())
+		depth[0] = 0;
+
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		if (depth[i] < 0)
+			return false;
+
+		const auto& node = nodes[i];
+		for (int c = 0; c < 4; c++)
+		{
+			auto child = node.child[c];
+			auto count = node.count[c];
+			if (count > 0)
+			{
+				if (static_cast<uint64_t>(child) + count > primitive_count)
+					return false;
+			}
+			else if (child == 0)
+			{
+				for (int a = 0; a < 3; a++)
+				{
+					if (node.bounds[0][a][c] != std::numeric_limits<float>::infinity() || node.bounds[1][a][c] != -std::numeric_limits<float>::infinity())
+						return false;
+				}
+			}
+			else
+			{
+				// An interior node at depth d leaves up to 3 * (d + 1) + 1 entries on the stack
+				if (child <= i || child >= nodes.size() || depth[child] >= 0 || depth[i] + 1 >= bvh_node::max_depth)
+					return false;
+				depth[child] = depth[i] + 1;
+			}
+		}
+	}
+	return true;
+}
+
+template <typename Leaf>
+void bvh4::traverse(const std::vector<bvh4_node>& nodes, const ray& r, real t_min, real t_max, Leaf&& leaf)
+{
+	if (nodes.empty())
+		return;
+
+	const traversal_ray tr(r);
+
+	// Widen the float interval slightly so rounding the ray to float never culls a box the ray touches
+	const float box_t_min = static_cast<float>(t_min);
+	const float widen = 1.0f + 4 * std::numeric_limits<float>::epsilon();
+
+	stack_entry stack[stack_size];
+	int stack_top = 0;
+	stack[stack_top++] = { 0, 0, box_t_min };
+	// Counted here and added once at the end to keep the loop free of stores
+	uint64_t visited = 0;
+
+	while (stack_top > 0)
+	{
+		auto entry = stack[--stack_top];
+		if (entry.t_near > t_max * widen)
+			continue;
+
+		if (entry.count > 0)
+		{
+			t_max = leaf(entry.index, entry.count, t_max);
+			continue;
+		}
+
+		const auto& node = nodes[entry.index];
+		visited++;
+		float t_near[4];
+		int mask = intersect_children(node, tr, box_t_min, static_cast<float>(t_max) * widen, t_near);
+
+		int order[4];
+		int hits = order_children(mask, t_near, order);
+		for (int k = 0; k < hits; k++)
+		{
+			auto c = order[k];
+			stack[stack_top++] = { node.child[c], node.count[c], t_near[c] };
+		}
+	}
+
+	count_stat(stat_counter::bvh_nodes, visited);
+	count_stat(stat_counter::box_tests, 4 * visited);
+}
+
+template <typename Leaf>
+void bvh4::traverse_packet(const std::vector<bvh4_node>& nodes, const ray_packet& packet, int ray_mask, real t_min, const real closest[packet_size],
+	Leaf&& leaf)
+{
+	if (nodes.empty() || ray_mask == 0)
+		return;
+
+	const float box_t_min = static_cast<float>(t_min);
+	const float widen = 1.0f + 4 * std::numeric_limits<float>::epsilon();
+
+	packet_entry stack[stack_size];
+	int stack_top = 0;
+	stack[stack_top++] = { 0, 0, ray_mask };
+	uint64_t visited = 0;
+
+	while (stack_top > 0)
+	{
+		auto entry = stack[--stack_top];
+
+		if (entry.count > 0)
+		{
+			leaf(entry.index, entry.count, entry.ray_mask);
+			continue;
+		}
+
+		float lane_t_max[packet_size];
+		for (int k = 0; k < packet_size; k++)
+			lane_t_max[k] = static_cast<float>(closest[k]) * widen;
+
+		const auto& node = nodes[entry.index];
+		visited++;
+		int ray_masks[4];
+		float t_near[4];
+		int mask;
+
+		if (packet.coherent)
+		{
+			// Cull for the packet as a whole and leave the exact test per ray to the leaves
+			float packet_t_max = lane_t_max[0];
+			for (int k = 1; k < packet_size; k++)
+				packet_t_max = std::max(packet_t_max, lane_t_max[k]);
+
+			mask = intersect_children_interval(node, packet, box_t_min, packet_t_max, t_near);
+			for (int c = 0; c < 4; c++)
+				ray_masks[c] = entry.ray_mask;
+		}
+		else
+		{
+			mask = intersect_children_packet(node, packet, entry.ray_mask, box_t_min, lane_t_max, ray_masks, t_near);
+		}
+
+		int order[4];
+		int hits = order_children(mask, t_near, order);
+		for (int k = 0; k < hits; k++)
+		{
+			auto c = order[k];
+			stack[stack_top++] = { node.child[c], node.count[c], ray_masks[c] };
+		}
+	}
+
+	count_stat(stat_counter::bvh_nodes, visited);
+	count_stat(stat_counter::box_tests, 4 * visited);
+}
+
+bool bvh4::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	bool hit_anything = false;
+
+	traverse(nodes, r, t_min, t_max, [&](uint32_t first, uint32_t count, real closest) {
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			if (primitives[i]->hit(r, t_min, closest, rec))
+			{
+				hit_anything = true;
+				closest = rec.t;
+			}
+		}
+		return closest;
+	});
+
+	return hit_anything;
+}
+
+// Leaves pass the rays that reached them on to each primitive's own packet test
+int bvh4::hit_packet(const ray rays[packet_size], int ray_mask, real t_min, real closest[packet_size], hit_record recs[packet_size]) const
+{
+	if (nodes.empty() || ray_mask == 0)
+		return 0;
+
+	const ray_packet packet(rays);
+	int hit_mask = 0;
+
+	traverse_packet(nodes, packet, ray_mask, t_min, closest, [&](uint32_t first, uint32_t count, int leaf_mask) {
+		for (uint32_t i = first; i < first + count; i++)
+			hit_mask |= primitives[i]->hit_packet(rays, leaf_mask, t_min, closest, recs);
+	});
+
+	return hit_mask;
+}
+
+bvh4::ray_packet::ray_packet(const ray rays[packet_size])
+{
+	for (int a = 0; a < 3; a++)
+	{
+		alignas(16) float o[packet_size];
+		alignas(16) float inv[packet_size];
+		int negative = 0;
+		for (int k = 0; k < packet_size; k++)
+		{
+			o[k] = static_cast<float>(rays[k].origin()[a]);
+			inv[k] = static_cast<float>(1.0 / rays[k].direction()[a]);
+			negative += inv[k] < 0;
+		}
+		sign[a] = negative == packet_size ? 1 : negative == 0 ? 0 : -1;
+
+		auto o_min = *std::min_element(o, o + packet_size);
+		auto o_max = *std::max_element(o, o + packet_size);
+		near_origin[a] = sign[a] == 1 ? o_min : o_max;
+		far_origin[a] = sign[a] == 1 ? o_max : o_min;
+		inv_dir_min[a] = *std::min_element(inv, inv + packet_size);
+		inv_dir_max[a] = *std::max_element(inv, inv + packet_size);
+#ifdef RT_USE_SSE
+		for (int g = 0; g < packet_groups; g++)
+		{
+			origin[a][g] = _mm_load_ps(o + 4 * g);
+			inv_dir[a][g] = _mm_load_ps(inv + 4 * g);
+		}
+#else
+		for (int k = 0; k < packet_size; k++)
+		{
+			origin[a][k] = o[k];
+			inv_dir[a][k] = inv[k];
+		}
+#endif
+	}
+
+	coherent = sign[0] >= 0 && sign[1] >= 0 && sign[2] >= 0;
+}
+
+int bvh4::intersect_children_interval(const bvh4_node& node, const ray_packet& packet, float t_min, float t_max, float t_near[4])
+{
+	// With the direction signs fixed the smallest entry distance over the packet comes from the origin nearest the
+	// near plane and the largest exit distance from the origin furthest from the far one, either reciprocal
+	// direction extreme can give the smaller or larger product so both are tried
+#ifdef RT_USE_SSE
+	__m128 near_t = _mm_set1_ps(t_min);
+	__m128 far_t = _mm_set1_ps(t_max);
+
+	for (int a = 0; a < 3; a++)
+	{
+		const __m128 inv_min = _mm_set1_ps(packet.inv_dir_min[a]);
+		const __m128 inv_max = _mm_set1_ps(packet.inv_dir_max[a]);
+
+		__m128 d_near = _mm_sub_ps(_mm_load_ps(node.bounds[packet.sign[a]][a]), _mm_set1_ps(packet.near_origin[a]));
+		__m128 d_far = _mm_sub_ps(_mm_load_ps(node.bounds[1 - packet.sign[a]][a]), _mm_set1_ps(packet.far_origin[a]));
+
+		near_t = _mm_max_ps(_mm_min_ps(_mm_mul_ps(d_near, inv_min), _mm_mul_ps(d_near, inv_max)), near_t);
+		far_t = _mm_min_ps(_mm_max_ps(_mm_mul_ps(d_far, inv_min), _mm_mul_ps(d_far, inv_max)), far_t);
+	}
+
+	_mm_storeu_ps(t_near, near_t);
+	return _mm_movemask_ps(_mm_cmple_ps(near_t, far_t));
+#else
+	int mask = 0;
+	for (int c = 0; c < 4; c++)
+	{
+		auto near_t = t_min;
+		auto far_t = t_max;
+		for (int a = 0; a < 3; a++)
+		{
+			auto d_near = node.bounds[packet.sign[a]][a][c] - packet.near_origin[a];
+			auto d_far = node.bounds[1 - packet.sign[a]][a][c] - packet.far_origin[a];
+			auto t0 = std::min(d_near * packet.inv_dir_min[a], d_near * packet.inv_dir_max[a]);
+			auto t1 = std::max(d_far * packet.inv_dir_min[a], d_far * packet.inv_dir_max[a]);
+			near_t = t0 > near_t ? t0 : near_t;
+			far_t = t1 < far_t ? t1 : far_t;
+		}
+		t_near[c] = near_t;
+		mask |= (near_t <= far_t) << c;
+	}
+	return mask;
+#endif
+}
+
+// Test every ray of the packet against each child box. Returns a mask of the children hit by any active ray,
+// the rays that hit each child and the nearest entry distance into each child over those rays
+int bvh4::intersect_children_packet(const bvh4_node& node, const ray_packet& packet, int ray_mask, float t_min, const float t_max[packet_size],
+	int ray_masks[4], float t_near[4])
+{
+	int child_mask = 0;
+
+	for (int c = 0; c < 4; c++)
+	{
+		// Ordering the slab distances per ray would turn an unused child's inverted bounds into an infinite box
+		ray_masks[c] = 0;
+		if (node.bounds[0][0][c] > node.bounds[1][0][c])
+			continue;
+
+		alignas(16) float near_t[packet_size];
+		int hit = 0;
+
+#ifdef RT_USE_SSE
+		for (int g = 0; g < packet_groups; g++)
+		{
+			if (!((ray_mask >> (4 * g)) & 0xf))
+				continue;
+
+			__m128 near_v = _mm_set1_ps(t_min);
+			__m128 far_v = _mm_loadu_ps(t_max + 4 * g);
+			for (int a = 0; a < 3; a++)
+			{
+				__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bounds[0][a][c]), packet.origin[a][g]), packet.inv_dir[a][g]);
+				__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bounds[1][a][c]), packet.origin[a][g]), packet.inv_dir[a][g]);
+				near_v = _mm_max_ps(_mm_min_ps(t0, t1), near_v);
+				far_v = _mm_min_ps(_mm_max_ps(t0, t1), far_v);
+			}
+			_mm_store_ps(near_t + 4 * g, near_v);
+			hit |= _mm_movemask_ps(_mm_cmple_ps(near_v, far_v)) << (4 * g);
+		}
+#else
+		for (int k = 0; k < packet_size; k++)
+		{
+			auto near_k = t_min;
+			auto far_k = t_max[k];
+			for (int a = 0; a < 3; a++)
+			{
+				auto t0 = (node.bounds[0][a][c] - packet.origin[a][k]) * packet.inv_dir[a][k];
+				auto t1 = (node.bounds[1][a][c] - packet.origin[a][k]) * packet.inv_dir[a][k];
+				if (t0 > t1)
+					std::swap(t0, t1);
+				near_k = t0 > near_k ? t0 : near_k;
+				far_k = t1 < far_k ? t1 : far_k;
+			}
+			near_t[k] = near_k;
+			hit |= (near_k <= far_k) << k;
+		}
+#endif
+
+		hit &= ray_mask;
+		ray_masks[c] = hit;
+		if (!hit)
+			continue;
+
+		child_mask |= 1 << c;
+		t_near[c] = std::numeric_limits<float>::infinity();
+		for (int k = 0; k < packet_size; k++)
+		{
+			if ((hit & (1 << k)) && near_t[k] < t_near[c])
+				t_near[c] = near_t[k];
+		}
+	}
+
+	return child_mask;
+}
+
+// Order the hit children furthest first so the nearest ends up on top of the stack, returns how many were hit
+int bvh4::order_children(int mask, const float t_near[4], int order[4])
+{
+	int hits = 0;
+	for (int c = 0; c < 4; c++)
+	{
+		if (!(mask & (1 << c)))
+			continue;
+
+		int k = hits++;
+		while (k > 0 && t_near[order[k - 1]] < t_near[c])
+		{
+			order[k] = order[k - 1];
+			k--;
+		}
+		order[k] = c;
+	}
+
+	return hits;
+}
+
+bool bvh4::bounding_box(real time0, real time1, aabb& output_box) const
+{
+	output_box = box;
+	return !nodes.empty();
+}
+
+#endif
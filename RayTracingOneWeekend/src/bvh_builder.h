@@ -0,0 +1,256 @@
+#ifndef BVH_BUILDER_H
+#define BVH_BUILDER_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// A node of the flattened tree, kept to 32 bytes so two fit in a cache line.
+// Bounds are stored as floats rounded outwards so they always contain the exact box
+struct linear_bvh_node
+{
+	float bounds_min[3];
+	float bounds_max[3];
+	// Leaves: index of the first primitive. Interior nodes: index of the second child, the first child directly follows its parent
+	uint32_t offset;
+	// Number of primitives in a leaf, 0 for interior nodes
+	uint16_t primitive_count;
+	// Axis interior nodes were split along
+	uint8_t axis;
+	uint8_t pad;
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should be 32 bytes");
+
+// Round a double to the nearest float that is not greater (down) or not smaller (up) than it
+inline float float_round_down(double x)
+{
+	auto f = static_cast<float>(x);
+	return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float float_round_up(double x)
+{
+	auto f = static_cast<float>(x);
+	return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+// A primitive's bounds and centroid, computed once before the build
+struct bvh_build_primitive
+{
+	aabb bounds;
+	point3 centroid;
+	uint32_t index;
+};
+
+// Builds a linear BVH with the Surface Area Heuristic, evaluating splits at the boundaries of equal width
+// centroid bins on every axis. Primitives are partitioned in place so after the build leaf ranges index
+// straight into the reordered primitive array
+class sah_bvh_builder
+{
+public:
+	sah_bvh_builder(int max_leaf_size = 4, int bin_count = 16) : max_leaf_size(max_leaf_size), bin_count(bin_count < max_bins ? bin_count : max_bins) {}
+
+	// Build the tree over prims, appending nodes in depth-first order. Returns the SAH cost of the tree
+	double build(std::vector<bvh_build_primitive>& prims, std::vector<linear_bvh_node>& nodes);
+
+public:
+	int max_leaf_size;
+	int bin_count;
+
+	// Relative costs of stepping through a node and intersecting a primitive
+	double traversal_cost = 1.0;
+	double intersection_cost = 1.0;
+
+	static const int max_bins = 32;
+	// Deepest tree a traversal stack needs to handle
+	static const int max_depth = 64;
+	// Most primitives a node's primitive_count can hold
+	static const size_t max_leaf_count = std::numeric_limits<uint16_t>::max();
+	// Levels from the bottom where splits are made at the middle of the range, which is enough to bring 2^32
+	// primitives down to max_leaf_count before max_depth
+	static const int middle_split_depth = 17;
+
+private:
+	struct bin
+	{
+		aabb bounds = empty_box();
+		size_t count = 0;
+	};
+
+	uint32_t build_recursive(std::vector<bvh_build_primitive>& prims, size_t start, size_t end, int depth,
+		std::vector<linear_bvh_node>& nodes, double& cost, double root_area);
+	uint32_t make_leaf(size_t start, size_t end, const aabb& bounds, std::vector<linear_bvh_node>& nodes,
+		double& cost, double root_area);
+	static void set_bounds(linear_bvh_node& node, const aabb& bounds);
+};
+
+double sah_bvh_builder::build(std::vector<bvh_build_primitive>& prims, std::vector<linear_bvh_node>& nodes)
+{
+	if (prims.empty())
+		return 0;
+
+	aabb root = empty_box();
+	for (const auto& prim : prims)
+		root = surrounding_box(root, prim.bounds);
+
+	nodes.reserve(nodes.size() + 2 * prims.size() / std::max(1, max_leaf_size) + 1);
+
+	double cost = 0;
+	build_recursive(prims, 0, prims.size(), 1, nodes, cost, std::max<double>(root.surface_area(), 1e-30));
+	return cost;
+}
+
+// Build a subtree over prims[start, end), returns the node's index
+uint32_t sah_bvh_builder::build_recursive(std::vector<bvh_build_primitive>& prims, size_t start, size_t end, int depth,
+	std::vector<linear_bvh_node>& nodes, double& cost, double root_area)
+{
+	aabb bounds = empty_box();
+	aabb centroid_bounds = empty_box();
+
+	for (size_t i = start; i < end; i++)
+	{
+		bounds = surrounding_box(bounds, prims[i].bounds);
+		centroid_bounds = surrounding_box(centroid_bounds, aabb(prims[i].centroid, prims[i].centroid));
+	}
+
+	auto count = end - start;
+
+	if (count == 1 || (depth >= max_depth && count <= max_leaf_count))
+		return make_leaf(start, end, bounds, nodes, cost, root_area);
+
+	// Find the cheapest bin boundary over all three axes
+	auto best_cost = infinity;
+	int best_axis = -1;
+	int best_split = 0;
+	vec3 extent = centroid_bounds.max() - centroid_bounds.min();
+
+	for (int axis = 0; axis < 3 && depth < max_depth - middle_split_depth; axis++)
+	{
+		if (extent[axis] <= 0)
+			continue;
+
+		bin bins[max_bins];
+		auto scale = bin_count / extent[axis];
+
+		for (size_t i = start; i < end; i++)
+		{
+			auto b = std::min(bin_count - 1, static_cast<int>((prims[i].centroid[axis] - centroid_bounds.min()[axis]) * scale));
+			bins[b].count++;
+			bins[b].bounds = surrounding_box(bins[b].bounds, prims[i].bounds);
+		}
+
+		// Sweep from the right to find the area and count to the right of every boundary
+		double right_area[max_bins];
+		size_t right_count[max_bins];
+		aabb right_box = empty_box();
+		size_t right_total = 0;
+		for (int b = bin_count - 1; b > 0; b--)
+		{
+			right_box = surrounding_box(right_box, bins[b].bounds);
+			right_total += bins[b].count;
+			right_area[b] = right_box.surface_area();
+			right_count[b] = right_total;
+		}
+
+		// Sweep from the left and evaluate the cost of splitting before each bin
+		aabb left_box = empty_box();
+		size_t left_total = 0;
+		for (int b = 1; b < bin_count; b++)
+		{
+			left_box = surrounding_box(left_box, bins[b - 1].bounds);
+			left_total += bins[b - 1].count;
+			if (left_total == 0 || right_count[b] == 0)
+				continue;
+
+			auto split_cost = left_box.surface_area() * left_total + right_area[b] * right_count[b];
+			if (split_cost < best_cost)
+			{
+				best_cost = split_cost;
+				best_axis = axis;
+				best_split = b;
+			}
+		}
+	}
+
+	auto area = std::max<double>(bounds.surface_area(), 1e-30);
+	auto leaf_cost = intersection_cost * count;
+	best_cost = traversal_cost + intersection_cost * best_cost / area;
+
+	size_t mid;
+	if (best_axis < 0)
+	{
+		// Every centroid is in the same place, or the tree is nearly too deep to split by cost. Only split, halving the
+		// range, if the primitives will not fit in one leaf
+		if (count <= static_cast<size_t>(max_leaf_size))
+			return make_leaf(start, end, bounds, nodes, cost, root_area);
+
+		mid = start + count / 2;
+		best_axis = 0;
+	}
+	else
+	{
+		if (count <= static_cast<size_t>(max_leaf_size) && leaf_cost <= best_cost)
+			return make_leaf(start, end, bounds, nodes, cost, root_area);
+
+		auto axis = best_axis;
+		auto scale = bin_count / extent[axis];
+		auto axis_min = centroid_bounds.min()[axis];
+		auto last_bin = bin_count - 1;
+		auto split = best_split;
+
+		auto middle = std::partition(prims.begin() + start, prims.begin() + end, [=](const bvh_build_primitive& prim) {
+			return std::min(last_bin, static_cast<int>((prim.centroid[axis] - axis_min) * scale)) < split;
+		});
+		mid = static_cast<size_t>(middle - prims.begin());
+	}
+
+	auto index = static_cast<uint32_t>(nodes.size());
+	nodes.emplace_back();
+	set_bounds(nodes[index], bounds);
+	nodes[index].primitive_count = 0;
+	nodes[index].axis = static_cast<uint8_t>(best_axis);
+	cost += traversal_cost * area / root_area;
+
+	build_recursive(prims, start, mid, depth + 1, nodes, cost, root_area);
+	auto second = build_recursive(prims, mid, end, depth + 1, nodes, cost, root_area);
+	nodes[index].offset = second;
+
+	return index;
+}
+
+uint32_t sah_bvh_builder::make_leaf(size_t start, size_t end, const aabb& bounds, std::vector<linear_bvh_node>& nodes,
+	double& cost, double root_area)
+{
+	auto index = static_cast<uint32_t>(nodes.size());
+	nodes.emplace_back();
+
+	assert(end - start <= max_leaf_count);
+
+	auto& node = nodes[index];
+	set_bounds(node, bounds);
+	node.offset = static_cast<uint32_t>(start);
+	node.primitive_count = static_cast<uint16_t>(end - start);
+	node.axis = 0;
+
+	cost += intersection_cost * (end - start) * bounds.surface_area() / root_area;
+
+	return index;
+}
+
+void sah_bvh_builder::set_bounds(linear_bvh_node& node, const aabb& bounds)
+{
+	for (int a = 0; a < 3; a++)
+	{
+		node.bounds_min[a] = float_round_down(bounds.min()[a]);
+		node.bounds_max[a] = float_round_up(bounds.max()[a]);
+	}
+	node.pad = 0;
+}
+
+#endif
@@ -3,14 +3,17 @@
 
 #include "rtweekend.h"
 
+#include <algorithm>
+
 // Creates a camera with all required information
 class camera 
 {
 public:
-    camera(point3 lookfrom, point3 lookat, vec3 vup, double v_fov, double aspect_ratio, double aperture, double focus_dist, double _time0, double _time1) 
+    camera(point3 lookfrom, point3 lookat, vec3 vup, real v_fov, real aspect_ratio, real aperture, real focus_dist, real _time0, real _time1) 
     {
         auto theta = degrees_to_radians(v_fov);
         auto h = tan(theta / 2);
+        half_height = h;
         auto viewport_height = 2.0 * h;
         auto viewport_width = aspect_ratio * viewport_height;
 
@@ -29,7 +32,7 @@ public:
     };
 
     // Gets the ray from camera origin to provided coords
-    ray get_ray(double s, double t) const
+    ray get_ray(real s, real t) const
     {
         vec3 rd = lens_radius * random_in_unit_disc();
         vec3 offset = u * rd.x() + v * rd.y();
@@ -37,14 +40,23 @@ public:
         return ray(origin + offset, lower_left_corner + s*horizontal + t*vertical - origin - offset, random_double(time0, time1)); 
     }
 
+    // Angle between the rays through neighbouring pixels of an image this many pixels high, how fast the footprint of
+    // a camera ray widens with distance
+    real pixel_spread(int image_height) const
+    {
+        return 2 * atan(half_height / std::max(1, image_height - 1));
+    }
+
 public:
     point3 origin;
     point3 lower_left_corner;
     vec3 horizontal;
     vec3 vertical;
     vec3 u, v, w;
-    double lens_radius;
-    double time0, time1;
+    real lens_radius;
+    // Half the height of the viewport at unit distance
+    real half_height;
+    real time0, time1;
 };
 
 #endif
\ No newline at end of file
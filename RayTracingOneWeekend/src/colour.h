@@ -1,29 +1,71 @@
 #ifndef COLOUR_H
 #define COLOUR_H
 
+#include "rtweekend.h"
 #include "vec3.h"
 
-#include <iostream>
+#include <cstdint>
+#include <cstring>
 
-// Writes a colour to specified output stream
-void write_colour(std::ostream& out, colour pixel_colour, int samples_per_pixel)
+#ifdef RT_USE_SSE
+#include <emmintrin.h>
+#endif
+
+// Average a row of summed samples into linear RGB, three floats per pixel
+inline void resolve_row(const colour* sums, int count, int samples_per_pixel, float* linear)
 {
-    // Get the RGB colour values
-    auto r = pixel_colour.x();
-    auto g = pixel_colour.y();
-    auto b = pixel_colour.z();
+    auto scale = 1.0 / samples_per_pixel;
+    for (int i = 0; i < count; i++)
+    {
+        linear[3 * i + 0] = static_cast<float>(scale * sums[i].x());
+        linear[3 * i + 1] = static_cast<float>(scale * sums[i].y());
+        linear[3 * i + 2] = static_cast<float>(scale * sums[i].z());
+    }
+}
 
-    // Find the average RGB values by dividing the totals by number of samples
+// Gamma correct (gamma 2) a row of summed samples and translate them to [0,255]. The average and the gamma are
+// worked out in double, as the text output always did, so every 8-bit format gets the same bytes it did
+inline void quantize_row(const colour* sums, int count, int samples_per_pixel, uint8_t* out)
+{
     auto scale = 1.0 / samples_per_pixel;
-    r = sqrt(scale * r);
-    g = sqrt(scale * g);
-    b = sqrt(scale * b);
-
-    // Write the translated [0,255] value of each RGB value
-    out << static_cast<int>(256 * clamp(r, 0.0, 0.999)) << ' '
-        << static_cast<int>(256 * clamp(g, 0.0, 0.999)) << ' '
-        << static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
+    int i = 0;
+
+#ifdef RT_USE_SSE
+    // Two pixels, six values, at a time. max and min also flush the NaN from an empty sample to 0
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d upper = _mm_set1_pd(0.999);
+    const __m128d levels = _mm_set1_pd(256.0);
+    const __m128d scales = _mm_set1_pd(scale);
+
+    for (; i + 2 <= count; i += 2)
+    {
+        const colour& a = sums[i];
+        const colour& b = sums[i + 1];
+        const __m128d values[3] = { _mm_set_pd(a.y(), a.x()), _mm_set_pd(b.x(), a.z()), _mm_set_pd(b.z(), b.y()) };
+        __m128i quantized[3];
+        for (int k = 0; k < 3; k++)
+        {
+            __m128d v = _mm_max_pd(_mm_mul_pd(values[k], scales), zero);
+            v = _mm_min_pd(_mm_sqrt_pd(v), upper);
+            quantized[k] = _mm_cvttpd_epi32(_mm_mul_pd(v, levels));
+        }
+
+        __m128i words = _mm_packs_epi32(_mm_unpacklo_epi64(quantized[0], quantized[1]), quantized[2]);
+        uint8_t bytes[16];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bytes), _mm_packus_epi16(words, words));
+        memcpy(out + 3 * i, bytes, 6);
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            auto v = scale * sums[i][c];
+            out[3 * i + c] = static_cast<uint8_t>(256 * clamp(v > 0 ? std::sqrt(v) : 0.0, 0.0, 0.999));
+        }
+    }
 }
 
 
-#endif
\ No newline at end of file
+#endif
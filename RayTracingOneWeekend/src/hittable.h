@@ -4,6 +4,7 @@
 #include "rtweekend.h"
 #include "ray.h"
 #include "aabb.h"
+#include "render_stats.h"
 
 class material;
 
@@ -12,10 +13,18 @@ struct hit_record
 {
 	point3 p;
 	vec3 normal;
-	shared_ptr<material> mat_ptr;
-	double t;
-	double u;
-	double v;
+	// Not owning, the material is kept alive by the object that was hit for as long as the scene exists
+	const material* mat_ptr;
+	// Bound on how far each coordinate of p may be from the surface, new rays start this far off it
+	real p_error;
+	real t;
+	real u;
+	real v;
+	// How fast u and v change across the surface near p, the square root of uv area per unit of surface area. 0 where
+	// the surface has no uvs
+	real uv_scale = 0;
+	// Width of the ray's footprint at p, set by whoever traced the ray. 0 when it is not known
+	real footprint = 0;
 	bool front_face;
 
 	inline void set_face_normal(const ray& r, const vec3& outward_normal)
@@ -23,45 +32,76 @@ struct hit_record
 		front_face = dot(r.direction(), outward_normal) < 0;
 		normal = front_face ? outward_normal : -outward_normal;
 	}
+
+	// Width of the footprint in uv units, the area textures average over
+	real uv_footprint() const { return footprint * uv_scale; }
 };
 
 // A hittable class with a hit fucntion find if a ray hits an object
 class hittable
 {
 public:
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const = 0;
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const = 0;
+
+	// Number of rays traced together by hit_packet
+	static const int packet_size = 16;
+
+	// Find the closest hit for each ray in ray_mask that is nearer than its entry in closest, shortening closest to it.
+	// Returns a mask of the rays that hit. Objects that can trace a packet faster than one ray at a time override this
+	virtual int hit_packet(const ray rays[packet_size], int ray_mask, real t_min, real closest[packet_size], hit_record recs[packet_size]) const
+	{
+		int hit_mask = 0;
+		for (int k = 0; k < packet_size; k++)
+		{
+			if ((ray_mask & (1 << k)) && hit(rays[k], t_min, closest[k], recs[k]))
+			{
+				hit_mask |= 1 << k;
+				closest[k] = recs[k].t;
+			}
+		}
+		return hit_mask;
+	}
+
+	// Light sampling. pdf_value is the solid angle density of random picking direction from origin, and random picks a
+	// direction from origin towards a point on the object. Only objects that return their material from light_material support these
+	virtual real pdf_value(const point3& origin, const vec3& direction) const { return 0.0; }
+	virtual vec3 random(const point3& origin) const { return vec3(1, 0, 0); }
+	virtual shared_ptr<material> light_material() const { return nullptr; }
 };
 
-// A hittable class that has been translated on an axis
+// A hittable class that has been translated on an axis. instance (instance.h) takes any affine transform in one step
 class translate : public hittable
 {
 public:
 	translate(shared_ptr<hittable>& p, const vec3& dispalcement) : ptr(p), offset(dispalcement) {}
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
 
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override;
 
 public:
 	shared_ptr<hittable> ptr;
 	vec3 offset;
 };
 
-bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool translate::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
+	count_stat(stat_counter::instance_tests);
+
 	ray moved_r(r.origin() - offset, r.direction(), r.time());
 
 	if (!ptr->hit(moved_r, t_min, t_max, rec))
 		return false;
 
 	rec.p += offset;
+	rec.p_error += rounding_error(rec.p);
 	rec.set_face_normal(moved_r, rec.normal);
 
 	return true;
 }
 
-bool translate::bounding_box(double time0, double time1, aabb& output_box) const
+bool translate::bounding_box(real time0, real time1, aabb& output_box) const
 {
 	if (!ptr->bounding_box(time0, time1, output_box))
 		return false;
@@ -75,25 +115,25 @@ bool translate::bounding_box(double time0, double time1, aabb& output_box) const
 // A hittable that has been rotated around the y axis
 class rotate_y : public hittable {
 public:
-	rotate_y(shared_ptr<hittable> p, double angle);
+	rotate_y(shared_ptr<hittable> p, real angle);
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
 
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override {
 		output_box = bbox;
 		return hasbox;
 	}
 
 public:
 	shared_ptr<hittable> ptr;
-	double sin_theta;
-	double cos_theta;
+	real sin_theta;
+	real cos_theta;
 	bool hasbox;
 	aabb bbox;
 };
 
 // Rotate the box
-rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
+rotate_y::rotate_y(shared_ptr<hittable> p, real angle) : ptr(p) {
 	auto radians = degrees_to_radians(angle);
 	sin_theta = sin(radians);
 	cos_theta = cos(radians);
@@ -114,10 +154,8 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
 
 				vec3 tester(newx, y, newz);
 
-				for (int c = 0; c < 3; c++) {
-					min[c] = fmin(min[c], tester[c]);
-					max[c] = fmax(max[c], tester[c]);
-				}
+				min = component_min(min, tester);
+				max = component_max(max, tester);
 			}
 		}
 	}
@@ -126,7 +164,9 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
 }
 
 // Find if a rotated box has been hit
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool rotate_y::hit(const ray& r, real t_min, real t_max, hit_record& rec) const {
+	count_stat(stat_counter::instance_tests);
+
 	auto origin = r.origin();
 	auto direction = r.direction();
 
@@ -151,6 +191,7 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 	normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
 
 	rec.p = p;
+	rec.p_error += rounding_error(p);
 	rec.set_face_normal(rotated_r, normal);
 
 	return true;
@@ -4,6 +4,7 @@
 #include "hittable.h"
 #include "aabb.h"
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 
@@ -20,16 +21,22 @@ public:
 	void clear() { objects.clear(); }
 	void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override;
+
+	// Sample a direction towards one of the objects picked uniformly, for a list of lights
+	virtual real pdf_value(const point3& origin, const vec3& direction) const override;
+	virtual vec3 random(const point3& origin) const override;
 
 public:
 	std::vector<shared_ptr<hittable>> objects;
 };
 
 // Go through the list and find if anything has been hit
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool hittable_list::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
+	count_stat(stat_counter::list_tests);
+
 	hit_record temp_rec;
 	bool hit_anything = false;
 	auto closest_so_far = t_max;
@@ -48,7 +55,7 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
 }
 
 // A box that surrounds a group of objects
-bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) const
+bool hittable_list::bounding_box(real time0, real time1, aabb& output_box) const
 {
 	if (objects.empty()) return false;
 
@@ -65,4 +72,21 @@ bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) c
 	return true;
 }
 
+// The average of every object's density, as each is picked with equal probability
+real hittable_list::pdf_value(const point3& origin, const vec3& direction) const
+{
+	if (objects.empty()) return 0.0;
+
+	real sum = 0.0;
+	for (const auto& object : objects)
+		sum += object->pdf_value(origin, direction);
+
+	return sum / objects.size();
+}
+
+vec3 hittable_list::random(const point3& origin) const
+{
+	return objects[random_int(0, static_cast<int>(objects.size()))]->random(origin);
+}
+
 #endif
\ No newline at end of file
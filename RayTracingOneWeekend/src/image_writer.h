@@ -0,0 +1,124 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "rtweekend.h"
+#include "colour.h"
+#include "png_writer.h"
+#include "trace.h"
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+// Output file formats
+enum class image_format
+{
+	ppm_ascii,	// P3 text PPM
+	ppm,		// P6 binary PPM
+	png,
+	pfm			// Linear 32-bit float RGB, keeps the full range of emissive scenes
+};
+
+// Find a format from its name on the command line, returns false if there is no such format
+inline bool image_format_from_name(const std::string& name, image_format& format)
+{
+	if (name == "p3") format = image_format::ppm_ascii;
+	else if (name == "ppm" || name == "p6") format = image_format::ppm;
+	else if (name == "png") format = image_format::png;
+	else if (name == "pfm") format = image_format::pfm;
+	else return false;
+	return true;
+}
+
+// Pick a format from a file's extension, anything unknown is written as binary PPM
+inline image_format image_format_from_path(const std::string& path)
+{
+	auto dot = path.find_last_of('.');
+	image_format format = image_format::ppm;
+	if (dot != std::string::npos && !image_format_from_name(path.substr(dot + 1), format))
+		format = image_format::ppm;
+	return format;
+}
+
+// Write a frame buffer of summed samples, stored with the bottom row first, to a stream
+inline bool write_image(std::ostream& out, image_format format, const std::vector<colour>& pixels, int width, int height, int samples_per_pixel)
+{
+	if (format == image_format::pfm)
+	{
+		std::vector<float> linear(static_cast<size_t>(width) * 3);
+
+		// PFM rows go from bottom to top and a negative scale marks little endian data
+		out << "PF\n" << width << ' ' << height << "\n-1.0\n";
+		for (int j = 0; j < height; j++)
+		{
+			resolve_row(&pixels[static_cast<size_t>(j) * width], width, samples_per_pixel, linear.data());
+			out.write(reinterpret_cast<const char*>(linear.data()), linear.size() * sizeof(float));
+		}
+		return static_cast<bool>(out);
+	}
+
+	// Every other format is 8-bit with the top row first
+	std::vector<uint8_t> bytes(static_cast<size_t>(width) * height * 3);
+	for (int j = height - 1; j >= 0; j--)
+		quantize_row(&pixels[static_cast<size_t>(j) * width], width, samples_per_pixel, &bytes[static_cast<size_t>(height - 1 - j) * width * 3]);
+
+	switch (format)
+	{
+	case image_format::ppm_ascii:
+	{
+		out << "P3\n" << width << ' ' << height << "\n255\n";
+		std::string text;
+		text.reserve(bytes.size() * 4);
+		for (size_t i = 0; i < bytes.size(); i += 3)
+		{
+			text += std::to_string(bytes[i]) + ' ' + std::to_string(bytes[i + 1]) + ' ' + std::to_string(bytes[i + 2]) + '\n';
+		}
+		out << text;
+		break;
+	}
+
+	case image_format::png:
+		return write_png(out, bytes.data(), width, height);
+
+	default:
+	case image_format::ppm:
+		out << "P6\n" << width << ' ' << height << "\n255\n";
+		out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+		break;
+	}
+
+	return static_cast<bool>(out);
+}
+
+// Write a frame buffer to a file, a path of "-" writes to standard output
+inline bool write_image(const std::string& path, image_format format, const std::vector<colour>& pixels, int width, int height, int samples_per_pixel)
+{
+	trace_scope trace("Write image", "output", "width", width, "height", height);
+	if (path == "-")
+	{
+#ifdef _WIN32
+		// Stop Windows turning '\n' bytes in binary formats into "\r\n"
+		if (format != image_format::ppm_ascii)
+			_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		return write_image(std::cout, format, pixels, width, height, samples_per_pixel);
+	}
+
+	std::ofstream file(path, std::ios::binary);
+	if (!file)
+	{
+		std::cerr << "ERROR: Could not open output file '" << path << "'.\n";
+		return false;
+	}
+
+	return write_image(file, format, pixels, width, height, samples_per_pixel);
+}
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "aabb.h"
+
+// An affine transform stored as the top three rows of a 4x4 matrix, the last column is the translation
+class affine_transform
+{
+public:
+	affine_transform() : m{ { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } } {}
+
+	static affine_transform translate(const vec3& offset);
+	static affine_transform scale(const vec3& factors);
+	// Rotate by an angle in degrees about an axis through the origin
+	static affine_transform rotate(const vec3& axis, real degrees);
+	static affine_transform rotate_y(real degrees) { return rotate(vec3(0, 1, 0), degrees); }
+
+	point3 apply_point(const point3& p) const
+	{
+		return point3(
+			m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+			m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+			m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+	}
+
+	vec3 apply_vector(const vec3& v) const
+	{
+		return vec3(
+			m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+			m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+			m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+	}
+
+	// Multiply by the transpose of the linear part, applied to a normal by the inverse of the transform that moves the surface
+	vec3 apply_transposed(const vec3& v) const
+	{
+		return vec3(
+			m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+			m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+			m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+	}
+
+	// Bound on the error of apply_point(p) when each coordinate of p is within p_error of the true point
+	real point_error(const point3& p, real p_error) const;
+
+	// Fills inv and returns true, or returns false leaving inv alone if the linear part has no usable inverse
+	bool inverse(affine_transform& inv) const;
+
+	// Determinant of the linear part, how much the transform scales volumes
+	real determinant() const
+	{
+		return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+			m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	}
+
+public:
+	real m[3][4];
+};
+
+// The transform that applies b and then a
+affine_transform operator*(const affine_transform& a, const affine_transform& b)
+{
+	affine_transform result;
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			result.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+			if (j == 3)
+				result.m[i][j] += a.m[i][3];
+		}
+	}
+	return result;
+}
+
+affine_transform affine_transform::translate(const vec3& offset)
+{
+	affine_transform t;
+	for (int i = 0; i < 3; i++)
+		t.m[i][3] = offset[i];
+	return t;
+}
+
+affine_transform affine_transform::scale(const vec3& factors)
+{
+	affine_transform t;
+	for (int i = 0; i < 3; i++)
+		t.m[i][i] = factors[i];
+	return t;
+}
+
+// Rodrigues' rotation formula as a matrix
+affine_transform affine_transform::rotate(const vec3& axis, real degrees)
+{
+	auto a = unit_vector(axis);
+	auto radians = degrees_to_radians(degrees);
+	auto s = sin(radians);
+	auto c = cos(radians);
+	auto k = 1 - c;
+
+	affine_transform t;
+	t.m[0][0] = c + a.x() * a.x() * k;
+	t.m[0][1] = a.x() * a.y() * k - a.z() * s;
+	t.m[0][2] = a.x() * a.z() * k + a.y() * s;
+	t.m[1][0] = a.y() * a.x() * k + a.z() * s;
+	t.m[1][1] = c + a.y() * a.y() * k;
+	t.m[1][2] = a.y() * a.z() * k - a.x() * s;
+	t.m[2][0] = a.z() * a.x() * k - a.y() * s;
+	t.m[2][1] = a.z() * a.y() * k + a.x() * s;
+	t.m[2][2] = c + a.z() * a.z() * k;
+	return t;
+}
+
+// Every output coordinate is a sum of products, the input error grows with the size of the matrix entries and the
+// sum itself rounds relative to the largest term
+real affine_transform::point_error(const point3& p, real p_error) const
+{
+	real error = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		real scale = fabs(m[i][0]) + fabs(m[i][1]) + fabs(m[i][2]);
+		real magnitude = fabs(m[i][0] * p.x()) + fabs(m[i][1] * p.y()) + fabs(m[i][2] * p.z()) + fabs(m[i][3]);
+		error = fmax(error, scale * p_error + rounding_error(magnitude));
+	}
+	return error;
+}
+
+// The linear part is inverted through its cofactors, the translation is undone afterwards
+bool affine_transform::inverse(affine_transform& result) const
+{
+	affine_transform inv;
+	inv.m[0][0] = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+	inv.m[0][1] = m[0][2] * m[2][1] - m[0][1] * m[2][2];
+	inv.m[0][2] = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+	inv.m[1][0] = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+	inv.m[1][1] = m[0][0] * m[2][2] - m[0][2] * m[2][0];
+	inv.m[1][2] = m[0][2] * m[1][0] - m[0][0] * m[1][2];
+	inv.m[2][0] = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+	inv.m[2][1] = m[0][1] * m[2][0] - m[0][0] * m[2][1];
+	inv.m[2][2] = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+
+	// A zero determinant, or one so small its reciprocal overflows, leaves nothing finite to divide by
+	auto determinant = m[0][0] * inv.m[0][0] + m[0][1] * inv.m[1][0] + m[0][2] * inv.m[2][0];
+	if (!std::isfinite(1 / determinant))
+		return false;
+
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			inv.m[i][j] /= determinant;
+
+	for (int i = 0; i < 3; i++)
+		inv.m[i][3] = -(inv.m[i][0] * m[0][3] + inv.m[i][1] * m[1][3] + inv.m[i][2] * m[2][3]);
+
+	result = inv;
+	return true;
+}
+
+// One placement of a shared object. The object, usually a bvh4 over a group or mesh, is built once in its own space and
+// any number of instances place it in the world, so each copy costs only its two transforms and bounds. Rays are moved
+// into the object's space and the hit moved back out, t is the same in both as the direction is not normalised
+class instance : public hittable
+{
+public:
+	// A transform that cannot be inverted is refused: the instance is left without its object and is not valid()
+	instance(shared_ptr<hittable> object, const affine_transform& object_to_world);
+
+	bool valid() const { return object != nullptr; }
+
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override;
+
+public:
+	shared_ptr<hittable> object;
+	affine_transform object_to_world;
+	// Cached inverse, every ray needs it
+	affine_transform world_to_object;
+	// What a hit's uv_scale is multiplied by in the world, the inverse of the transform's average scale
+	real uv_scale_factor;
+	aabb box;
+	bool has_box;
+};
+
+instance::instance(shared_ptr<hittable> object, const affine_transform& object_to_world)
+	: object(object), object_to_world(object_to_world), uv_scale_factor(0), has_box(false)
+{
+	if (!object_to_world.inverse(world_to_object))
+	{
+		std::cerr << "ERROR: Instance transform cannot be inverted, the instance is left out.\n";
+		this->object = nullptr;
+		return;
+	}
+
+	auto scale = std::cbrt(fabs(object_to_world.determinant()));
+	uv_scale_factor = scale > 0 ? 1 / scale : 0;
+
+	// The world bounds are the bounds of the object's transformed corners
+	aabb object_box;
+	has_box = object->bounding_box(0, 1, object_box);
+	if (!has_box)
+		return;
+
+	box = empty_box();
+	for (int i = 0; i < 8; i++)
+	{
+		point3 corner((i & 1) ? object_box.max().x() : object_box.min().x(),
+			(i & 2) ? object_box.max().y() : object_box.min().y(),
+			(i & 4) ? object_box.max().z() : object_box.min().z());
+		auto p = object_to_world.apply_point(corner);
+		box = surrounding_box(box, aabb(p, p));
+	}
+}
+
+bool instance::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	if (!object)
+		return false;
+
+	count_stat(stat_counter::instance_tests);
+
+	ray object_ray(world_to_object.apply_point(r.origin()), world_to_object.apply_vector(r.direction()), r.time());
+	if (!object->hit(object_ray, t_min, t_max, rec))
+		return false;
+
+	// Normals move by the inverse transpose, which keeps which side the ray came from
+	rec.p_error = object_to_world.point_error(rec.p, rec.p_error);
+	rec.p = object_to_world.apply_point(rec.p);
+	rec.normal = unit_vector(world_to_object.apply_transposed(rec.normal));
+	rec.uv_scale *= uv_scale_factor;
+
+	return true;
+}
+
+bool instance::bounding_box(real time0, real time1, aabb& output_box) const
+{
+	output_box = box;
+	return has_box;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "rtweekend.h"
+#include "hittable_list.h"
+#include "material.h"
+
+// Collect the emissive objects of a scene that directions can be sampled towards. Lights inside
+// other objects like boxes or instances are not found and are only reached by scattered rays
+inline hittable_list find_lights(const hittable_list& world)
+{
+	hittable_list lights;
+	for (const auto& object : world.objects)
+	{
+		auto mat = object->light_material();
+		if (mat && mat->is_emissive())
+			lights.add(object);
+	}
+	return lights;
+}
+
+// Weight of a sample taken with density pdf when another strategy could have picked it with density other_pdf
+inline real power_heuristic(real pdf, real other_pdf)
+{
+	auto a = pdf * pdf;
+	auto b = other_pdf * other_pdf;
+	return a + b > 0 ? a / (a + b) : 0.0;
+}
+
+#endif
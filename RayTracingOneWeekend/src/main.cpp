@@ -1,6 +1,6 @@
 #include "rtweekend.h"
 
-#include "colour.h"
+#include "image_writer.h"
 #include "hittable_list.h"
 #include "sphere.h"
 #include "camera.h"
@@ -8,59 +8,175 @@
 #include "moving_sphere.h"
 #include "aarect.h"
 #include "box.h"
-
+#include "instance.h"
+#include "bvh4.h"
+#include "sphere_soup.h"
+#include "triangle_mesh.h"
+#include "mesh_cache.h"
+#include "scene_arena.h"
+#include "adaptive_sampling.h"
+#include "lights.h"
+#include "render_job.h"
+#include "render_stats.h"
+#include "trace.h"
+
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
-#include <future>
-#include <thread>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Follow a path from its first hit (if any), accumulating emitted light weighted by the throughput of every bounce before it.
+// At diffuse surfaces a direction towards a light is sampled as well as the scattered ray, and light reached by either one is
+// weighted with the power heuristic so each path is counted once.
+// The path carries a ray cone for texture filtering, starting at a point at the camera and widening by spread per unit
+// of distance. Each bounce carries on from the width it had at the surface, as though every surface were a flat mirror
+static colour trace_path(
+    ray r, bool hit, hit_record rec, const colour& background, const hittable& world, const hittable_list& lights, const render_settings& settings,
+    real spread
+)
+{
+    colour radiance(0, 0, 0);
+    colour throughput(1, 1, 1);
 
-static colour ray_colour(const ray& r, const colour& background, const hittable& world, int depth) {
-    hit_record rec;
+    const bool sample_lights = settings.sample_lights && !lights.objects.empty();
+    // Whether the last bounce also sampled the lights, and where from and how likely its scattered ray was
+    bool sampled_lights = false;
+    point3 scatter_origin;
+    real scatter_pdf = 0;
+    real cone_width = 0;
 
-    if (depth <= 0)
-        return colour(0, 0, 0);
+    for (int bounce = 0; ; bounce++)
+    {
+        set_random_bounce(bounce);
+
+        if (!hit)
+        {
+            count_stat(stat_counter::paths_missed);
+            radiance += throughput * background;
+            break;
+        }
+
+        // Directions are not normalised, t is in lengths of the direction
+        rec.footprint = cone_width + spread * rec.t * r.direction().length();
+        cone_width = rec.footprint;
 
-    if (!world.hit(r, 0.001, infinity, rec))
-        return background;
+        ray scattered;
+        colour attenuation;
+        auto emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
 
-    ray scattered;
-    colour attenuation;
-    colour emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+        if (sampled_lights && (emitted.x() > 0 || emitted.y() > 0 || emitted.z() > 0))
+            emitted = emitted * power_heuristic(scatter_pdf, lights.pdf_value(scatter_origin, r.direction()));
+        radiance += throughput * emitted;
 
-    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-        return emitted;
+        if (bounce + 1 >= settings.max_depth)
+        {
+            count_stat(stat_counter::paths_depth_capped);
+            break;
+        }
+        if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
+        {
+            count_stat(stat_counter::paths_absorbed);
+            break;
+        }
+
+        sampled_lights = sample_lights && rec.mat_ptr->is_diffuse();
+        if (sampled_lights)
+        {
+            auto to_light = lights.random(rec.p);
+            auto light_pdf = lights.pdf_value(rec.p, to_light);
+            auto light_scatter_pdf = rec.mat_ptr->scattering_pdf(r, rec, to_light);
+
+            // Whatever is hit first is the light arriving from that direction, which is nothing if the light is blocked
+            hit_record light_rec;
+            if (light_pdf > 0 && light_scatter_pdf > 0)
+            {
+                count_ray(stat_counter::shadow_rays, bounce + 1);
+                if (world.hit(ray(offset_ray_origin(rec.p, rec.normal, to_light, rec.p_error), to_light, r.time()), 0, infinity, light_rec))
+                {
+                    auto weight = power_heuristic(light_pdf, light_scatter_pdf) * light_scatter_pdf / light_pdf;
+                    radiance += throughput * attenuation * light_rec.mat_ptr->emitted(light_rec.u, light_rec.v, light_rec.p) * weight;
+                }
+            }
+
+            scatter_origin = rec.p;
+            scatter_pdf = rec.mat_ptr->scattering_pdf(r, rec, scattered.direction());
+        }
 
-    return emitted + attenuation * ray_colour(scattered, background, world, depth-1);
+        throughput = throughput * attenuation;
+
+        // Russian roulette, end dim paths early and boost the ones that survive so the expected result is unchanged
+        if (bounce + 1 >= settings.rr_min_depth)
+        {
+            auto survive = fmin(0.95, fmax(throughput.x(), fmax(throughput.y(), throughput.z())));
+            if (random_double() >= survive)
+            {
+                count_stat(stat_counter::paths_roulette);
+                break;
+            }
+            throughput /= survive;
+        }
+
+        // Start the next ray just off the surface rather than ignoring hits closer than some fixed distance
+        r = ray(offset_ray_origin(rec.p, rec.normal, scattered.direction(), rec.p_error), scattered.direction(), scattered.time());
+        count_ray(stat_counter::bounce_rays, bounce + 1);
+        hit = world.hit(r, 0, infinity, rec);
+    }
+
+    return radiance;
 }
 
-static hittable_list two_spheres() {
+static colour ray_colour(
+    const ray& r, const colour& background, const hittable& world, const hittable_list& lights, const render_settings& settings, real spread
+) {
+    hit_record rec;
+
+    if (settings.max_depth <= 0)
+        return colour(0, 0, 0);
+
+    count_ray(stat_counter::camera_rays, 0);
+    bool hit = world.hit(r, 0, infinity, rec);
+    return trace_path(r, hit, rec, background, world, lights, settings, spread);
+}
+
+static hittable_list two_spheres(scene_arena& arena) {
     hittable_list objects;
 
-    auto checker = make_shared<checker_texture>(colour(0.2, 0.3, 0.1), colour(0.9, 0.9, 0.9));
+    auto checker = arena.make<checker_texture>(colour(0.2, 0.3, 0.1), colour(0.9, 0.9, 0.9));
 
-    objects.add(make_shared<sphere>(point3(0, -10, 0), 10, make_shared<lambertian>(checker)));
-    objects.add(make_shared<sphere>(point3(0, 10, 0), 10, make_shared<lambertian>(checker)));
+    objects.add(arena.make<sphere>(point3(0, -10, 0), 10, arena.make<lambertian>(checker)));
+    objects.add(arena.make<sphere>(point3(0, 10, 0), 10, arena.make<lambertian>(checker)));
 
     return objects;
 }
 
-static hittable_list two_perlin_spheres()
+static hittable_list two_perlin_spheres(scene_arena& arena)
 {
     hittable_list objects;
 
-    auto pertext = make_shared<noise_texture>(4);
+    auto pertext = arena.make<noise_texture>(4);
 
-    objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
-    objects.add(make_shared<sphere>(point3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
+    objects.add(arena.make<sphere>(point3(0, -1000, 0), 1000, arena.make<lambertian>(pertext)));
+    objects.add(arena.make<sphere>(point3(0, 2, 0), 2, arena.make<lambertian>(pertext)));
 
     return objects;
 }
 
-static hittable_list random_scene()
+static hittable_list random_scene(scene_arena& arena)
 {
     hittable_list world;
 
-    auto checker = make_shared<checker_texture>(colour(0.2, 0.3, 0.1), colour(0.9, 0.9, 0.9));
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
+    auto checker = arena.make<checker_texture>(colour(0.2, 0.3, 0.1), colour(0.9, 0.9, 0.9));
+    world.add(arena.make<sphere>(point3(0, -1000, 0), 1000, arena.make<lambertian>(checker)));
+
+    // Every sphere but the ground goes in one soup
+    auto spheres = arena.make<sphere_soup>();
 
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
@@ -73,241 +189,614 @@ static hittable_list random_scene()
                 if (choose_mat < 0.8) {
                     // diffuse
                     auto albedo = colour::random() * colour::random();
-                    sphere_material = make_shared<lambertian>(albedo);
+                    // Give the albedo a place in the arena too rather than letting lambertian put it on the heap
+                    sphere_material = arena.make<lambertian>(arena.make<solid_colour>(albedo));
                     auto centre2 = centre + vec3(0, random_double(0, .5), 0);
-                    world.add(make_shared<moving_sphere>(centre, centre2, 0.0, 1.0, 0.2, sphere_material));
+                    spheres->add(centre, centre2, 0.0, 1.0, 0.2, sphere_material);
                 }
                 else if (choose_mat < 0.95) {
                     // metal
                     auto albedo = colour::random(0.5, 1);
                     auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(centre, 0.2, sphere_material));
+                    sphere_material = arena.make<metal>(albedo, fuzz);
+                    spheres->add(centre, 0.2, sphere_material);
                 }
                 else {
                     // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(centre, 0.2, sphere_material));
+                    sphere_material = arena.make<dielectric>(1.5);
+                    spheres->add(centre, 0.2, sphere_material);
                 }
             }
         }
     }
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+    auto material1 = arena.make<dielectric>(1.5);
+    spheres->add(point3(0, 1, 0), 1.0, material1);
+
+    auto material2 = arena.make<lambertian>(colour(0.4, 0.2, 0.1));
+    spheres->add(point3(-4, 1, 0), 1.0, material2);
 
-    auto material2 = make_shared<lambertian>(colour(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+    auto material3 = arena.make<metal>(colour(0.7, 0.6, 0.5), 0.0);
+    spheres->add(point3(4, 1, 0), 1.0, material3);
 
-    auto material3 = make_shared<metal>(colour(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    spheres->build(0.0, 1.0);
+    world.add(spheres);
 
     return world;
 }
 
-static hittable_list earth()
+static hittable_list earth(scene_arena& arena)
 {
-    auto earth_texture = make_shared<image_texture>("earthmap.jpg");
-    auto earth_surface = make_shared<lambertian>(earth_texture);
-    auto globe = make_shared<sphere>(point3(0, 0, 0), 2, earth_surface);
+    auto earth_texture = arena.make<image_texture>("earthmap.jpg");
+    auto earth_surface = arena.make<lambertian>(earth_texture);
+    auto globe = arena.make<sphere>(point3(0, 0, 0), 2, earth_surface);
 
     return hittable_list(globe);
 }
 
-static hittable_list simple_light()
+static hittable_list simple_light(scene_arena& arena)
 {
     hittable_list objects;
 
-    auto pertext = make_shared<noise_texture>(4);
-    objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
-    objects.add(make_shared<sphere>(point3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
+    auto pertext = arena.make<noise_texture>(4);
+    objects.add(arena.make<sphere>(point3(0, -1000, 0), 1000, arena.make<lambertian>(pertext)));
+    objects.add(arena.make<sphere>(point3(0, 2, 0), 2, arena.make<lambertian>(pertext)));
 
-    auto difflight = make_shared<diffuse_light>(colour(4, 4, 4));
-    objects.add(make_shared<xy_rect>(3, 5, 1, 3, -2, difflight));
+    auto difflight = arena.make<diffuse_light>(colour(4, 4, 4));
+    objects.add(arena.make<xy_rect>(3, 5, 1, 3, -2, difflight));
 
     return objects;
 }
 
-static hittable_list cornell_box()
+// The walls and light of the Cornell box, with nothing inside
+static hittable_list cornell_walls(scene_arena& arena, shared_ptr<material> white)
 {
     hittable_list objects;
 
-    auto red = make_shared<lambertian>(colour(0.65, 0.05, 0.05));
-    auto white = make_shared<lambertian>(colour(0.73, 0.73, 0.73));
-    auto green = make_shared<lambertian>(colour(0.12, 0.45, 0.15));
-    auto light = make_shared<diffuse_light>(colour(15, 15, 15));
-
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<xz_rect>(213, 343, 227, 332, 554, light));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
-    
-    shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265, 0, 295));
-    objects.add(box1);
-
-    shared_ptr<hittable> box2 = make_shared<box>(point3(0, 0, 0), point3(165, 165, 165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130, 0, 65));
-    objects.add(box2);
+    auto red = arena.make<lambertian>(colour(0.65, 0.05, 0.05));
+    auto green = arena.make<lambertian>(colour(0.12, 0.45, 0.15));
+    auto light = arena.make<diffuse_light>(colour(15, 15, 15));
+
+    objects.add(arena.make<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(arena.make<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(arena.make<xz_rect>(213, 343, 227, 332, 554, light));
+    objects.add(arena.make<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(arena.make<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(arena.make<xy_rect>(0, 555, 0, 555, 555, white));
 
     return objects;
 }
 
-// Mutex to prevent pixels being written and console log output at the same time
+static hittable_list cornell_box(scene_arena& arena)
+{
+    auto white = arena.make<lambertian>(colour(0.73, 0.73, 0.73));
+    auto objects = cornell_walls(arena, white);
+
+    // Both boxes are placements of one unit cube, built once with its own BVH
+    box cube(point3(0, 0, 0), point3(1, 1, 1), white, &arena);
+    auto unit_cube = arena.make<bvh4>(cube.sides, 0.0, 1.0);
+
+    objects.add(arena.make<instance>(unit_cube, affine_transform::translate(vec3(265, 0, 295)) *
+        affine_transform::rotate_y(15) * affine_transform::scale(vec3(165, 330, 165))));
+    objects.add(arena.make<instance>(unit_cube, affine_transform::translate(vec3(130, 0, 65)) *
+        affine_transform::rotate_y(-18) * affine_transform::scale(vec3(165, 165, 165))));
+
+    return objects;
+}
+
+// A model loaded from an OBJ or binary PLY file standing in the Cornell box, scaled to fit and placed on the floor
+static hittable_list cornell_mesh(scene_arena& arena, const std::string& path)
+{
+    auto white = arena.make<lambertian>(colour(0.73, 0.73, 0.73));
+    auto objects = cornell_walls(arena, white);
+
+    // The mesh and its BVH come from the model's cache when it is up to date, otherwise they are built and cached
+    auto start = std::chrono::steady_clock::now();
+    auto mesh = arena.make<triangle_mesh>();
+    mesh->mat_ptr = white;
+    if (!load_mesh_cached(path, *mesh))
+        return objects;
+
+    std::chrono::duration<double> load_time = std::chrono::steady_clock::now() - start;
+    std::cerr << "Mesh: " << mesh->size() << " triangles, " << mesh->mesh.positions.size() << " vertices, ready in " << load_time.count() << "s\n";
+
+    aabb bounds;
+    if (!mesh->bounding_box(0, 1, bounds))
+        return objects;
+
+    vec3 extent = bounds.max() - bounds.min();
+    auto size = fmax(extent.x(), fmax(extent.y(), extent.z()));
+    auto scale = size > 0 ? 330 / size : 1;
+    point3 centre = 0.5 * (bounds.min() + bounds.max());
+
+    // A model too small or large for its scale to be inverted is left out
+    auto placed = arena.make<instance>(mesh, affine_transform::translate(vec3(278, 0, 278)) * affine_transform::rotate_y(180) *
+        affine_transform::scale(vec3(scale, scale, scale)) * affine_transform::translate(vec3(-centre.x(), -bounds.min().y(), -centre.z())));
+    if (placed->valid())
+        objects.add(placed);
+
+    return objects;
+}
+
+// A scene that can be picked by name, with the background and camera it is meant to be seen with
+struct scene_definition
+{
+    const char* name;
+    hittable_list (*build)(scene_arena& arena, const render_job& job);
+    // Whether building the scene draws random numbers, so that the seed changes it
+    bool uses_seed;
+    colour background;
+    camera_settings camera;
+};
+
+static camera_settings scene_camera(point3 lookfrom, point3 lookat, double vfov, double aperture = 0.0)
+{
+    camera_settings camera;
+    camera.lookfrom = lookfrom;
+    camera.lookat = lookat;
+    camera.vfov = vfov;
+    camera.aperture = aperture;
+    return camera;
+}
+
+static const std::vector<scene_definition>& scene_definitions()
+{
+    static const std::vector<scene_definition> scenes = {
+        { "random", [](scene_arena& arena, const render_job&) { return random_scene(arena); }, true,
+            colour(0.70, 0.80, 1.00), scene_camera(point3(13, 2, 3), point3(0, 0, 0), 20.0, 0.1) },
+        { "two_spheres", [](scene_arena& arena, const render_job&) { return two_spheres(arena); }, false,
+            colour(0.70, 0.80, 1.00), scene_camera(point3(13, 2, 3), point3(0, 0, 0), 20.0) },
+        { "two_perlin_spheres", [](scene_arena& arena, const render_job&) { return two_perlin_spheres(arena); }, true,
+            colour(0.70, 0.80, 1.00), scene_camera(point3(13, 2, 3), point3(0, 0, 0), 20.0) },
+        { "earth", [](scene_arena& arena, const render_job&) { return earth(arena); }, false,
+            colour(0.70, 0.80, 1.00), scene_camera(point3(13, 2, 3), point3(0, 0, 0), 20.0) },
+        { "simple_light", [](scene_arena& arena, const render_job&) { return simple_light(arena); }, true,
+            colour(0, 0, 0), scene_camera(point3(26, 3, 6), point3(0, 2, 0), 20.0) },
+        { "cornell_box", [](scene_arena& arena, const render_job&) { return cornell_box(arena); }, false,
+            colour(0, 0, 0), scene_camera(point3(278, 278, -800), point3(278, 278, 0), 40.0) },
+        { "cornell_mesh", [](scene_arena& arena, const render_job& job) { return cornell_mesh(arena, job.mesh_path); }, false,
+            colour(0, 0, 0), scene_camera(point3(278, 278, -800), point3(278, 278, 0), 40.0) },
+    };
+    return scenes;
+}
+
+// Find a scene by its name or its number, counting from 1. Returns nullptr if there is no such scene
+static const scene_definition* find_scene(const std::string& name)
+{
+    const auto& scenes = scene_definitions();
+    for (size_t i = 0; i < scenes.size(); i++)
+    {
+        if (name == scenes[i].name || name == std::to_string(i + 1))
+            return &scenes[i];
+    }
+    return nullptr;
+}
+
+// Jobs with the same key render the same built scene
+static std::string scene_key(const scene_definition& definition, const render_job& job)
+{
+    std::string key = definition.name;
+    if (definition.uses_seed)
+        key += " seed " + std::to_string(job.seed);
+    if (std::string(definition.name) == "cornell_mesh")
+        key += " mesh " + job.mesh_path;
+    return key;
+}
+
+// A built scene with its BVH and lights, kept between jobs that share it. Every object in it is allocated
+// from the arena so the arena has to outlive the world and everything built from it
+struct loaded_scene
+{
+    scene_arena arena;
+    hittable_list world;
+    shared_ptr<bvh4> world_bvh;
+    hittable_list lights;
+    const scene_definition* definition = nullptr;
+};
+
+static std::unique_ptr<loaded_scene> load_scene(const scene_definition& definition, const render_job& job)
+{
+    std::unique_ptr<loaded_scene> scene(new loaded_scene());
+    scene->definition = &definition;
+
+    set_random_seed(job.seed);
+    {
+        trace_scope trace("Build scene", "scene");
+        scene->world = definition.build(scene->arena, job);
+    }
+    scene->arena.print_stats(std::cerr);
+
+    // Trace every scene through a BVH rather than the linear scan in hittable_list
+    {
+        trace_scope trace("Build BVH", "bvh", "objects", static_cast<int64_t>(scene->world.objects.size()));
+        scene->world_bvh = scene->arena.make<bvh4>(scene->world, 0.0, 1.0);
+    }
+    std::cerr << "BVH: " << scene->world_bvh->nodes.size() << " nodes, SAH cost " << scene->world_bvh->sah_cost << '\n';
+
+    scene->lights = find_lights(scene->world);
+    std::cerr << "Lights: " << scene->lights.objects.size() << '\n';
+
+    return scene;
+}
+
+// Held by the worker printing progress, the others skip printing rather than wait for it
 static std::mutex output_mutex;
 
-// Calulate a row of pixels
+// True if a pixel has taken enough samples to stop, variance_floor is the pooled variance of its tile
+static bool pixel_done(const pixel_estimate& estimate, double variance_floor, const render_settings& settings)
+{
+    if (estimate.count >= settings.samples_per_pixel)
+        return true;
+
+    return settings.adaptive_threshold > 0 && estimate.count >= settings.min_samples_per_pixel &&
+        estimate.converged(settings.adaptive_threshold, variance_floor);
+}
+
+// Samples every pixel takes before adaptive sampling decides whether to stop
+static int first_pass_samples(const render_settings& settings)
+{
+    return settings.adaptive_threshold > 0 ? std::min(settings.min_samples_per_pixel, settings.samples_per_pixel) : settings.samples_per_pixel;
+}
+
+// Calculate every pixel in a tile and store the averaged samples and sample counts in the frame buffer.
+// Every pixel first takes the minimum number of samples, then keeps sampling until it is done
 static void calculate_pixels(
-    std::vector<std::vector<std::tuple<int, int, colour>>>& rows, const hittable_list& world, const colour& background, camera& cam,
-    int image_width, int image_height, int samples_per_pixel, int max_depth, int j
+    std::vector<colour>& pixels, std::vector<int>& sample_counts, const bvh4& world, const hittable_list& lights, const colour& background,
+    const camera& cam, const render_settings& settings, const tile& t
 )
 {
-    std::vector<std::tuple<int, int, colour>> current_row;
-    for (int i = 0; i < image_width; ++i)
+    const int image_width = settings.image_width;
+    const int image_height = settings.image_height;
+    const int tile_width = t.x1 - t.x0;
+    const real spread = settings.mip_mapping ? cam.pixel_spread(image_height) : 0;
+
+    std::vector<pixel_estimate> estimates((t.x1 - t.x0) * (t.y1 - t.y0));
+
+    auto sample_pixel = [&](int i, int j, pixel_estimate& estimate) {
+        begin_random_sample(static_cast<uint64_t>(j) * image_width + i, estimate.count);
+        auto u = ((i + random_double()) / (image_width - 1));
+        auto v = ((j + random_double()) / (image_height - 1));
+        ray r = cam.get_ray(u, v);
+        estimate.add(ray_colour(r, background, world, lights, settings, spread));
+    };
+
+    const int first_samples = first_pass_samples(settings);
+    for (int pass = 0; pass < 2; ++pass)
     {
-        colour pixel_colour(0, 0, 0);
-        for (int s = 0; s < samples_per_pixel; ++s)
+        auto variance_floor = pass > 0 ? pooled_variance(estimates) : 0.0;
+
+        for (int j = t.y0; j < t.y1; ++j)
         {
-            auto u = ((i + random_double()) / (image_width - 1));
-            auto v = ((j + random_double()) / (image_height - 1));
-            ray r = cam.get_ray(u, v);
-            pixel_colour += ray_colour(r, background, world, max_depth);
+            for (int i = t.x0; i < t.x1; ++i)
+            {
+                auto& estimate = estimates[(j - t.y0) * tile_width + (i - t.x0)];
+                if (pass == 0)
+                {
+                    while (estimate.count < first_samples)
+                        sample_pixel(i, j, estimate);
+                }
+                else
+                {
+                    while (!pixel_done(estimate, variance_floor, settings))
+                        sample_pixel(i, j, estimate);
+
+                    pixels[j * image_width + i] = estimate.average();
+                    sample_counts[j * image_width + i] = estimate.count;
+                }
+            }
         }
-        current_row.push_back(std::make_tuple(j, i, pixel_colour));
     }
-    std::lock_guard<std::mutex> lock(output_mutex);
-    rows.push_back(current_row);
-    std::cerr << "Scanline: " << j << std::endl;
 }
 
-// Wakes the conditional variable when we have finished calculating all rows
-static void wake_main_thread(std::vector<std::vector<std::tuple<int, int, colour>>>& rows, std::condition_variable& cv, int image_height)
+// Calculate a tile in square blocks of pixels, tracing the camera rays of each block as one packet and every bounce after that on its own.
+// Sampling runs in the same two passes as calculate_pixels, pixels that finish early drop out of their packet
+static void calculate_pixels_packets(
+    std::vector<colour>& pixels, std::vector<int>& sample_counts, const bvh4& world, const hittable_list& lights, const colour& background,
+    const camera& cam, const render_settings& settings, const tile& t
+)
 {
-    using namespace std::chrono_literals;
-    while (rows.size() != image_height)
+    const int image_width = settings.image_width;
+    const int image_height = settings.image_height;
+    const int tile_width = t.x1 - t.x0;
+    const real spread = settings.mip_mapping ? cam.pixel_spread(image_height) : 0;
+
+    const int lanes = bvh4::packet_size;
+    const int block = 4;
+    static_assert(block * block == lanes, "Pixel blocks should fill a packet");
+
+    std::vector<pixel_estimate> estimates((t.x1 - t.x0) * (t.y1 - t.y0));
+
+    // Take one more sample for every pixel of a block in active, returns the pixels that are not done yet
+    auto sample_block = [&](int i, int j, int active, double variance_floor) {
+        ray rays[lanes];
+        hit_record recs[lanes];
+        int first = -1;
+        for (int k = 0; k < lanes; k++)
+        {
+            if (!(active & (1 << k)))
+                continue;
+
+            int x = i + k % block, y = j + k / block;
+            begin_random_sample(static_cast<uint64_t>(y) * image_width + x, estimates[(y - t.y0) * tile_width + (x - t.x0)].count);
+            auto u = ((x + random_double()) / (image_width - 1));
+            auto v = ((y + random_double()) / (image_height - 1));
+            rays[k] = cam.get_ray(u, v);
+            count_ray(stat_counter::camera_rays, 0);
+            if (first < 0)
+                first = k;
+        }
+
+        // Idle lanes still go through the packet's bounds tests, give them a copy of a real ray
+        for (int k = 0; k < lanes; k++)
+        {
+            if (!(active & (1 << k)))
+                rays[k] = rays[first];
+        }
+
+        real closest[lanes];
+        for (int k = 0; k < lanes; k++)
+            closest[k] = infinity;
+
+        int hits = world.hit_packet(rays, active, 0, closest, recs);
+
+        for (int k = 0; k < lanes; k++)
+        {
+            if (!(active & (1 << k)))
+                continue;
+
+            int x = i + k % block, y = j + k / block;
+            auto& estimate = estimates[(y - t.y0) * tile_width + (x - t.x0)];
+            begin_random_sample(static_cast<uint64_t>(y) * image_width + x, estimate.count);
+            estimate.add(trace_path(rays[k], (hits >> k) & 1, recs[k], background, world, lights, settings, spread));
+            if (pixel_done(estimate, variance_floor, settings))
+                active &= ~(1 << k);
+        }
+
+        return active;
+    };
+
+    const int first_samples = first_pass_samples(settings);
+    for (int pass = 0; pass < 2; ++pass)
     {
-        std::this_thread::sleep_for(1s);
-    }
+        auto variance_floor = pass > 0 ? pooled_variance(estimates) : 0.0;
 
-    cv.notify_all();
+        for (int j = t.y0; j < t.y1; j += block)
+        {
+            for (int i = t.x0; i < t.x1; i += block)
+            {
+                // Blocks on the edge of a tile that does not divide evenly have lanes with no pixel
+                int pixel_mask = 0;
+                for (int k = 0; k < lanes; k++)
+                {
+                    if (i + k % block < t.x1 && j + k / block < t.y1)
+                        pixel_mask |= 1 << k;
+                }
+
+                if (pass == 0)
+                {
+                    for (int s = 0; s < first_samples; ++s)
+                        sample_block(i, j, pixel_mask, 0.0);
+                    continue;
+                }
+
+                // Pixels can already be done after the first pass
+                int active = 0;
+                for (int k = 0; k < lanes; k++)
+                {
+                    if ((pixel_mask & (1 << k)) && !pixel_done(estimates[(j + k / block - t.y0) * tile_width + (i + k % block - t.x0)], variance_floor, settings))
+                        active |= 1 << k;
+                }
+
+                while (active)
+                    active = sample_block(i, j, active, variance_floor);
+
+                for (int k = 0; k < lanes; k++)
+                {
+                    if (!(pixel_mask & (1 << k)))
+                        continue;
+
+                    int x = i + k % block, y = j + k / block;
+                    const auto& estimate = estimates[(y - t.y0) * tile_width + (x - t.x0)];
+                    pixels[y * image_width + x] = estimate.average();
+                    sample_counts[y * image_width + x] = estimate.count;
+                }
+            }
+        }
+    }
 }
 
-int main()
+// Render one job of a scene that is already built and write its images
+static bool render(const render_job& job, const loaded_scene& scene, tile_scheduler& scheduler)
 {
-    // Image
-    const double aspect_ratio = 1.0;
-    const int image_width = 600;
-    const int samples_per_pixel = 200;
-    const int max_depth = 50;
+    const auto& settings = job.settings;
+    const int image_width = settings.image_width;
+    const int image_height = settings.image_height;
+    const auto& world = *scene.world_bvh;
+    const auto& background = scene.definition->background;
+
+    trace_scope trace("Render", "render", "width", image_width, "height", image_height);
+    set_random_seed(job.seed);
+
+    auto view = job.camera_for(scene.definition->camera);
+    auto aspect_ratio = static_cast<double>(image_width) / image_height;
+    camera cam(view.lookfrom, view.lookat, view.vup, view.vfov, aspect_ratio, view.aperture, view.focus_distance, 0.0, 1.0);
+
+    std::vector<colour> pixels(image_width * image_height);
+    std::vector<int> sample_counts(image_width * image_height);
+
+    int tiles_x = (image_width + job.tile_size - 1) / job.tile_size;
+    int tiles_y = (image_height + job.tile_size - 1) / job.tile_size;
+    const int tile_count = tiles_x * tiles_y;
+    std::atomic<int> tiles_done(0);
+
+    // Each worker moves its thread's counts into its own entry after every tile, they are summed once the render is done
+    std::vector<render_stats> worker_stats(scheduler.thread_count());
+    std::vector<double> tile_seconds(tile_count);
+    auto render_start = std::chrono::steady_clock::now();
+
+    scheduler.run(image_width, image_height, job.tile_size, [&](const tile& t, int worker) {
+        trace_scope trace("Tile", "render", "x", t.x0, "y", t.y0);
+        auto& stats = thread_render_stats();
+        stats.reset();
+        auto counters = thread_perf_counters();
+        perf_sample counters_start;
+        if (counters)
+            counters->read(counters_start);
+        auto tile_start = std::chrono::steady_clock::now();
+
+        if (settings.packet_camera_rays && settings.max_depth > 0)
+            calculate_pixels_packets(pixels, sample_counts, world, scene.lights, background, cam, settings, t);
+        else
+            calculate_pixels(pixels, sample_counts, world, scene.lights, background, cam, settings, t);
+
+        std::chrono::duration<double> tile_time = std::chrono::steady_clock::now() - tile_start;
+        perf_sample counters_end;
+        if (counters && counters->read(counters_end))
+            stats.hardware = counters_end.since(counters_start);
+        tile_seconds[(t.y0 / job.tile_size) * tiles_x + t.x0 / job.tile_size] = tile_time.count();
+        worker_stats[worker].add(stats);
+
+        auto done = ++tiles_done;
+        if (output_mutex.try_lock())
+        {
+            std::cerr << "\rTiles remaining: " << tile_count - done << ' ' << std::flush;
+            output_mutex.unlock();
+        }
+    });
 
-    // World
-    hittable_list world;
+    std::chrono::duration<double> render_time = std::chrono::steady_clock::now() - render_start;
 
-    point3 lookfrom;
-    point3 lookat;
-    double vfov = 40.0;
-    double aperture = 0.0;
-    colour background(0, 0, 0);
-
-    switch (0) {
-    case 1:
-        world = random_scene();
-        background = colour(0.70, 0.80, 1.00);
-        lookfrom = point3(13, 2, 3);
-        lookat = point3(0, 0, 0);
-        vfov = 20.0;
-        aperture = 0.1;
-        break;
-
-    case 2:
-        world = two_spheres();
-        background = colour(0.70, 0.80, 1.00);
-        lookfrom = point3(13, 2, 3);
-        lookat = point3(0, 0, 0);
-        vfov = 20.0;
-        break;
-
-    case 3:
-        world = two_perlin_spheres();
-        background = colour(0.70, 0.80, 1.00);
-        lookfrom = point3(13, 2, 3);
-        lookat = point3(0, 0, 0);
-        vfov = 20.0;
-        break;
-    
-    case 4:
-        world = earth();
-        background = colour(0.70, 0.80, 1.00);
-        lookfrom = point3(13, 2, 3);
-        lookat = point3(0, 0, 0);
-        vfov = 20.0;
-        break;
-    
-    case 5:
-        world = simple_light();
-        background = colour(0, 0, 0);
-        lookfrom = point3(26, 3, 6);
-        lookat = point3(0, 2, 0);
-        vfov = 20.0;
-        break;
-    default:
-    case 6:
-        world = cornell_box();
-        background = colour(0, 0, 0);
-        lookfrom = point3(278, 278, -800);
-        lookat = point3(278, 278, 0);
-        vfov = 40.0;
-        break;
-    }
+    long long total_samples = 0;
+    for (auto count : sample_counts)
+        total_samples += count;
+    std::cerr << "\rTiles remaining: 0 \nSamples: " << total_samples << ", " << static_cast<double>(total_samples) / sample_counts.size() << " per pixel\n";
 
-    // Camera
+    render_stats total_stats;
+    for (const auto& stats : worker_stats)
+        total_stats.add(stats);
+    total_stats.print(std::cerr, render_time.count());
 
-    vec3 vup(0, 1, 0);
-    double dist_to_focus = 10.0;
-    int image_height = static_cast<int>(image_width / aspect_ratio);
+    // Write the pixels to the output file, they already hold the average of their samples
+    if (!write_image(job.output_path, job.format(), pixels, image_width, image_height, 1))
+        return false;
 
-    camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
+    if (!job.heatmap_path.empty() && !write_image(job.heatmap_path, image_format_from_path(job.heatmap_path),
+        sample_heatmap(sample_counts, settings.min_samples_per_pixel, settings.samples_per_pixel), image_width, image_height, 1))
+        return false;
 
-    // Render
-    std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-    std::vector<std::vector<std::tuple<int, int, colour>>> rows;
+    return job.tile_heatmap_path.empty() || write_image(job.tile_heatmap_path, image_format_from_path(job.tile_heatmap_path),
+        tile_heatmap(tile_seconds, job.tile_size, image_width, image_height), image_width, image_height, 1);
+}
 
-    std::vector<std::future<void>> future;
-    std::mutex threads;
-    std::condition_variable cv;
+int main(int argc, char* argv[])
+{
+    // Threads and the job file apply to the whole run. Every other option describes the job, or with a job file
+    // the defaults every job in it starts from
+    int thread_count = 0;
+    std::string job_path;
+    std::string trace_path;
+    bool count_hardware = false;
+    render_job base;
+
+    std::vector<std::string> args(argv + 1, argv + argc);
+    for (size_t a = 0; a < args.size(); a++)
+    {
+        if (args[a] == "-h" || args[a] == "--help")
+        {
+            print_usage(std::cout, argv[0]);
+            return 0;
+        }
+        else if (args[a] == "--threads" && a + 1 < args.size())
+        {
+            if (!parse_option_value(args[++a], thread_count) || thread_count < 0)
+            {
+                std::cerr << "ERROR: Bad value '" << args[a] << "' for --threads.\n";
+                return 1;
+            }
+        }
+        else if (args[a] == "--jobs" && a + 1 < args.size())
+        {
+            job_path = args[++a];
+        }
+        else if (args[a] == "--trace" && a + 1 < args.size())
+        {
+            trace_path = args[++a];
+        }
+        else if (args[a] == "--perf-counters")
+        {
+            count_hardware = true;
+        }
+        else if (!parse_job_option(args, a, base))
+        {
+            std::cerr << "Run with --help for the options.\n";
+            return 1;
+        }
+    }
 
-    // Async call all rows to be calculated
-    for (int j = image_height - 1; j >= 0; --j)
+    if (!trace_path.empty())
     {
-        future.push_back(std::async(std::launch::async, std::ref(calculate_pixels),
-            std::ref(rows), std::ref(world), std::ref(background), std::ref(cam),
-            image_width, image_height, samples_per_pixel, max_depth, j)
-        );
+        start_trace();
+        name_trace_thread("main");
     }
-    // Add the wake main thread and wait until it does
-    future.push_back(std::async(std::launch::async, std::ref(wake_main_thread),
-        std::ref(rows), std::ref(cv), image_height)
-    );
-    std::unique_lock<std::mutex> lck(threads);
-    cv.wait(lck);
-
-    // Sort the calculated rows based on j coord
-    std::sort(rows.begin(), rows.end(), [](const std::vector<std::tuple<int, int, colour>>& a, const std::vector<std::tuple<int, int, colour>>& b) {
-        return std::get<0>(a.front()) < std::get<0>(b.front());
-    });
 
-    // Write the pixels to the output file
-    for (int j = image_height - 1; j >= 0; --j)
+    if (count_hardware)
+        enable_perf_counters();
+
+    std::vector<render_job> jobs;
+    if (job_path.empty())
+        jobs.push_back(base);
+    else if (!read_job_file(job_path, base, jobs))
+        return 1;
+
+    // Check every job before rendering any, and note the last job each scene is needed for
+    std::map<std::string, size_t> last_use;
+    for (size_t i = 0; i < jobs.size(); i++)
     {
-        for (int i = 0; i < image_width; i++)
+        auto definition = find_scene(jobs[i].scene);
+        if (!definition)
+        {
+            std::cerr << "ERROR: Unknown scene '" << jobs[i].scene << "'.\n";
+            return 1;
+        }
+        if (jobs.size() > 1 && jobs[i].output_path == "-")
         {
-            write_colour(std::cout, std::get<2>(rows.at(j).at(i)), samples_per_pixel);
+            std::cerr << "ERROR: Every job in a job file needs its own output path.\n";
+            return 1;
         }
+        last_use[scene_key(*definition, jobs[i])] = i;
     }
 
-    std::cerr << "\nDone.\n";
-}
\ No newline at end of file
+    // The threads persist from one job to the next
+    tile_scheduler scheduler(thread_count);
+    std::map<std::string, std::unique_ptr<loaded_scene>> scenes;
+    bool ok = true;
+
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        const auto& job = jobs[i];
+        const auto& definition = *find_scene(job.scene);
+        auto key = scene_key(definition, job);
+
+        if (jobs.size() > 1)
+            std::cerr << "Job " << i + 1 << " of " << jobs.size() << ": " << key << " to '" << job.output_path << "'\n";
+
+        auto& scene = scenes[key];
+        if (!scene)
+            scene = load_scene(definition, job);
+
+        ok = render(job, *scene, scheduler) && ok;
+
+        // Free the scene once no later job needs it
+        if (last_use[key] == i)
+            scenes.erase(key);
+    }
+
+    // The workers are idle between jobs, so their buffers can be read now
+    if (!trace_path.empty())
+        ok = write_trace(trace_path) && ok;
+
+    if (!ok)
+        return 1;
+
+    std::cerr << "Done.\n";
+}
@@ -2,6 +2,7 @@
 #define MATERIAL_H
 
 #include "rtweekend.h"
+#include "render_stats.h"
 #include "hittable_list.h"
 #include "texture.h"
 
@@ -12,7 +13,14 @@ class material
 {
 public:
 	virtual bool scatter(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered) const = 0;
-	virtual colour emitted(double u, double v, const point3& p) const { return colour(0, 0, 0); }
+	virtual colour emitted(real u, real v, const point3& p) const { return colour(0, 0, 0); }
+
+	// Materials that can say how likely scatter is to pick any direction are diffuse, and are lit by sampling lights directly as well
+	virtual bool is_diffuse() const { return false; }
+	virtual real scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const { return 0.0; }
+	virtual bool is_emissive() const { return false; }
+	// False when neither scattering nor emission looks at the hit's u and v
+	virtual bool uses_uv() const { return true; }
 };
 
 // A type of material like a solid matte object
@@ -25,6 +33,7 @@ public:
 	// Determines whether ray will scatter
 	virtual bool scatter(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered) const override 
 	{
+		count_stat(stat_counter::lambertian_scatters);
 		auto scattered_direction = rec.normal + random_unit_vector();
 
 		// Catch edge case where scatter direction is 0
@@ -32,10 +41,20 @@ public:
 			scattered_direction = rec.normal;
 
 		scattered = ray(rec.p, scattered_direction, r_in.time());
-		attenuation = albedo->value(rec.u, rec.v, rec.p);
+		attenuation = albedo->value(rec.u, rec.v, rec.p, rec.uv_footprint());
 		return true;
 	}
 
+	virtual bool is_diffuse() const override { return true; }
+	virtual bool uses_uv() const override { return albedo->uses_uv(); }
+
+	// The normal plus a random unit vector has a cosine distribution
+	virtual real scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override
+	{
+		auto cosine = dot(rec.normal, unit_vector(direction));
+		return cosine < 0 ? 0 : cosine / pi;
+	}
+
 public:
 	shared_ptr<texture> albedo;
 };
@@ -44,36 +63,40 @@ public:
 class metal : public material
 {
 public:
-	metal(const colour& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+	metal(const colour& a, real f) : albedo(a), fuzz(f < 1 ? f : 1) {}
 
 	// Determines whether ray will scatter
 	virtual bool scatter(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered) const override
 	{
+		count_stat(stat_counter::metal_scatters);
 		vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
 		scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
 		attenuation = albedo;
 		return (dot(scattered.direction(), rec.normal) > 0);
 	}
 
+	virtual bool uses_uv() const override { return false; }
+
 public:
 	colour albedo;
-	double fuzz;
+	real fuzz;
 };
 
 // A type of material like glass
 class dielectric : public material
 {
 public:
-	dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+	dielectric(real index_of_refraction) : ir(index_of_refraction) {}
 
 	virtual bool scatter(const ray& r_in, const hit_record& rec, colour& attenuation, ray& scattered) const override
 	{
+		count_stat(stat_counter::dielectric_scatters);
 		attenuation = colour(1.0, 1.0, 1.0);
-		double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
+		real refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
 
 		vec3 unit_direction = unit_vector(r_in.direction());
-		double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
-		double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+		real cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
+		real sin_theta = sqrt(1.0 - cos_theta * cos_theta);
 
 		bool cannot_refract = refraction_ratio * sin_theta > 1.0;
 		vec3 direction;
@@ -88,11 +111,13 @@ public:
 		return true;
 	}
 
+	virtual bool uses_uv() const override { return false; }
+
 public:
-	double ir;
+	real ir;
 
 private:
-	static double reflectance(double cosine, double ref_index)
+	static real reflectance(real cosine, real ref_index)
 	{
 		auto r0 = (1 - ref_index) / (1 + ref_index);
 		r0 = r0 * r0;
@@ -107,12 +132,19 @@ public:
 	diffuse_light(shared_ptr<texture> a) : emit(a) {}
 	diffuse_light(colour c) : emit(make_shared<solid_colour>(c)) {}
 
-	virtual bool scatter(const ray& r_in, const hit_record& rec, colour& attentuation, ray& scattered) const override { return false; }
-	virtual colour emitted(double u, double v, const point3& p) const override
+	virtual bool scatter(const ray& r_in, const hit_record& rec, colour& attentuation, ray& scattered) const override
+	{
+		count_stat(stat_counter::light_scatters);
+		return false;
+	}
+	virtual colour emitted(real u, real v, const point3& p) const override
 	{
 		return emit->value(u, v, p);
 	}
 
+	virtual bool is_emissive() const override { return true; }
+	virtual bool uses_uv() const override { return emit->uses_uv(); }
+
 public:
 	shared_ptr<texture> emit;
 };
@@ -0,0 +1,281 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include "rtweekend.h"
+#include "triangle_mesh.h"
+#include "mesh_loader.h"
+#include "trace.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// A built triangle_mesh saved as a binary file: a header, then every array of the mesh and its BVH stored as raw bytes
+// at 64 byte aligned offsets. Loading one is a bulk copy of each array out of the mapped file, with no parsing and no
+// build. The copy lets the mesh own its arrays like a built one, so the mapping can be closed once it is loaded. The
+// header records a hash of the model the mesh was loaded from, so a cache of a model that has since changed is
+// rebuilt, and the sizes of the types written so a cache from a build with a different precision or vec3 is too
+struct mesh_cache_section
+{
+	uint64_t offset;
+	uint64_t count;
+};
+
+struct mesh_cache_header
+{
+	enum section_index
+	{
+		positions, normals, uvs, indices,
+		v0_x, v0_y, v0_z, e1_x, e1_y, e1_z, e2_x, e2_y, e2_z,
+		nodes,
+		section_count
+	};
+
+	char magic[8];
+	// Bumped whenever the layout of the file or of the mesh changes
+	uint32_t version;
+	uint32_t real_size;
+	uint32_t vec3_size;
+	uint32_t node_size;
+	uint32_t leaf_size;
+	uint32_t pad;
+	uint64_t source_hash;
+	double box_min[3];
+	double box_max[3];
+	double sah_cost;
+	mesh_cache_section sections[section_count];
+
+	static const uint32_t current_version = 1;
+
+	// The header this build of the renderer writes for a model with the given hash
+	static mesh_cache_header expected(uint64_t source_hash)
+	{
+		mesh_cache_header header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, "RTMESH\0\0", 8);
+		header.version = current_version;
+		header.real_size = sizeof(real);
+		header.vec3_size = sizeof(vec3);
+		header.node_size = sizeof(bvh4_node);
+		header.leaf_size = triangle_mesh::leaf_size;
+		header.source_hash = source_hash;
+		return header;
+	}
+
+	// True if a cache with this header was written for the same model by a compatible build
+	bool matches(const mesh_cache_header& other) const
+	{
+		return memcmp(magic, other.magic, 8) == 0 && version == other.version && real_size == other.real_size &&
+			vec3_size == other.vec3_size && node_size == other.node_size && leaf_size == other.leaf_size && source_hash == other.source_hash;
+	}
+};
+
+// Hash a block of bytes. Four independent lanes keep the multiplies of neighbouring words from waiting on each other
+inline uint64_t hash_bytes(const char* data, size_t size)
+{
+	uint64_t lanes[4] = { 1, 2, 3, 4 };
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		for (int lane = 0; lane < 4; lane++)
+		{
+			uint64_t word;
+			memcpy(&word, data + i + 8 * lane, 8);
+			lanes[lane] = hash_uint64(lanes[lane] ^ word);
+		}
+	}
+
+	uint64_t hash = hash_uint64(size);
+	for (auto lane : lanes)
+		hash = hash_uint64(hash ^ lane);
+	for (; i < size; i++)
+		hash = hash_uint64(hash ^ static_cast<unsigned char>(data[i]));
+	return hash;
+}
+
+// Hash a model file's contents, returns false if it cannot be read
+inline bool hash_file(const std::string& path, uint64_t& hash)
+{
+	trace_scope trace("Hash model", "mesh");
+	mapped_file file;
+	if (!file.open(path))
+		return false;
+
+	hash = hash_bytes(file.data(), file.size());
+	return true;
+}
+
+template <typename T>
+void write_cache_section(std::ofstream& out, const std::vector<T>& values, mesh_cache_section& section)
+{
+	static const char zeros[64] = {};
+	auto position = static_cast<uint64_t>(out.tellp());
+	out.write(zeros, static_cast<std::streamsize>((64 - position % 64) % 64));
+
+	section.offset = static_cast<uint64_t>(out.tellp());
+	section.count = values.size();
+	out.write(reinterpret_cast<const char*>(values.data()), static_cast<std::streamsize>(values.size() * sizeof(T)));
+}
+
+// Copy one array out of a mapped cache, returns false if it lies outside the file
+template <typename T>
+bool read_cache_section(const mapped_file& file, const mesh_cache_section& section, std::vector<T>& values)
+{
+	if (section.offset > file.size() || section.count > (file.size() - section.offset) / sizeof(T))
+		return false;
+
+	values.resize(static_cast<size_t>(section.count));
+	if (!values.empty())
+		memcpy(values.data(), file.data() + section.offset, values.size() * sizeof(T));
+	return true;
+}
+
+// Write a built mesh to path. The file is written under a temporary name and renamed into place, so a run that is
+// stopped part way never leaves a broken cache behind
+inline bool save_mesh_cache(const std::string& path, const triangle_mesh& mesh, uint64_t source_hash)
+{
+	trace_scope trace("Write mesh cache", "mesh");
+	auto temporary = path + ".tmp";
+	std::ofstream out(temporary, std::ios::binary);
+	if (!out)
+	{
+		std::cerr << "ERROR: Could not write mesh cache '" << temporary << "'.\n";
+		return false;
+	}
+
+	auto header = mesh_cache_header::expected(source_hash);
+	for (int a = 0; a < 3; a++)
+	{
+		header.box_min[a] = mesh.box.min()[a];
+		header.box_max[a] = mesh.box.max()[a];
+	}
+	header.sah_cost = mesh.sah_cost;
+
+	// Leave room for the header, it is written once the sections' offsets are known
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	using section = mesh_cache_header::section_index;
+	write_cache_section(out, mesh.mesh.positions, header.sections[section::positions]);
+	write_cache_section(out, mesh.mesh.normals, header.sections[section::normals]);
+	write_cache_section(out, mesh.mesh.uvs, header.sections[section::uvs]);
+	write_cache_section(out, mesh.mesh.indices, header.sections[section::indices]);
+	write_cache_section(out, mesh.v0_x, header.sections[section::v0_x]);
+	write_cache_section(out, mesh.v0_y, header.sections[section::v0_y]);
+	write_cache_section(out, mesh.v0_z, header.sections[section::v0_z]);
+	write_cache_section(out, mesh.e1_x, header.sections[section::e1_x]);
+	write_cache_section(out, mesh.e1_y, header.sections[section::e1_y]);
+	write_cache_section(out, mesh.e1_z, header.sections[section::e1_z]);
+	write_cache_section(out, mesh.e2_x, header.sections[section::e2_x]);
+	write_cache_section(out, mesh.e2_y, header.sections[section::e2_y]);
+	write_cache_section(out, mesh.e2_z, header.sections[section::e2_z]);
+	write_cache_section(out, mesh.nodes, header.sections[section::nodes]);
+
+	out.seekp(0);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.close();
+
+	if (!out)
+	{
+		std::cerr << "ERROR: Could not write mesh cache '" << temporary << "'.\n";
+		std::remove(temporary.c_str());
+		return false;
+	}
+
+	// Renaming over an existing file fails on Windows
+	std::remove(path.c_str());
+	if (std::rename(temporary.c_str(), path.c_str()) != 0)
+	{
+		std::cerr << "ERROR: Could not move mesh cache into place at '" << path << "'.\n";
+		std::remove(temporary.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Fill mesh from the cache at path if it exists and was made from a model with the given hash. The mesh's material
+// is left alone. Returns false, leaving mesh untouched, if the cache is missing, stale or damaged
+inline bool load_mesh_cache(const std::string& path, uint64_t source_hash, triangle_mesh& mesh)
+{
+	trace_scope trace("Load mesh cache", "mesh");
+	if (!std::ifstream(path, std::ios::binary))
+		return false;
+
+	mapped_file file;
+	if (!file.open(path))
+		return false;
+
+	mesh_cache_header header;
+	auto expected = mesh_cache_header::expected(source_hash);
+	if (file.size() < sizeof(header))
+		return false;
+	memcpy(&header, file.data(), sizeof(header));
+	if (!expected.matches(header))
+		return false;
+
+	using section = mesh_cache_header::section_index;
+	mesh_data data;
+	std::vector<float> values[9];
+	std::vector<bvh4_node> nodes;
+	bool ok = read_cache_section(file, header.sections[section::positions], data.positions) &&
+		read_cache_section(file, header.sections[section::normals], data.normals) &&
+		read_cache_section(file, header.sections[section::uvs], data.uvs) &&
+		read_cache_section(file, header.sections[section::indices], data.indices) &&
+		read_cache_section(file, header.sections[section::nodes], nodes);
+	for (int i = 0; i < 9; i++)
+		ok = ok && read_cache_section(file, header.sections[section::v0_x + i], values[i]);
+
+	// Every float array holds one entry per triangle plus a leaf of padding
+	for (const auto& v : values)
+		ok = ok && v.size() == data.triangle_count() + triangle_mesh::leaf_size;
+	if (!ok || nodes.empty() || !data.validate() || !bvh4::validate(nodes, data.triangle_count()))
+		return false;
+
+	mesh.mesh = std::move(data);
+	mesh.nodes = std::move(nodes);
+	std::vector<float>* arrays[9] = { &mesh.v0_x, &mesh.v0_y, &mesh.v0_z, &mesh.e1_x, &mesh.e1_y, &mesh.e1_z, &mesh.e2_x, &mesh.e2_y, &mesh.e2_z };
+	for (int i = 0; i < 9; i++)
+		arrays[i]->swap(values[i]);
+	mesh.box = aabb(point3(header.box_min[0], header.box_min[1], header.box_min[2]), point3(header.box_max[0], header.box_max[1], header.box_max[2]));
+	mesh.sah_cost = header.sah_cost;
+	return true;
+}
+
+// Where the cache of a model is kept, next to the model
+inline std::string mesh_cache_path(const std::string& model_path)
+{
+	return model_path + ".rtcache";
+}
+
+// Fill mesh from a model file, through its cache when that is up to date. Otherwise the model is loaded and built
+// and the cache written for the next run
+inline bool load_mesh_cached(const std::string& path, triangle_mesh& mesh)
+{
+	uint64_t hash;
+	if (!hash_file(path, hash))
+		return false;
+
+	auto cache_path = mesh_cache_path(path);
+	if (load_mesh_cache(cache_path, hash, mesh))
+	{
+		std::cerr << "Mesh cache: loaded '" << cache_path << "'\n";
+		return true;
+	}
+
+	mesh_data data;
+	if (!load_mesh(path, data))
+		return false;
+
+	mesh.set_mesh(std::move(data));
+	if (mesh.nodes.empty())
+		return false;
+
+	if (save_mesh_cache(cache_path, mesh, hash))
+		std::cerr << "Mesh cache: wrote '" << cache_path << "'\n";
+	return true;
+}
+
+#endif
@@ -0,0 +1,995 @@
+#ifndef MESH_LOADER_H
+#define MESH_LOADER_H
+
+#include "rtweekend.h"
+#include "triangle_mesh.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A whole file mapped read only into memory, the OS reads pages in as the parsers touch them
+class mapped_file
+{
+public:
+	mapped_file() {}
+	~mapped_file() { close(); }
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	bool open(const std::string& path);
+	void close();
+
+	const char* data() const { return bytes; }
+	size_t size() const { return length; }
+
+private:
+	const char* bytes = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+};
+
+bool mapped_file::open(const std::string& path)
+{
+	close();
+
+#ifdef _WIN32
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER file_size;
+	if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &file_size))
+	{
+		std::cerr << "ERROR: Could not open '" << path << "'.\n";
+		close();
+		return false;
+	}
+
+	length = static_cast<size_t>(file_size.QuadPart);
+	if (length > 0)
+	{
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		bytes = mapping ? static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+	}
+#else
+	int fd = ::open(path.c_str(), O_RDONLY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0)
+	{
+		std::cerr << "ERROR: Could not open '" << path << "'.\n";
+		if (fd >= 0)
+			::close(fd);
+		return false;
+	}
+
+	length = static_cast<size_t>(info.st_size);
+	if (length > 0)
+	{
+		void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped != MAP_FAILED)
+		{
+			// Every page is about to be read, by several threads at once
+			madvise(mapped, length, MADV_WILLNEED);
+			bytes = static_cast<const char*>(mapped);
+		}
+	}
+	::close(fd);
+#endif
+
+	if (length > 0 && !bytes)
+	{
+		std::cerr << "ERROR: Could not map '" << path << "' into memory.\n";
+		close();
+		return false;
+	}
+	return true;
+}
+
+void mapped_file::close()
+{
+#ifdef _WIN32
+	if (bytes)
+		UnmapViewOfFile(bytes);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	mapping = nullptr;
+	file = INVALID_HANDLE_VALUE;
+#else
+	if (bytes)
+		munmap(const_cast<char*>(bytes), length);
+#endif
+	bytes = nullptr;
+	length = 0;
+}
+
+// Threads to parse a file of the given size with, small files are not worth starting threads for
+inline int loader_thread_count(size_t bytes)
+{
+	auto hardware = static_cast<size_t>(std::max(1u, std::thread::hardware_concurrency()));
+	return static_cast<int>(std::max<size_t>(1, std::min(hardware, bytes / (1 << 20))));
+}
+
+// Call work(part) for every part in [0, parts) on its own thread, the calling thread takes part 0
+template <typename F>
+void run_parallel(int parts, F work)
+{
+	std::vector<std::thread> threads;
+	for (int part = 1; part < parts; part++)
+		threads.emplace_back(work, part);
+	work(0);
+	for (auto& thread : threads)
+		thread.join();
+}
+
+// Text parsers over [p, end). Each skips leading spaces and tabs, leaves p just past what it read and returns false,
+// without moving p, if there is no number there
+inline void skip_spaces(const char*& p, const char* end)
+{
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+}
+
+inline bool parse_int(const char*& p, const char* end, int64_t& value)
+{
+	auto q = p;
+	skip_spaces(q, end);
+	bool negative = q < end && *q == '-';
+	if (q < end && (*q == '-' || *q == '+'))
+		q++;
+	if (q == end || *q < '0' || *q > '9')
+		return false;
+
+	int64_t v = 0;
+	for (; q < end && *q >= '0' && *q <= '9'; q++)
+		v = v * 10 + (*q - '0');
+
+	value = negative ? -v : v;
+	p = q;
+	return true;
+}
+
+// Up to 19 significant digits are gathered in an integer and scaled by a power of ten once at the end, which is within
+// an ulp or two of the correctly rounded double and far quicker than strtod
+inline bool parse_real(const char*& p, const char* end, real& value)
+{
+	static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	auto q = p;
+	skip_spaces(q, end);
+	bool negative = q < end && *q == '-';
+	if (q < end && (*q == '-' || *q == '+'))
+		q++;
+
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int64_t exponent = 0;
+	bool any = false;
+
+	for (; q < end && *q >= '0' && *q <= '9'; q++)
+	{
+		any = true;
+		if (digits < 19)
+		{
+			mantissa = mantissa * 10 + (*q - '0');
+			digits += mantissa != 0;
+		}
+		else
+		{
+			exponent++;
+		}
+	}
+	if (q < end && *q == '.')
+	{
+		for (q++; q < end && *q >= '0' && *q <= '9'; q++)
+		{
+			any = true;
+			if (digits < 19)
+			{
+				mantissa = mantissa * 10 + (*q - '0');
+				digits += mantissa != 0;
+				exponent--;
+			}
+		}
+	}
+	if (!any)
+		return false;
+
+	if (q < end && (*q == 'e' || *q == 'E'))
+	{
+		auto e = q + 1;
+		int64_t power;
+		if (e < end && *e != ' ' && *e != '\t' && parse_int(e, end, power))
+		{
+			exponent += std::max<int64_t>(-1000, std::min<int64_t>(1000, power));
+			q = e;
+		}
+	}
+
+	auto result = static_cast<double>(mantissa);
+	if (mantissa != 0 && exponent != 0)
+	{
+		auto magnitude = exponent < 0 ? -exponent : exponent;
+		auto scale = magnitude <= 22 ? powers[magnitude] : std::pow(10.0, static_cast<double>(magnitude));
+		result = exponent < 0 ? result / scale : result * scale;
+	}
+
+	value = static_cast<real>(negative ? -result : result);
+	p = q;
+	return true;
+}
+
+// The part of an OBJ file one thread parses, a run of whole lines
+struct obj_chunk
+{
+	std::vector<point3> positions;
+	std::vector<vec3> normals;
+	std::vector<real> uvs;
+
+	// Position, uv and normal index of every triangle corner, zero based and -1 where the corner has none
+	std::vector<int64_t> corners;
+	// Corners given relative to the end of the list they index. Until the chunk's offsets are known they are
+	// relative to the start of the chunk, and can be negative
+	std::vector<size_t> relative_corners;
+
+	std::string error;
+};
+
+// Parse the OBJ lines in [p, end). Only v, vt, vn and f are read, polygons are split into fans of triangles
+inline void parse_obj_chunk(const char* p, const char* end, obj_chunk& chunk)
+{
+	int64_t polygon[3 * 64];
+	bool polygon_relative[3 * 64];
+
+	while (p < end)
+	{
+		auto newline = static_cast<const char*>(memchr(p, '\n', end - p));
+		auto line_end = newline ? newline : end;
+		auto line = p;
+		p = newline ? newline + 1 : end;
+
+		skip_spaces(line, line_end);
+		if (line + 1 >= line_end)
+			continue;
+
+		if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t'))
+		{
+			real x, y, z;
+			line++;
+			if (!parse_real(line, line_end, x) || !parse_real(line, line_end, y) || !parse_real(line, line_end, z))
+			{
+				chunk.error = "a vertex position without three coordinates";
+				return;
+			}
+			chunk.positions.emplace_back(x, y, z);
+		}
+		else if (line[0] == 'v' && line[1] == 'n')
+		{
+			real x, y, z;
+			line += 2;
+			if (!parse_real(line, line_end, x) || !parse_real(line, line_end, y) || !parse_real(line, line_end, z))
+			{
+				chunk.error = "a vertex normal without three coordinates";
+				return;
+			}
+			chunk.normals.emplace_back(x, y, z);
+		}
+		else if (line[0] == 'v' && line[1] == 't')
+		{
+			// A third coordinate for 3D textures is ignored
+			real u, v = 0;
+			line += 2;
+			if (!parse_real(line, line_end, u))
+			{
+				chunk.error = "a texture coordinate without a u";
+				return;
+			}
+			parse_real(line, line_end, v);
+			chunk.uvs.push_back(u);
+			chunk.uvs.push_back(v);
+		}
+		else if (line[0] == 'f' && (line[1] == ' ' || line[1] == '\t'))
+		{
+			const int64_t counts[3] = {
+				static_cast<int64_t>(chunk.positions.size()),
+				static_cast<int64_t>(chunk.uvs.size() / 2),
+				static_cast<int64_t>(chunk.normals.size())
+			};
+
+			// Corners are v, v/vt, v//vn or v/vt/vn
+			int corner_count = 0;
+			line++;
+			for (;;)
+			{
+				int64_t index[3];
+				bool present[3] = { false, false, false };
+				if (!parse_int(line, line_end, index[0]))
+					break;
+				present[0] = true;
+				for (int component = 1; component < 3 && line < line_end && *line == '/'; component++)
+				{
+					line++;
+					present[component] = parse_int(line, line_end, index[component]);
+				}
+
+				if (corner_count == 64)
+				{
+					chunk.error = "a face with more than 64 corners";
+					return;
+				}
+
+				for (int component = 0; component < 3; component++)
+				{
+					auto& value = polygon[3 * corner_count + component];
+					auto i = index[component];
+					polygon_relative[3 * corner_count + component] = present[component] && i < 0;
+
+					// Positive indices count from 1 at the start of the file, negative ones back from the latest element
+					if (!present[component])
+					{
+						value = -1;
+					}
+					else if (i == 0)
+					{
+						chunk.error = "a face with an index of 0";
+						return;
+					}
+					else
+					{
+						value = i > 0 ? i - 1 : counts[component] + i;
+					}
+				}
+				corner_count++;
+			}
+
+			if (corner_count < 3)
+			{
+				chunk.error = "a face with fewer than three corners";
+				return;
+			}
+
+			for (int k = 1; k + 1 < corner_count; k++)
+			{
+				for (int corner : { 0, k, k + 1 })
+				{
+					for (int component = 0; component < 3; component++)
+					{
+						if (polygon_relative[3 * corner + component])
+							chunk.relative_corners.push_back(chunk.corners.size());
+						chunk.corners.push_back(polygon[3 * corner + component]);
+					}
+				}
+			}
+		}
+	}
+}
+
+// Load a Wavefront OBJ file. The file is split into one run of lines per thread and the runs are parsed in parallel,
+// then joined. Where every corner's uv and normal share its position's index they are used as they are, otherwise
+// each distinct combination becomes its own vertex. Normals or uvs that only some corners have are dropped
+inline bool load_obj(const std::string& path, mesh_data& mesh)
+{
+	mapped_file file;
+	if (!file.open(path))
+		return false;
+
+	const char* begin = file.data();
+	const char* end = begin + file.size();
+
+	// Split at the first line break after each equal share of the file
+	int parts = loader_thread_count(file.size());
+	std::vector<const char*> splits(parts + 1, end);
+	splits[0] = begin;
+	for (int part = 1; part < parts; part++)
+	{
+		auto p = std::max(splits[part - 1], begin + file.size() / parts * part);
+		auto newline = p < end ? static_cast<const char*>(memchr(p, '\n', end - p)) : nullptr;
+		splits[part] = newline ? newline + 1 : end;
+	}
+
+	std::vector<obj_chunk> chunks(parts);
+	run_parallel(parts, [&](int part) { parse_obj_chunk(splits[part], splits[part + 1], chunks[part]); });
+
+	for (const auto& chunk : chunks)
+	{
+		if (!chunk.error.empty())
+		{
+			std::cerr << "ERROR: '" << path << "' has " << chunk.error << ".\n";
+			return false;
+		}
+	}
+
+	// Where each chunk's elements start in the whole file
+	std::vector<size_t> position_offsets(parts + 1, 0), uv_offsets(parts + 1, 0), normal_offsets(parts + 1, 0), corner_offsets(parts + 1, 0);
+	for (int part = 0; part < parts; part++)
+	{
+		position_offsets[part + 1] = position_offsets[part] + chunks[part].positions.size();
+		uv_offsets[part + 1] = uv_offsets[part] + chunks[part].uvs.size() / 2;
+		normal_offsets[part + 1] = normal_offsets[part] + chunks[part].normals.size();
+		corner_offsets[part + 1] = corner_offsets[part] + chunks[part].corners.size() / 3;
+	}
+
+	const size_t position_count = position_offsets[parts];
+	const size_t uv_count = uv_offsets[parts];
+	const size_t normal_count = normal_offsets[parts];
+	const size_t corner_count = corner_offsets[parts];
+
+	if (corner_count == 0)
+	{
+		std::cerr << "ERROR: '" << path << "' has no faces.\n";
+		return false;
+	}
+	if (corner_count / 3 > std::numeric_limits<uint32_t>::max())
+	{
+		std::cerr << "ERROR: '" << path << "' has too many faces.\n";
+		return false;
+	}
+
+	// Resolve relative indices and check every index is in range. Record which attributes every corner, or no corner,
+	// has and whether they all line up with the positions
+	std::vector<uint8_t> all_uvs(parts), no_uvs(parts), all_normals(parts), no_normals(parts), shared_indices(parts), in_range(parts);
+	run_parallel(parts, [&](int part) {
+		auto& chunk = chunks[part];
+		const size_t offsets[3] = { position_offsets[part], uv_offsets[part], normal_offsets[part] };
+		const size_t counts[3] = { position_count, uv_count, normal_count };
+
+		// A relative index reaching back past the start of the file is out of range, not missing
+		for (auto corner : chunk.relative_corners)
+		{
+			chunk.corners[corner] += offsets[corner % 3];
+			if (chunk.corners[corner] < 0)
+				chunk.corners[corner] = std::numeric_limits<int64_t>::max();
+		}
+
+		bool all[3] = { true, true, true }, none[3] = { false, true, true }, shared = true, valid = true;
+		for (size_t c = 0; c < chunk.corners.size(); c += 3)
+		{
+			for (int component = 0; component < 3; component++)
+			{
+				auto i = chunk.corners[c + component];
+				bool present = i >= 0;
+				all[component] = all[component] && present;
+				none[component] = none[component] && !present;
+				valid = valid && (i < static_cast<int64_t>(counts[component])) && (present || component > 0);
+				shared = shared && (!present || i == chunk.corners[c]);
+			}
+		}
+
+		all_uvs[part] = all[1]; no_uvs[part] = none[1];
+		all_normals[part] = all[2]; no_normals[part] = none[2];
+		shared_indices[part] = shared;
+		in_range[part] = valid;
+	});
+
+	bool use_uvs = true, use_normals = true, shared = true;
+	for (int part = 0; part < parts; part++)
+	{
+		if (!in_range[part])
+		{
+			std::cerr << "ERROR: '" << path << "' has a face index out of range.\n";
+			return false;
+		}
+		use_uvs = use_uvs && all_uvs[part];
+		use_normals = use_normals && all_normals[part];
+		shared = shared && shared_indices[part];
+	}
+	use_uvs = use_uvs && uv_count > 0;
+	use_normals = use_normals && normal_count > 0;
+
+	mesh = mesh_data();
+
+	if (shared && (!use_uvs || uv_count == position_count) && (!use_normals || normal_count == position_count))
+	{
+		// Each position has its own uv and normal, copy everything straight across
+		mesh.positions.resize(position_count);
+		mesh.uvs.resize(use_uvs ? 2 * uv_count : 0);
+		mesh.normals.resize(use_normals ? normal_count : 0);
+		mesh.indices.resize(corner_count);
+
+		run_parallel(parts, [&](int part) {
+			const auto& chunk = chunks[part];
+			std::copy(chunk.positions.begin(), chunk.positions.end(), mesh.positions.begin() + position_offsets[part]);
+			if (use_uvs)
+				std::copy(chunk.uvs.begin(), chunk.uvs.end(), mesh.uvs.begin() + 2 * uv_offsets[part]);
+			if (use_normals)
+				std::copy(chunk.normals.begin(), chunk.normals.end(), mesh.normals.begin() + normal_offsets[part]);
+
+			auto index = mesh.indices.begin() + corner_offsets[part];
+			for (size_t c = 0; c < chunk.corners.size(); c += 3)
+				*index++ = static_cast<uint32_t>(chunk.corners[c]);
+		});
+	}
+	else
+	{
+		// Gather every element, then give each distinct corner its own vertex
+		std::vector<point3> positions(position_count);
+		std::vector<real> uvs(2 * uv_count);
+		std::vector<vec3> normals(normal_count);
+		run_parallel(parts, [&](int part) {
+			const auto& chunk = chunks[part];
+			std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + position_offsets[part]);
+			std::copy(chunk.uvs.begin(), chunk.uvs.end(), uvs.begin() + 2 * uv_offsets[part]);
+			std::copy(chunk.normals.begin(), chunk.normals.end(), normals.begin() + normal_offsets[part]);
+		});
+
+		struct corner_hash
+		{
+			size_t operator()(const std::pair<int64_t, int64_t>& key) const
+			{
+				return static_cast<size_t>(hash_uint64(static_cast<uint64_t>(key.first) * 0x9e3779b97f4a7c15ull ^ static_cast<uint64_t>(key.second)));
+			}
+		};
+
+		// The position and a combined uv and normal index
+		std::unordered_map<std::pair<int64_t, int64_t>, uint32_t, corner_hash> vertices;
+		vertices.reserve(position_count);
+		mesh.indices.reserve(corner_count);
+
+		for (const auto& chunk : chunks)
+		{
+			for (size_t c = 0; c < chunk.corners.size(); c += 3)
+			{
+				auto uv = use_uvs ? chunk.corners[c + 1] : 0;
+				auto normal = use_normals ? chunk.corners[c + 2] : 0;
+				std::pair<int64_t, int64_t> key(chunk.corners[c], uv * static_cast<int64_t>(normal_count + 1) + normal);
+
+				auto found = vertices.emplace(key, static_cast<uint32_t>(mesh.positions.size()));
+				if (found.second)
+				{
+					mesh.positions.push_back(positions[chunk.corners[c]]);
+					if (use_uvs)
+					{
+						mesh.uvs.push_back(uvs[2 * uv]);
+						mesh.uvs.push_back(uvs[2 * uv + 1]);
+					}
+					if (use_normals)
+						mesh.normals.push_back(normals[normal]);
+				}
+				mesh.indices.push_back(found.first->second);
+			}
+		}
+	}
+
+	return true;
+}
+
+// Scalar types a PLY property can have
+enum class ply_type { int8, uint8, int16, uint16, int32, uint32, float32, float64, none };
+
+inline ply_type ply_type_from_name(const std::string& name)
+{
+	if (name == "char" || name == "int8") return ply_type::int8;
+	if (name == "uchar" || name == "uint8") return ply_type::uint8;
+	if (name == "short" || name == "int16") return ply_type::int16;
+	if (name == "ushort" || name == "uint16") return ply_type::uint16;
+	if (name == "int" || name == "int32") return ply_type::int32;
+	if (name == "uint" || name == "uint32") return ply_type::uint32;
+	if (name == "float" || name == "float32") return ply_type::float32;
+	if (name == "double" || name == "float64") return ply_type::float64;
+	return ply_type::none;
+}
+
+inline size_t ply_type_size(ply_type type)
+{
+	switch (type)
+	{
+	case ply_type::int8: case ply_type::uint8: return 1;
+	case ply_type::int16: case ply_type::uint16: return 2;
+	case ply_type::int32: case ply_type::uint32: case ply_type::float32: return 4;
+	case ply_type::float64: return 8;
+	default: return 0;
+	}
+}
+
+// Read one value, swapping its bytes if the file's byte order is not the machine's
+inline double read_ply_value(const char* p, ply_type type, bool swap)
+{
+	unsigned char b[8];
+	auto size = ply_type_size(type);
+	memcpy(b, p, size);
+	if (swap)
+	{
+		for (size_t i = 0; i < size / 2; i++)
+			std::swap(b[i], b[size - 1 - i]);
+	}
+
+	switch (type)
+	{
+	case ply_type::int8: { int8_t v; memcpy(&v, b, 1); return v; }
+	case ply_type::uint8: return b[0];
+	case ply_type::int16: { int16_t v; memcpy(&v, b, 2); return v; }
+	case ply_type::uint16: { uint16_t v; memcpy(&v, b, 2); return v; }
+	case ply_type::int32: { int32_t v; memcpy(&v, b, 4); return v; }
+	case ply_type::uint32: { uint32_t v; memcpy(&v, b, 4); return v; }
+	case ply_type::float32: { float v; memcpy(&v, b, 4); return v; }
+	case ply_type::float64: { double v; memcpy(&v, b, 8); return v; }
+	default: return 0;
+	}
+}
+
+struct ply_property
+{
+	std::string name;
+	ply_type type;
+	// Lists store their length as count_type, then that many values of type
+	ply_type count_type = ply_type::none;
+	// Byte offset within an element with no lists
+	size_t offset = 0;
+};
+
+struct ply_element
+{
+	std::string name;
+	size_t count = 0;
+	std::vector<ply_property> properties;
+	// Size of each element if none of its properties are lists, otherwise 0
+	size_t stride = 0;
+
+	int find(std::initializer_list<const char*> names) const
+	{
+		for (size_t i = 0; i < properties.size(); i++)
+		{
+			for (auto name : names)
+			{
+				if (properties[i].name == name)
+					return static_cast<int>(i);
+			}
+		}
+		return -1;
+	}
+};
+
+// Walk past one property, or one element that may hold lists. Returns nullptr if it runs past end
+inline const char* skip_ply_property(const char* p, const char* end, const ply_property& property, bool swap)
+{
+	if (property.count_type != ply_type::none)
+	{
+		if (p + ply_type_size(property.count_type) > end)
+			return nullptr;
+		auto count = static_cast<size_t>(read_ply_value(p, property.count_type, swap));
+		p += ply_type_size(property.count_type) + count * ply_type_size(property.type);
+	}
+	else
+	{
+		p += ply_type_size(property.type);
+	}
+	return p > end ? nullptr : p;
+}
+
+inline const char* skip_ply_element(const char* p, const char* end, const ply_element& element, bool swap)
+{
+	for (const auto& property : element.properties)
+	{
+		p = skip_ply_property(p, end, property, swap);
+		if (!p)
+			return nullptr;
+	}
+	return p;
+}
+
+// Load a binary PLY file with a vertex element holding x, y and z, optionally nx, ny, nz and u, v (or s, t), and a face
+// element holding a list of vertex indices. Vertices are decoded in parallel. Faces are too as long as every one is a
+// triangle, which is checked as they are read, otherwise they are walked on one thread and split into fans
+inline bool load_ply(const std::string& path, mesh_data& mesh)
+{
+	mapped_file file;
+	if (!file.open(path))
+		return false;
+
+	const char* begin = file.data();
+	const char* end = begin + file.size();
+
+	if (file.size() < 4 || memcmp(begin, "ply", 3) != 0)
+	{
+		std::cerr << "ERROR: '" << path << "' is not a PLY file.\n";
+		return false;
+	}
+
+	// The header is text up to and including the end_header line
+	const char* header_end = nullptr;
+	for (auto p = begin; p < end; )
+	{
+		auto newline = static_cast<const char*>(memchr(p, '\n', end - p));
+		if (!newline)
+			break;
+		if (std::string(p, newline).compare(0, 10, "end_header") == 0)
+		{
+			header_end = newline + 1;
+			break;
+		}
+		p = newline + 1;
+	}
+
+	if (!header_end)
+	{
+		std::cerr << "ERROR: '" << path << "' has no end to its header.\n";
+		return false;
+	}
+
+	std::istringstream header(std::string(begin, header_end));
+	std::vector<ply_element> elements;
+	bool big_endian = false;
+	std::string line;
+	while (std::getline(header, line))
+	{
+		std::istringstream words(line);
+		std::string keyword;
+		words >> keyword;
+
+		if (keyword == "format")
+		{
+			std::string format;
+			words >> format;
+			if (format == "binary_big_endian")
+			{
+				big_endian = true;
+			}
+			else if (format != "binary_little_endian")
+			{
+				std::cerr << "ERROR: '" << path << "' is " << format << " PLY, only binary PLY is supported.\n";
+				return false;
+			}
+		}
+		else if (keyword == "element")
+		{
+			elements.emplace_back();
+			words >> elements.back().name >> elements.back().count;
+		}
+		else if (keyword == "property" && !elements.empty())
+		{
+			ply_property property;
+			std::string type;
+			words >> type;
+			if (type == "list")
+			{
+				std::string count_type;
+				words >> count_type >> type;
+				property.count_type = ply_type_from_name(count_type);
+				if (property.count_type == ply_type::none)
+					type.clear();
+			}
+			property.type = ply_type_from_name(type);
+			words >> property.name;
+
+			if (property.type == ply_type::none)
+			{
+				std::cerr << "ERROR: '" << path << "' has a property of unknown type: " << line << '\n';
+				return false;
+			}
+			elements.back().properties.push_back(property);
+		}
+	}
+
+	for (auto& element : elements)
+	{
+		size_t offset = 0;
+		bool fixed = true;
+		for (auto& property : element.properties)
+		{
+			property.offset = offset;
+			offset += ply_type_size(property.type);
+			fixed = fixed && property.count_type == ply_type::none;
+		}
+		element.stride = fixed ? offset : 0;
+	}
+
+	uint16_t byte_order = 1;
+	unsigned char first_byte;
+	memcpy(&first_byte, &byte_order, 1);
+	const bool swap = big_endian == (first_byte == 1);
+
+	mesh = mesh_data();
+	bool found_vertices = false, found_faces = false;
+	const char* p = header_end;
+
+	for (const auto& element : elements)
+	{
+		if (element.name == "vertex")
+		{
+			int x = element.find({ "x" }), y = element.find({ "y" }), z = element.find({ "z" });
+			int nx = element.find({ "nx" }), ny = element.find({ "ny" }), nz = element.find({ "nz" });
+			int u = element.find({ "u", "s", "texture_u", "texture_s" }), v = element.find({ "v", "t", "texture_v", "texture_t" });
+
+			if (x < 0 || y < 0 || z < 0 || element.stride == 0)
+			{
+				std::cerr << "ERROR: '" << path << "' has vertices without x, y and z or with list properties.\n";
+				return false;
+			}
+			if (static_cast<size_t>(end - p) / element.stride < element.count)
+			{
+				std::cerr << "ERROR: '" << path << "' ends in the middle of its vertices.\n";
+				return false;
+			}
+
+			bool normals = nx >= 0 && ny >= 0 && nz >= 0;
+			bool uvs = u >= 0 && v >= 0;
+			mesh.positions.resize(element.count);
+			mesh.normals.resize(normals ? element.count : 0);
+			mesh.uvs.resize(uvs ? 2 * element.count : 0);
+
+			const auto& props = element.properties;
+			auto read = [&](const char* vertex, int property) {
+				return static_cast<real>(read_ply_value(vertex + props[property].offset, props[property].type, swap));
+			};
+
+			const char* vertices = p;
+			int parts = loader_thread_count(element.count * element.stride);
+			run_parallel(parts, [&](int part) {
+				auto first = element.count / parts * part;
+				auto last = part + 1 == parts ? element.count : element.count / parts * (part + 1);
+				for (auto i = first; i < last; i++)
+				{
+					auto vertex = vertices + i * element.stride;
+					mesh.positions[i] = point3(read(vertex, x), read(vertex, y), read(vertex, z));
+					if (normals)
+						mesh.normals[i] = vec3(read(vertex, nx), read(vertex, ny), read(vertex, nz));
+					if (uvs)
+					{
+						mesh.uvs[2 * i] = read(vertex, u);
+						mesh.uvs[2 * i + 1] = read(vertex, v);
+					}
+				}
+			});
+
+			p += element.count * element.stride;
+			found_vertices = true;
+		}
+		else if (element.name == "face" && !found_faces)
+		{
+			int list = element.find({ "vertex_indices", "vertex_index" });
+			if (list < 0 || element.properties[list].count_type == ply_type::none)
+			{
+				std::cerr << "ERROR: '" << path << "' has faces without a list of vertex indices.\n";
+				return false;
+			}
+
+			// Every face a triangle makes every face the same size. Check the file is long enough for that, then read the
+			// faces in parallel, stopping if any turns out not to be a triangle
+			const auto& props = element.properties;
+			const auto count_size = ply_type_size(props[list].count_type);
+			const auto index_size = ply_type_size(props[list].type);
+			size_t triangle_stride = 0;
+			for (const auto& property : props)
+				triangle_stride += property.count_type == ply_type::none ? ply_type_size(property.type) : count_size + 3 * index_size;
+
+			bool all_triangles = element.count <= std::numeric_limits<uint32_t>::max() / 3;
+			for (const auto& property : props)
+				all_triangles = all_triangles && (property.count_type == ply_type::none || &property == &props[list]);
+			all_triangles = all_triangles && static_cast<size_t>(end - p) / triangle_stride >= element.count;
+
+			if (all_triangles)
+			{
+				const char* faces = p;
+				mesh.indices.resize(3 * element.count);
+				size_t list_offset = 0;
+				for (int k = 0; k < list; k++)
+					list_offset += ply_type_size(props[k].type);
+
+				int parts = loader_thread_count(element.count * triangle_stride);
+				std::vector<uint8_t> part_ok(parts, 1);
+				run_parallel(parts, [&](int part) {
+					auto first = element.count / parts * part;
+					auto last = part + 1 == parts ? element.count : element.count / parts * (part + 1);
+					for (auto i = first; i < last; i++)
+					{
+						auto face = faces + i * triangle_stride + list_offset;
+						if (read_ply_value(face, props[list].count_type, swap) != 3)
+						{
+							part_ok[part] = 0;
+							return;
+						}
+						for (int corner = 0; corner < 3; corner++)
+							mesh.indices[3 * i + corner] = static_cast<uint32_t>(read_ply_value(face + count_size + corner * index_size, props[list].type, swap));
+					}
+				});
+
+				for (auto ok : part_ok)
+					all_triangles = all_triangles && ok;
+				if (all_triangles)
+					p += element.count * triangle_stride;
+			}
+
+			if (!all_triangles)
+			{
+				mesh.indices.clear();
+				for (size_t i = 0; i < element.count; i++)
+				{
+					auto face = p;
+					for (int k = 0; k < list && face; k++)
+						face = skip_ply_property(face, end, props[k], swap);
+
+					auto next = skip_ply_element(p, end, element, swap);
+					if (!face || !next)
+					{
+						std::cerr << "ERROR: '" << path << "' ends in the middle of its faces.\n";
+						return false;
+					}
+
+					auto corners = static_cast<size_t>(read_ply_value(face, props[list].count_type, swap));
+					auto index = [&](size_t corner) {
+						return static_cast<uint32_t>(read_ply_value(face + count_size + corner * index_size, props[list].type, swap));
+					};
+					for (size_t k = 1; k + 1 < corners; k++)
+					{
+						mesh.indices.push_back(index(0));
+						mesh.indices.push_back(index(k));
+						mesh.indices.push_back(index(k + 1));
+					}
+					p = next;
+				}
+			}
+
+			found_faces = true;
+		}
+		else if (element.stride > 0)
+		{
+			if (static_cast<size_t>(end - p) / element.stride < element.count)
+			{
+				std::cerr << "ERROR: '" << path << "' ends in the middle of its " << element.name << " elements.\n";
+				return false;
+			}
+			p += element.count * element.stride;
+		}
+		else
+		{
+			for (size_t i = 0; i < element.count && p; i++)
+				p = skip_ply_element(p, end, element, swap);
+			if (!p)
+			{
+				std::cerr << "ERROR: '" << path << "' ends in the middle of its " << element.name << " elements.\n";
+				return false;
+			}
+		}
+	}
+
+	if (!found_vertices || !found_faces || mesh.indices.empty())
+	{
+		std::cerr << "ERROR: '" << path << "' has no triangles.\n";
+		return false;
+	}
+	return true;
+}
+
+// Load a mesh from an OBJ or binary PLY file, chosen by the file's extension
+inline bool load_mesh(const std::string& path, mesh_data& mesh)
+{
+	trace_scope trace("Load mesh", "mesh");
+	auto dot = path.find_last_of('.');
+	std::string extension = dot == std::string::npos ? "" : path.substr(dot + 1);
+	for (auto& c : extension)
+		c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+
+	if (extension == "obj")
+		return load_obj(path, mesh);
+	if (extension == "ply")
+		return load_ply(path, mesh);
+
+	std::cerr << "ERROR: Unknown mesh format '" << extension << "', expected obj or ply.\n";
+	return false;
+}
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#ifdef __linux__
+#include <cerrno>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware event counts over some stretch of work
+struct perf_sample
+{
+	enum event
+	{
+		cycles, instructions, cache_misses, branch_misses,
+		event_count
+	};
+
+	uint64_t counts[event_count] = {};
+
+	uint64_t operator[](event e) const { return counts[e]; }
+
+	bool empty() const { return counts[cycles] == 0 && counts[instructions] == 0; }
+
+	void add(const perf_sample& other)
+	{
+		for (int e = 0; e < event_count; e++)
+			counts[e] += other.counts[e];
+	}
+
+	// The counts between an earlier reading and this one
+	perf_sample since(const perf_sample& start) const
+	{
+		perf_sample difference;
+		for (int e = 0; e < event_count; e++)
+			difference.counts[e] = counts[e] >= start.counts[e] ? counts[e] - start.counts[e] : 0;
+		return difference;
+	}
+
+	// Instructions per cycle
+	double ipc() const { return counts[cycles] > 0 ? static_cast<double>(counts[instructions]) / counts[cycles] : 0.0; }
+};
+
+// Hardware counters for the calling thread, read through Linux's perf_event_open. They are opened as one group so the
+// kernel schedules them onto the hardware together and their ratios hold. Where they cannot be opened, on other
+// systems, in containers without access to the PMU or with perf_event_paranoid set too high, open returns false and
+// says why
+class perf_counter_group
+{
+public:
+	perf_counter_group() {}
+	~perf_counter_group() { close(); }
+
+	perf_counter_group(const perf_counter_group&) = delete;
+	perf_counter_group& operator=(const perf_counter_group&) = delete;
+
+	bool open(std::string& error);
+	void close();
+	bool is_open() const { return fds[0] >= 0; }
+
+	// Read the counts since the group was opened
+	bool read(perf_sample& sample) const;
+
+private:
+	int fds[perf_sample::event_count] = { -1, -1, -1, -1 };
+};
+
+#ifdef __linux__
+
+bool perf_counter_group::open(std::string& error)
+{
+	close();
+
+	const uint64_t configs[perf_sample::event_count] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+	};
+
+	for (int e = 0; e < perf_sample::event_count; e++)
+	{
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = configs[e];
+		// The leader starts disabled and the rest follow it, so the group starts counting at once
+		attr.disabled = e == 0;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		// This thread on whichever CPU it runs on
+		fds[e] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, e == 0 ? -1 : fds[0], 0));
+		if (fds[e] < 0)
+		{
+			auto code = errno;
+			error = std::strerror(code);
+			if (code == EACCES || code == EPERM)
+				error += ", lower /proc/sys/kernel/perf_event_paranoid to allow them";
+			else if (code == ENOENT || code == EOPNOTSUPP || code == ENODEV)
+				error += ", this machine exposes no hardware counters";
+			close();
+			return false;
+		}
+	}
+
+	ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	return true;
+}
+
+void perf_counter_group::close()
+{
+	for (auto& fd : fds)
+	{
+		if (fd >= 0)
+			::close(fd);
+		fd = -1;
+	}
+}
+
+bool perf_counter_group::read(perf_sample& sample) const
+{
+	if (!is_open())
+		return false;
+
+	// Number of counters, time enabled, time running, then the counts in the order they were opened
+	uint64_t values[3 + perf_sample::event_count];
+	if (::read(fds[0], values, sizeof(values)) != static_cast<ssize_t>(sizeof(values)) || values[0] != perf_sample::event_count)
+		return false;
+
+	// When more events are wanted than the hardware has counters for they take turns, scale the counts up to the whole time
+	double scale = values[2] > 0 && values[2] < values[1] ? static_cast<double>(values[1]) / values[2] : 1.0;
+	for (int e = 0; e < perf_sample::event_count; e++)
+		sample.counts[e] = static_cast<uint64_t>(values[3 + e] * scale);
+	return true;
+}
+
+#else
+
+bool perf_counter_group::open(std::string& error)
+{
+	error = "hardware counters are only read on Linux";
+	return false;
+}
+
+void perf_counter_group::close() {}
+
+bool perf_counter_group::read(perf_sample& sample) const
+{
+	return false;
+}
+
+#endif
+
+// Whether render threads read their hardware counters, only set once enable_perf_counters finds they work
+inline bool& perf_counters_enabled()
+{
+	static bool enabled = false;
+	return enabled;
+}
+
+// Turn hardware counting on for the run if the counters can be opened, otherwise say why and carry on without them
+inline bool enable_perf_counters()
+{
+	perf_counter_group probe;
+	std::string error;
+	if (!probe.open(error))
+	{
+		std::cerr << "Hardware counters unavailable: " << error << ".\n";
+		return false;
+	}
+
+	perf_counters_enabled() = true;
+	return true;
+}
+
+// The calling thread's counters, opened on first use. Null when counting is off or this thread's counters failed to open
+inline const perf_counter_group* thread_perf_counters()
+{
+	if (!perf_counters_enabled())
+		return nullptr;
+
+	thread_local perf_counter_group group;
+	thread_local bool tried = false;
+	if (!tried)
+	{
+		tried = true;
+		std::string error;
+		group.open(error);
+	}
+	return group.is_open() ? &group : nullptr;
+}
+
+#endif
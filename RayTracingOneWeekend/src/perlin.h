@@ -3,98 +3,278 @@
 
 #include "rtweekend.h"
 
-// Perlin noise class
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(RT_USE_AVX) && defined(__AVX2__) && !defined(RT_SINGLE_PRECISION)
+#include <immintrin.h>
+#define RT_PERLIN_AVX2
+#elif defined(RT_USE_SSE) && !defined(RT_SINGLE_PRECISION)
+#include <emmintrin.h>
+#define RT_PERLIN_SSE
+#elif defined(RT_USE_SSE)
+#include <emmintrin.h>
+#define RT_PERLIN_SSE_FLOAT
+#endif
+
+// Perlin noise class. The three permutations share one table of bytes and every gradient is a row padded to a whole
+// vector, so everything a lookup touches fits in a few kilobytes. With SIMD, a single point's noise works on the eight
+// corners of its cell together, one gradient row times its offset from the corner per corner. turb evaluates several
+// octaves at once, one per lane, and the batch functions several points at once. Either way each corner's dot product
+// and weight are worked out in the scalar order and the corners are added up one at a time, so the results are the
+// same however a point is evaluated. That holds as long as the compiler does not fuse multiplies and adds, which it may
+// do differently in scalar and vector code; the CMake build turns that off when it targets FMA
 class perlin
 {
 public:
 	perlin()
 	{
-		ranvec = new vec3[point_count];
 		for (int i = 0; i < point_count; i++)
 		{
-			ranvec[i] = unit_vector(vec3::random(-1,1));
+			auto gradient = unit_vector(vec3::random(-1,1));
+			gradients[i] = { gradient.x(), gradient.y(), gradient.z(), -0.0f };
 		}
 
-		perm_x = perlin_generate_perm();
-		perm_y = perlin_generate_perm();
-		perm_z = perlin_generate_perm();
-	}
-
-	~perlin()
-	{
-		delete[] ranvec;
-		delete[] perm_x;
-		delete[] perm_y;
-		delete[] perm_z;
+		for (int axis = 0; axis < 3; axis++)
+			perlin_generate_perm(perm + axis * point_count);
 	}
 
 	// Add turbulence to the perlin noise
-	double turb(const point3& p, int depth = 7) const
+	real turb(const point3& p, int depth = 7) const
 	{
 		auto accum = 0.0;
-		auto temp_p = p;
 		auto weight = 1.0;
 
+#if defined(RT_PERLIN_AVX2)
+		// Four octaves at a time, see below
+		const __m256d x = _mm256_set1_pd(p.x()), y = _mm256_set1_pd(p.y()), z = _mm256_set1_pd(p.z());
+		auto scale = _mm256_setr_pd(1.0, 2.0, 4.0, 8.0);
+		const auto step = _mm256_set1_pd(16.0);
+
+		for (int i = 0; i < depth; i += 4)
+		{
+			alignas(32) double values[4];
+			_mm256_store_pd(values, noise_quad(_mm256_mul_pd(x, scale), _mm256_mul_pd(y, scale), _mm256_mul_pd(z, scale)));
+			scale = _mm256_mul_pd(scale, step);
+
+			for (int octave = 0; octave < 4 && i + octave < depth; octave++)
+			{
+				accum += weight * values[octave];
+				weight *= 0.5;
+			}
+		}
+#elif defined(RT_PERLIN_SSE)
+		// Octaves o and o + 1 together. Doubling is exact, so scaling by a power of two gives the same point as
+		// doubling once per octave
+		const __m128d x = _mm_set1_pd(p.x()), y = _mm_set1_pd(p.y()), z = _mm_set1_pd(p.z());
+		auto scale = _mm_setr_pd(1.0, 2.0);
+		const auto step = _mm_set1_pd(4.0);
+
+		for (int i = 0; i < depth; i += 2)
+		{
+			auto values = noise_pair(_mm_mul_pd(x, scale), _mm_mul_pd(y, scale), _mm_mul_pd(z, scale));
+			scale = _mm_mul_pd(scale, step);
+
+			accum += weight * _mm_cvtsd_f64(values);
+			weight *= 0.5;
+			if (i + 1 < depth)
+			{
+				accum += weight * _mm_cvtsd_f64(_mm_unpackhi_pd(values, values));
+				weight *= 0.5;
+			}
+		}
+#elif defined(RT_PERLIN_SSE_FLOAT)
+		// Four octaves at a time as with AVX2
+		const __m128 x = _mm_set1_ps(p.x()), y = _mm_set1_ps(p.y()), z = _mm_set1_ps(p.z());
+		auto scale = _mm_setr_ps(1.0f, 2.0f, 4.0f, 8.0f);
+		const auto step = _mm_set1_ps(16.0f);
+
+		for (int i = 0; i < depth; i += 4)
+		{
+			alignas(16) float values[4];
+			_mm_store_ps(values, noise_quad(_mm_mul_ps(x, scale), _mm_mul_ps(y, scale), _mm_mul_ps(z, scale)));
+			scale = _mm_mul_ps(scale, step);
+
+			for (int octave = 0; octave < 4 && i + octave < depth; octave++)
+			{
+				accum += weight * values[octave];
+				weight *= 0.5;
+			}
+		}
+#else
+		auto temp_p = p;
+
 		for (int i = 0; i < depth; i++)
 		{
 			accum += weight * noise(temp_p);
 			weight *= 0.5;
 			temp_p *= 2;
 		}
+#endif
 
 		return fabs(accum);
 	}
 
 	// Generate perlin noise at a point
-	double noise(const point3& p) const
+	real noise(const point3& p) const
 	{
-		auto u = p.x() - floor(p.x());
-		auto v = p.y() - floor(p.y());
-		auto w = p.z() - floor(p.z());
+#if defined(RT_PERLIN_AVX2)
+		return corner_sum(_mm256_setr_pd(p.x(), p.y(), p.z(), 0));
+#elif defined(RT_PERLIN_SSE)
+		return corner_sum(_mm_setr_pd(p.x(), p.y()), _mm_setr_pd(p.z(), 0));
+#elif defined(RT_PERLIN_SSE_FLOAT)
+		return static_cast<real>(corner_sum(_mm_setr_ps(p.x(), p.y(), p.z(), 0)));
+#else
+		lattice_point x(p.x()), y(p.y()), z(p.z());
+		int h[8];
+		hash_corners(x.cell, y.cell, z.cell, h);
 
-		u = u * u * (3 - 2 * u);
-		v = v * v * (3 - 2 * v);
-		w = w * w * (3 - 2 * w);
+		const real weight_x[2] = { 1 - x.weight, x.weight }, weight_y[2] = { 1 - y.weight, y.weight }, weight_z[2] = { 1 - z.weight, z.weight };
+		const real offset_x[2] = { x.t, x.t - 1 }, offset_y[2] = { y.t, y.t - 1 }, offset_z[2] = { z.t, z.t - 1 };
 
-		auto i = static_cast<int>(floor(p.x()));
-		auto j = static_cast<int>(floor(p.y()));
-		auto k = static_cast<int>(floor(p.z()));
-		vec3 c[2][2][2];
+		// Summed in double whatever real is
+		auto accum = 0.0;
+		for (int c = 0; c < 8; c++)
+		{
+			int i = c >> 2, j = (c >> 1) & 1, k = c & 1;
+			const auto& g = gradients[h[c]];
+			accum += weight_x[i] * weight_y[j] * weight_z[k] * (g.x * offset_x[i] + g.y * offset_y[j] + g.z * offset_z[k]);
+		}
+		return static_cast<real>(accum);
+#endif
+	}
 
-		for (int di = 0; di < 2; di++)
+	// Noise or turbulence at count points, out[i] for points[i]
+	void noise(const point3* points, real* out, size_t count) const
+	{
+		size_t i = 0;
+#if defined(RT_PERLIN_AVX2)
+		for (; i + 3 < count; i += 4)
+		{
+			auto values = noise_quad(_mm256_setr_pd(points[i].x(), points[i + 1].x(), points[i + 2].x(), points[i + 3].x()),
+				_mm256_setr_pd(points[i].y(), points[i + 1].y(), points[i + 2].y(), points[i + 3].y()),
+				_mm256_setr_pd(points[i].z(), points[i + 1].z(), points[i + 2].z(), points[i + 3].z()));
+			_mm256_storeu_pd(out + i, values);
+		}
+#elif defined(RT_PERLIN_SSE)
+		for (; i + 1 < count; i += 2)
+		{
+			auto values = noise_pair(_mm_setr_pd(points[i].x(), points[i + 1].x()), _mm_setr_pd(points[i].y(), points[i + 1].y()),
+				_mm_setr_pd(points[i].z(), points[i + 1].z()));
+			_mm_storeu_pd(out + i, values);
+		}
+#elif defined(RT_PERLIN_SSE_FLOAT)
+		for (; i + 3 < count; i += 4)
 		{
-			for (int dj = 0; dj < 2; dj++)
+			auto values = noise_quad(_mm_setr_ps(points[i].x(), points[i + 1].x(), points[i + 2].x(), points[i + 3].x()),
+				_mm_setr_ps(points[i].y(), points[i + 1].y(), points[i + 2].y(), points[i + 3].y()),
+				_mm_setr_ps(points[i].z(), points[i + 1].z(), points[i + 2].z(), points[i + 3].z()));
+			_mm_storeu_ps(out + i, values);
+		}
+#endif
+		for (; i < count; i++)
+			out[i] = noise(points[i]);
+	}
+
+	void turb(const point3* points, real* out, size_t count, int depth = 7) const
+	{
+		size_t i = 0;
+#if defined(RT_PERLIN_AVX2)
+		const auto two = _mm256_set1_pd(2.0), half = _mm256_set1_pd(0.5), sign = _mm256_set1_pd(-0.0);
+		for (; i + 3 < count; i += 4)
+		{
+			auto x = _mm256_setr_pd(points[i].x(), points[i + 1].x(), points[i + 2].x(), points[i + 3].x());
+			auto y = _mm256_setr_pd(points[i].y(), points[i + 1].y(), points[i + 2].y(), points[i + 3].y());
+			auto z = _mm256_setr_pd(points[i].z(), points[i + 1].z(), points[i + 2].z(), points[i + 3].z());
+			auto accum = _mm256_setzero_pd();
+			auto weight = _mm256_set1_pd(1.0);
+
+			for (int octave = 0; octave < depth; octave++)
+			{
+				accum = _mm256_add_pd(accum, _mm256_mul_pd(weight, noise_quad(x, y, z)));
+				weight = _mm256_mul_pd(weight, half);
+				x = _mm256_mul_pd(x, two);
+				y = _mm256_mul_pd(y, two);
+				z = _mm256_mul_pd(z, two);
+			}
+			_mm256_storeu_pd(out + i, _mm256_andnot_pd(sign, accum));
+		}
+#elif defined(RT_PERLIN_SSE)
+		const auto two = _mm_set1_pd(2.0), half = _mm_set1_pd(0.5), sign = _mm_set1_pd(-0.0);
+		for (; i + 1 < count; i += 2)
+		{
+			auto x = _mm_setr_pd(points[i].x(), points[i + 1].x());
+			auto y = _mm_setr_pd(points[i].y(), points[i + 1].y());
+			auto z = _mm_setr_pd(points[i].z(), points[i + 1].z());
+			auto accum = _mm_setzero_pd();
+			auto weight = _mm_set1_pd(1.0);
+
+			for (int octave = 0; octave < depth; octave++)
 			{
-				for (int dk = 0; dk < 2; dk++)
-				{
-					c[di][dj][dk] = ranvec[
-						perm_x[(i + di) & 255] ^
-						perm_y[(j + dj) & 255] ^
-						perm_z[(k + dk) & 255]];
-				}
+				accum = _mm_add_pd(accum, _mm_mul_pd(weight, noise_pair(x, y, z)));
+				weight = _mm_mul_pd(weight, half);
+				x = _mm_mul_pd(x, two);
+				y = _mm_mul_pd(y, two);
+				z = _mm_mul_pd(z, two);
 			}
+			_mm_storeu_pd(out + i, _mm_andnot_pd(sign, accum));
 		}
+#elif defined(RT_PERLIN_SSE_FLOAT)
+		// The sums are kept in double, two points per vector, as turb of one point keeps them
+		const auto two = _mm_set1_ps(2.0f);
+		const auto sign = _mm_set1_pd(-0.0);
+		for (; i + 3 < count; i += 4)
+		{
+			auto x = _mm_setr_ps(points[i].x(), points[i + 1].x(), points[i + 2].x(), points[i + 3].x());
+			auto y = _mm_setr_ps(points[i].y(), points[i + 1].y(), points[i + 2].y(), points[i + 3].y());
+			auto z = _mm_setr_ps(points[i].z(), points[i + 1].z(), points[i + 2].z(), points[i + 3].z());
+			auto accum_low = _mm_setzero_pd(), accum_high = _mm_setzero_pd();
+			auto weight = 1.0;
 
-		return trilinear_interp(c, u, v, w);
+			for (int octave = 0; octave < depth; octave++)
+			{
+				auto values = noise_quad(x, y, z);
+				auto weights = _mm_set1_pd(weight);
+				accum_low = _mm_add_pd(accum_low, _mm_mul_pd(weights, _mm_cvtps_pd(values)));
+				accum_high = _mm_add_pd(accum_high, _mm_mul_pd(weights, _mm_cvtps_pd(_mm_movehl_ps(values, values))));
+				weight *= 0.5;
+				x = _mm_mul_ps(x, two);
+				y = _mm_mul_ps(y, two);
+				z = _mm_mul_ps(z, two);
+			}
+			_mm_storeu_ps(out + i, _mm_movelh_ps(_mm_cvtpd_ps(_mm_andnot_pd(sign, accum_low)), _mm_cvtpd_ps(_mm_andnot_pd(sign, accum_high))));
+		}
+#endif
+		for (; i < count; i++)
+			out[i] = turb(points[i], depth);
 	}
 
-private:
 	static const int point_count = 256;
-	vec3* ranvec;
-	int* perm_x;
-	int* perm_y;
-	int* perm_z;
 
-	static int* perlin_generate_perm()
+private:
+	// A gradient padded to a whole vector. The padding is -0, so adding its product to a sum leaves the sum as it was
+	struct alignas(4 * sizeof(real)) gradient_row
+	{
+		real x, y, z, pad;
+	};
+
+	// perm[axis * point_count + i] is the permutation of each axis, its values all fit in a byte. AVX2 gathers the bytes
+	// as whole ints, the padding keeps the last ones inside the table
+	uint8_t perm[3 * point_count + 3] = {};
+	gradient_row gradients[point_count];
+
+	static void perlin_generate_perm(uint8_t* p)
 	{
-		auto p = new int[point_count];
-		for (int i = 0; i < perlin::point_count; i++)
+		int values[point_count];
+		for (int i = 0; i < point_count; i++)
 		{
-			p[i] = i;
+			values[i] = i;
 		}
 
-		permute(p, point_count);
-		return p;
+		permute(values, point_count);
+		for (int i = 0; i < point_count; i++)
+			p[i] = static_cast<uint8_t>(values[i]);
 	}
 
 	static void permute(int* p, int n)
@@ -108,31 +288,370 @@ private:
 		}
 	}
 
-	// Smooth perlin noise out
-	static double trilinear_interp(vec3 c[2][2][2], double u, double v, double w)
+	// Permutation entries of the two lattice planes either side of a point along each axis
+	void hash_cells(int cell_x, int cell_y, int cell_z, int hx[2], int hy[2], int hz[2]) const
 	{
-		auto uu = u * u * (3 - 2 * u);
-		auto vv = v * v * (3 - 2 * v);
-		auto ww = w * w * (3 - 2 * w);
-		auto accum = 0.0;
+		for (int d = 0; d < 2; d++)
+		{
+			hx[d] = perm[(cell_x + d) & 255];
+			hy[d] = perm[point_count + ((cell_y + d) & 255)];
+			hz[d] = perm[2 * point_count + ((cell_z + d) & 255)];
+		}
+	}
+
+	// Gradient rows of the eight corners of a cell. Corner c = 4i + 2j + k is i, j and k steps along x, y and z from
+	// the lowest corner
+	void hash_corners(int cell_x, int cell_y, int cell_z, int h[8]) const
+	{
+		int hx[2], hy[2], hz[2];
+		hash_cells(cell_x, cell_y, cell_z, hx, hy, hz);
+		for (int c = 0; c < 8; c++)
+			h[c] = hx[c >> 2] ^ hy[(c >> 1) & 1] ^ hz[c & 1];
+	}
 
-		for (int i = 0; i < 2; i++)
+	// Where a coordinate falls in the lattice: its cell, its position across the cell eased once and the interpolation
+	// weight, which eases it again. The first easing is done in double, as the noise always has
+	struct lattice_point
+	{
+		int cell;
+		real t;
+		real weight;
+
+		explicit lattice_point(real x)
 		{
-			for (int j = 0; j < 2; j++)
-			{
-				for (int k = 0; k < 2; k++)
-				{
-					vec3 weight_v(u - i, v - j, w - k);
-					accum += (i * uu + (1 - i) * (1 - uu)) *
-							 (j * vv + (1 - j) * (1 - vv)) *
-							 (k * ww + (1 - k) * (1 - ww)) *
-							 dot(c[i][j][k], weight_v);
-				}
-			}
+			double f = floor(static_cast<double>(x));
+			double u = x - f;
+			cell = static_cast<int>(f);
+			t = static_cast<real>(u * u * (3 - 2 * u));
+			weight = t * t * (3 - 2 * t);
+		}
+	};
+
+#if defined(RT_PERLIN_SSE) || defined(RT_PERLIN_SSE_FLOAT)
+	// Floor and first easing of two coordinates at once, see lattice_point. Floor comes from truncation, which rounds
+	// negative values up
+	static __m128d ease_pair(__m128d x, __m128i& cells)
+	{
+		const __m128d one = _mm_set1_pd(1.0), two = _mm_set1_pd(2.0), three = _mm_set1_pd(3.0);
+
+		auto truncated = _mm_cvtepi32_pd(_mm_cvttpd_epi32(x));
+		auto f = _mm_sub_pd(truncated, _mm_and_pd(_mm_cmpgt_pd(truncated, x), one));
+		cells = _mm_cvttpd_epi32(f);
+
+		auto u = _mm_sub_pd(x, f);
+		return _mm_mul_pd(_mm_mul_pd(u, u), _mm_sub_pd(three, _mm_mul_pd(two, u)));
+	}
+#endif
+
+#ifdef RT_PERLIN_SSE
+	// The lattice positions of two coordinates at once, see lattice_point
+	static void lattice_pair(__m128d x, __m128i& cells, __m128d& t, __m128d& weight)
+	{
+		const __m128d two = _mm_set1_pd(2.0), three = _mm_set1_pd(3.0);
+		t = ease_pair(x, cells);
+		weight = _mm_mul_pd(_mm_mul_pd(t, t), _mm_sub_pd(three, _mm_mul_pd(two, t)));
+	}
+
+	// Noise at two points, given as vectors of their coordinates. Each point sums the contributions of the eight corners
+	// of its lattice cell, the corner's gradient dotted with the offset from the corner, weighted by how near the point is
+	__m128d noise_pair(__m128d x, __m128d y, __m128d z) const
+	{
+		const __m128d one = _mm_set1_pd(1.0);
+		__m128i cell_x, cell_y, cell_z;
+		__m128d tx, ty, tz, wx, wy, wz;
+		lattice_pair(x, cell_x, tx, wx);
+		lattice_pair(y, cell_y, ty, wy);
+		lattice_pair(z, cell_z, tz, wz);
+
+		const __m128d weight_x[2] = { _mm_sub_pd(one, wx), wx }, weight_y[2] = { _mm_sub_pd(one, wy), wy }, weight_z[2] = { _mm_sub_pd(one, wz), wz };
+		const __m128d offset_x[2] = { tx, _mm_sub_pd(tx, one) }, offset_y[2] = { ty, _mm_sub_pd(ty, one) }, offset_z[2] = { tz, _mm_sub_pd(tz, one) };
+
+		int h0[8], h1[8];
+		hash_corners(_mm_cvtsi128_si32(cell_x), _mm_cvtsi128_si32(cell_y), _mm_cvtsi128_si32(cell_z), h0);
+		hash_corners(_mm_cvtsi128_si32(_mm_srli_si128(cell_x, 4)), _mm_cvtsi128_si32(_mm_srli_si128(cell_y, 4)),
+			_mm_cvtsi128_si32(_mm_srli_si128(cell_z, 4)), h1);
+
+		auto accum = _mm_setzero_pd();
+		for (int c = 0; c < 8; c++)
+		{
+			int i = c >> 2, j = (c >> 1) & 1, k = c & 1;
+			const auto& g0 = gradients[h0[c]];
+			const auto& g1 = gradients[h1[c]];
+			auto xy0 = _mm_load_pd(&g0.x), xy1 = _mm_load_pd(&g1.x);
+			auto gradient_z = _mm_unpacklo_pd(_mm_load_pd(&g0.z), _mm_load_pd(&g1.z));
+
+			auto dot = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_unpacklo_pd(xy0, xy1), offset_x[i]), _mm_mul_pd(_mm_unpackhi_pd(xy0, xy1), offset_y[j])),
+				_mm_mul_pd(gradient_z, offset_z[k]));
+			accum = _mm_add_pd(accum, _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(weight_x[i], weight_y[j]), weight_z[k]), dot));
 		}
 
 		return accum;
 	}
+
+	// Noise at one point given as (x, y) and (z, 0). The corners are taken in pairs, the two either side along z
+	double corner_sum(__m128d xy, __m128d z) const
+	{
+		const __m128d one = _mm_set1_pd(1.0), z_steps = _mm_setr_pd(0.0, 1.0);
+		__m128i cells_xy, cells_z;
+		__m128d t_xy, t_z, weight_xy, weight_z;
+		lattice_pair(xy, cells_xy, t_xy, weight_xy);
+		lattice_pair(z, cells_z, t_z, weight_z);
+
+		int h[8];
+		hash_corners(_mm_cvtsi128_si32(cells_xy), _mm_cvtsi128_si32(_mm_srli_si128(cells_xy, 4)), _mm_cvtsi128_si32(cells_z), h);
+
+		// Offsets and weights along x and y broadcast, along z one lane per corner of the pair
+		auto offset_x = _mm_unpacklo_pd(t_xy, t_xy), offset_y = _mm_unpackhi_pd(t_xy, t_xy);
+		const __m128d offsets_x[2] = { offset_x, _mm_sub_pd(offset_x, one) }, offsets_y[2] = { offset_y, _mm_sub_pd(offset_y, one) };
+		auto offsets_z = _mm_sub_pd(_mm_unpacklo_pd(t_z, t_z), z_steps);
+
+		auto weight_low = _mm_sub_pd(one, weight_xy);
+		const __m128d weights_x[2] = { _mm_unpacklo_pd(weight_low, weight_low), _mm_unpacklo_pd(weight_xy, weight_xy) };
+		const __m128d weights_y[2] = { _mm_unpackhi_pd(weight_low, weight_low), _mm_unpackhi_pd(weight_xy, weight_xy) };
+		auto weights_z = _mm_unpacklo_pd(_mm_sub_pd(one, weight_z), weight_z);
+
+		auto accum = _mm_setzero_pd();
+		for (int c = 0; c < 8; c += 2)
+		{
+			int i = c >> 2, j = (c >> 1) & 1;
+			const auto& g0 = gradients[h[c]];
+			const auto& g1 = gradients[h[c + 1]];
+			auto xy0 = _mm_load_pd(&g0.x), xy1 = _mm_load_pd(&g1.x);
+			auto gradient_z = _mm_unpacklo_pd(_mm_load_pd(&g0.z), _mm_load_pd(&g1.z));
+
+			auto dot = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_unpacklo_pd(xy0, xy1), offsets_x[i]), _mm_mul_pd(_mm_unpackhi_pd(xy0, xy1), offsets_y[j])),
+				_mm_mul_pd(gradient_z, offsets_z));
+			auto corners = _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(weights_x[i], weights_y[j]), weights_z), dot);
+			accum = _mm_add_sd(accum, corners);
+			accum = _mm_add_sd(accum, _mm_unpackhi_pd(corners, corners));
+		}
+		return _mm_cvtsd_f64(accum);
+	}
+#endif
+
+#ifdef RT_PERLIN_AVX2
+	// The lattice positions of four coordinates at once, see lattice_point
+	static void lattice_quad(__m256d x, __m128i& cells, __m256d& t, __m256d& weight)
+	{
+		const __m256d two = _mm256_set1_pd(2.0), three = _mm256_set1_pd(3.0);
+
+		auto f = _mm256_floor_pd(x);
+		cells = _mm256_cvttpd_epi32(f);
+
+		t = _mm256_sub_pd(x, f);
+		t = _mm256_mul_pd(_mm256_mul_pd(t, t), _mm256_sub_pd(three, _mm256_mul_pd(two, t)));
+		weight = _mm256_mul_pd(_mm256_mul_pd(t, t), _mm256_sub_pd(three, _mm256_mul_pd(two, t)));
+	}
+
+	// Permutation entries of four cells along an axis. The masked gathers start from zero so no lane is left undefined
+	__m128i permute_quad(__m128i cells, int axis) const
+	{
+		const auto byte = _mm_set1_epi32(255);
+		auto entries = _mm_mask_i32gather_epi32(_mm_setzero_si128(), reinterpret_cast<const int*>(perm + axis * point_count),
+			_mm_and_si128(cells, byte), _mm_set1_epi32(-1), 1);
+		return _mm_and_si128(entries, byte);
+	}
+
+	// One component of four gradient rows, rows are four doubles apart
+	static __m256d gather_gradients(const double* component, __m128i rows)
+	{
+		return _mm256_mask_i32gather_pd(_mm256_setzero_pd(), component, _mm_slli_epi32(rows, 2), _mm256_castsi256_pd(_mm256_set1_epi64x(-1)), 8);
+	}
+
+	// Noise at four points, see noise_pair
+	__m256d noise_quad(__m256d x, __m256d y, __m256d z) const
+	{
+		const __m256d one = _mm256_set1_pd(1.0);
+		const __m128i next = _mm_set1_epi32(1);
+		__m128i cell_x, cell_y, cell_z;
+		__m256d tx, ty, tz, wx, wy, wz;
+		lattice_quad(x, cell_x, tx, wx);
+		lattice_quad(y, cell_y, ty, wy);
+		lattice_quad(z, cell_z, tz, wz);
+
+		const __m256d weight_x[2] = { _mm256_sub_pd(one, wx), wx }, weight_y[2] = { _mm256_sub_pd(one, wy), wy }, weight_z[2] = { _mm256_sub_pd(one, wz), wz };
+		const __m256d offset_x[2] = { tx, _mm256_sub_pd(tx, one) }, offset_y[2] = { ty, _mm256_sub_pd(ty, one) }, offset_z[2] = { tz, _mm256_sub_pd(tz, one) };
+
+		const __m128i hx[2] = { permute_quad(cell_x, 0), permute_quad(_mm_add_epi32(cell_x, next), 0) };
+		const __m128i hy[2] = { permute_quad(cell_y, 1), permute_quad(_mm_add_epi32(cell_y, next), 1) };
+		const __m128i hz[2] = { permute_quad(cell_z, 2), permute_quad(_mm_add_epi32(cell_z, next), 2) };
+
+		auto accum = _mm256_setzero_pd();
+		for (int c = 0; c < 8; c++)
+		{
+			int i = c >> 2, j = (c >> 1) & 1, k = c & 1;
+			auto h = _mm_xor_si128(_mm_xor_si128(hx[i], hy[j]), hz[k]);
+
+			auto dot = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(gather_gradients(&gradients[0].x, h), offset_x[i]),
+				_mm256_mul_pd(gather_gradients(&gradients[0].y, h), offset_y[j])),
+				_mm256_mul_pd(gather_gradients(&gradients[0].z, h), offset_z[k]));
+			accum = _mm256_add_pd(accum, _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(weight_x[i], weight_y[j]), weight_z[k]), dot));
+		}
+
+		return accum;
+	}
+
+	// Noise at one point given as (x, y, z, 0). Lane l of the first half works on corner l and of the second on corner
+	// 4 + l
+	double corner_sum(__m256d point) const
+	{
+		const __m256d one = _mm256_set1_pd(1.0);
+		__m128i cells;
+		__m256d t, weight;
+		lattice_quad(point, cells, t, weight);
+
+		int h[8];
+		hash_corners(_mm_cvtsi128_si32(cells), _mm_extract_epi32(cells, 1), _mm_extract_epi32(cells, 2), h);
+
+		// A corner's offset is t less its steps, and its gradient times that is the three terms of its dot product
+		__m256d products[8];
+		for (int c = 0; c < 8; c++)
+			products[c] = _mm256_mul_pd(_mm256_load_pd(&gradients[h[c]].x), _mm256_sub_pd(t, _mm256_load_pd(corner_steps_avx[c])));
+
+		// Pairwise sums give x + y and z + pad of two corners, then one add finishes the dot products of four
+		__m256d dots[2];
+		for (int half = 0; half < 2; half++)
+		{
+			auto low = _mm256_hadd_pd(products[4 * half], products[4 * half + 1]);
+			auto high = _mm256_hadd_pd(products[4 * half + 2], products[4 * half + 3]);
+			dots[half] = _mm256_add_pd(_mm256_blend_pd(low, high, 0xc), _mm256_permute2f128_pd(low, high, 0x21));
+		}
+
+		// The unpacks pair 1 - w with w along each axis, which are then spread out in corner order
+		auto weight_low = _mm256_sub_pd(one, weight);
+		auto xz = _mm256_unpacklo_pd(weight_low, weight);
+		auto yy = _mm256_unpackhi_pd(weight_low, weight);
+		auto weights_x = _mm256_permute2f128_pd(xz, xz, 0x00);
+		auto weights_y = _mm256_permute_pd(_mm256_permute2f128_pd(yy, yy, 0x00), 0xc);
+		auto weights_z = _mm256_permute2f128_pd(xz, xz, 0x11);
+		const __m256d weight_x[2] = { _mm256_permute_pd(weights_x, 0x0), _mm256_permute_pd(weights_x, 0xf) };
+
+		auto accum = _mm_setzero_pd();
+		for (int half = 0; half < 2; half++)
+		{
+			auto corners = _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(weight_x[half], weights_y), weights_z), dots[half]);
+			auto low = _mm256_castpd256_pd128(corners);
+			auto high = _mm256_extractf128_pd(corners, 1);
+			accum = _mm_add_sd(accum, low);
+			accum = _mm_add_sd(accum, _mm_unpackhi_pd(low, low));
+			accum = _mm_add_sd(accum, high);
+			accum = _mm_add_sd(accum, _mm_unpackhi_pd(high, high));
+		}
+		return _mm_cvtsd_f64(accum);
+	}
+
+	// Steps of each corner from the lowest along x, y and z
+	alignas(32) static constexpr double corner_steps_avx[8][4] = {
+		{ 0, 0, 0, 0 }, { 0, 0, 1, 0 }, { 0, 1, 0, 0 }, { 0, 1, 1, 0 },
+		{ 1, 0, 0, 0 }, { 1, 0, 1, 0 }, { 1, 1, 0, 0 }, { 1, 1, 1, 0 }
+	};
+#endif
+
+#ifdef RT_PERLIN_SSE_FLOAT
+	// The lattice positions of four coordinates at once, see lattice_point. The first easing is in double, two lanes
+	// at a time
+	static void lattice_quad(__m128 x, int cells[4], __m128& t, __m128& weight)
+	{
+		const __m128 two = _mm_set1_ps(2.0f), three = _mm_set1_ps(3.0f);
+		__m128i cells_low, cells_high;
+		auto t_low = ease_pair(_mm_cvtps_pd(x), cells_low);
+		auto t_high = ease_pair(_mm_cvtps_pd(_mm_movehl_ps(x, x)), cells_high);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(cells), _mm_unpacklo_epi64(cells_low, cells_high));
+
+		t = _mm_movelh_ps(_mm_cvtpd_ps(t_low), _mm_cvtpd_ps(t_high));
+		weight = _mm_mul_ps(_mm_mul_ps(t, t), _mm_sub_ps(three, _mm_mul_ps(two, t)));
+	}
+
+	// The x, y and z of four gradient rows, one row per lane
+	void load_gradients(int h0, int h1, int h2, int h3, __m128& gradient_x, __m128& gradient_y, __m128& gradient_z) const
+	{
+		auto row0 = _mm_load_ps(&gradients[h0].x), row1 = _mm_load_ps(&gradients[h1].x);
+		auto row2 = _mm_load_ps(&gradients[h2].x), row3 = _mm_load_ps(&gradients[h3].x);
+		auto xy01 = _mm_unpacklo_ps(row0, row1), xy23 = _mm_unpacklo_ps(row2, row3);
+		gradient_x = _mm_movelh_ps(xy01, xy23);
+		gradient_y = _mm_movehl_ps(xy23, xy01);
+		gradient_z = _mm_movelh_ps(_mm_unpackhi_ps(row0, row1), _mm_unpackhi_ps(row2, row3));
+	}
+
+	// Noise at four points, given as vectors of their coordinates. Each lane works as the scalar code does, the
+	// corners in float and their sum in double
+	__m128 noise_quad(__m128 x, __m128 y, __m128 z) const
+	{
+		const __m128 one = _mm_set1_ps(1.0f);
+		alignas(16) int cell_x[4], cell_y[4], cell_z[4];
+		__m128 tx, ty, tz, wx, wy, wz;
+		lattice_quad(x, cell_x, tx, wx);
+		lattice_quad(y, cell_y, ty, wy);
+		lattice_quad(z, cell_z, tz, wz);
+
+		const __m128 weight_x[2] = { _mm_sub_ps(one, wx), wx }, weight_y[2] = { _mm_sub_ps(one, wy), wy }, weight_z[2] = { _mm_sub_ps(one, wz), wz };
+		const __m128 offset_x[2] = { tx, _mm_sub_ps(tx, one) }, offset_y[2] = { ty, _mm_sub_ps(ty, one) }, offset_z[2] = { tz, _mm_sub_ps(tz, one) };
+
+		int h[4][8];
+		for (int l = 0; l < 4; l++)
+			hash_corners(cell_x[l], cell_y[l], cell_z[l], h[l]);
+
+		auto accum_low = _mm_setzero_pd(), accum_high = _mm_setzero_pd();
+		for (int c = 0; c < 8; c++)
+		{
+			int i = c >> 2, j = (c >> 1) & 1, k = c & 1;
+			__m128 gradient_x, gradient_y, gradient_z;
+			load_gradients(h[0][c], h[1][c], h[2][c], h[3][c], gradient_x, gradient_y, gradient_z);
+
+			auto dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(gradient_x, offset_x[i]), _mm_mul_ps(gradient_y, offset_y[j])), _mm_mul_ps(gradient_z, offset_z[k]));
+			auto corners = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(weight_x[i], weight_y[j]), weight_z[k]), dot);
+			accum_low = _mm_add_pd(accum_low, _mm_cvtps_pd(corners));
+			accum_high = _mm_add_pd(accum_high, _mm_cvtps_pd(_mm_movehl_ps(corners, corners)));
+		}
+
+		return _mm_movelh_ps(_mm_cvtpd_ps(accum_low), _mm_cvtpd_ps(accum_high));
+	}
+
+	// Noise at one point given as (x, y, z, 0). Lane l of the first half works on corner l and of the second on corner
+	// 4 + l, the gradient rows of four corners are transposed as they are loaded
+	double corner_sum(__m128 point) const
+	{
+		const __m128 one = _mm_set1_ps(1.0f);
+		alignas(16) int cells[4];
+		__m128 t, weight;
+		lattice_quad(point, cells, t, weight);
+
+		int h[8];
+		hash_corners(cells[0], cells[1], cells[2], h);
+
+		// Offsets from the corners along each axis in corner order
+		auto offset_low = t, offset_high = _mm_sub_ps(t, one);
+		auto xy = _mm_unpacklo_ps(offset_low, offset_high);
+		auto zz = _mm_unpackhi_ps(offset_low, offset_high);
+		auto offsets_y = _mm_shuffle_ps(xy, xy, _MM_SHUFFLE(3, 3, 2, 2));
+		auto offsets_z = _mm_movelh_ps(zz, zz);
+		const __m128 offsets_x[2] = { _mm_shuffle_ps(xy, xy, 0x00), _mm_shuffle_ps(xy, xy, 0x55) };
+
+		auto weight_low = _mm_sub_ps(one, weight);
+		auto weights_xy = _mm_unpacklo_ps(weight_low, weight);
+		auto weights_zz = _mm_unpackhi_ps(weight_low, weight);
+		auto weights_y = _mm_shuffle_ps(weights_xy, weights_xy, _MM_SHUFFLE(3, 3, 2, 2));
+		auto weights_z = _mm_movelh_ps(weights_zz, weights_zz);
+		const __m128 weights_x[2] = { _mm_shuffle_ps(weights_xy, weights_xy, 0x00), _mm_shuffle_ps(weights_xy, weights_xy, 0x55) };
+
+		auto accum = _mm_setzero_pd();
+		for (int half = 0; half < 2; half++)
+		{
+			__m128 gradient_x, gradient_y, gradient_z;
+			load_gradients(h[4 * half], h[4 * half + 1], h[4 * half + 2], h[4 * half + 3], gradient_x, gradient_y, gradient_z);
+
+			auto dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(gradient_x, offsets_x[half]), _mm_mul_ps(gradient_y, offsets_y)), _mm_mul_ps(gradient_z, offsets_z));
+			auto corners = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(weights_x[half], weights_y), weights_z), dot);
+			auto low = _mm_cvtps_pd(corners);
+			auto high = _mm_cvtps_pd(_mm_movehl_ps(corners, corners));
+			accum = _mm_add_sd(accum, low);
+			accum = _mm_add_sd(accum, _mm_unpackhi_pd(low, low));
+			accum = _mm_add_sd(accum, high);
+			accum = _mm_add_sd(accum, _mm_unpackhi_pd(high, high));
+		}
+		return _mm_cvtsd_f64(accum);
+	}
+#endif
 };
 
-#endif
\ No newline at end of file
+#endif
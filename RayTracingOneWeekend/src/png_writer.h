@@ -0,0 +1,302 @@
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <ostream>
+#include <vector>
+
+// A small self contained PNG encoder for 8-bit RGB images. Each row is filtered with whichever of the five PNG
+// filters gives the smallest sum of absolute differences and the result is deflated with LZ77 and the fixed Huffman codes
+namespace png_writer
+{
+	// Collects bits least significant first as deflate expects
+	class bit_writer
+	{
+	public:
+		void write_bits(uint32_t value, int count)
+		{
+			buffer |= static_cast<uint64_t>(value) << bit_count;
+			bit_count += count;
+			while (bit_count >= 8)
+			{
+				bytes.push_back(static_cast<uint8_t>(buffer));
+				buffer >>= 8;
+				bit_count -= 8;
+			}
+		}
+
+		// Huffman codes are defined most significant bit first so they go in reversed
+		void write_code(uint32_t code, int length)
+		{
+			uint32_t reversed = 0;
+			for (int i = 0; i < length; i++)
+				reversed |= ((code >> i) & 1) << (length - 1 - i);
+			write_bits(reversed, length);
+		}
+
+		void flush()
+		{
+			if (bit_count > 0)
+				bytes.push_back(static_cast<uint8_t>(buffer));
+			buffer = 0;
+			bit_count = 0;
+		}
+
+	public:
+		std::vector<uint8_t> bytes;
+
+	private:
+		uint64_t buffer = 0;
+		int bit_count = 0;
+	};
+
+	inline void write_literal(bit_writer& bits, int value)
+	{
+		if (value < 144)
+			bits.write_code(0x30 + value, 8);
+		else if (value < 256)
+			bits.write_code(0x190 + value - 144, 9);
+		else if (value < 280)
+			bits.write_code(value - 256, 7);
+		else
+			bits.write_code(0xc0 + value - 280, 8);
+	}
+
+	inline void write_match(bit_writer& bits, int length, int distance)
+	{
+		static const int length_base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+		static const int length_extra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+		static const int distance_base[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+			4097, 6145, 8193, 12289, 16385, 24577 };
+		static const int distance_extra[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+		int l = 28;
+		while (length_base[l] > length)
+			l--;
+		write_literal(bits, 257 + l);
+		bits.write_bits(length - length_base[l], length_extra[l]);
+
+		int d = 29;
+		while (distance_base[d] > distance)
+			d--;
+		bits.write_code(d, 5);
+		bits.write_bits(distance - distance_base[d], distance_extra[d]);
+	}
+
+	// Compress data into a zlib stream holding a single fixed Huffman deflate block
+	inline std::vector<uint8_t> zlib_compress(const std::vector<uint8_t>& data)
+	{
+		const int window = 32768;
+		const int hash_size = 1 << 15;
+		const int max_chain = 32;
+		const int min_match = 3;
+		const int max_match = 258;
+
+		bit_writer bits;
+		bits.bytes.reserve(data.size() / 2 + 64);
+		bits.bytes.push_back(0x78);
+		bits.bytes.push_back(0x01);
+
+		// Final block, fixed Huffman codes
+		bits.write_bits(1, 1);
+		bits.write_bits(1, 2);
+
+		std::vector<int> head(hash_size, -1);
+		std::vector<int> previous(window, -1);
+		auto hash = [&](size_t i) {
+			return ((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2]) & (hash_size - 1);
+		};
+		auto insert = [&](size_t i) {
+			auto h = hash(i);
+			previous[i & (window - 1)] = head[h];
+			head[h] = static_cast<int>(i);
+		};
+
+		size_t i = 0;
+		const size_t n = data.size();
+		while (i < n)
+		{
+			int best_length = 0;
+			int best_distance = 0;
+
+			if (i + min_match <= n)
+			{
+				auto limit = static_cast<int>(std::min<size_t>(max_match, n - i));
+				int candidate = head[hash(i)];
+				for (int chain = 0; chain < max_chain && candidate >= 0 && static_cast<int>(i) - candidate <= window - 1; chain++)
+				{
+					int length = 0;
+					while (length < limit && data[candidate + length] == data[i + length])
+						length++;
+
+					if (length > best_length)
+					{
+						best_length = length;
+						best_distance = static_cast<int>(i) - candidate;
+						if (length == limit)
+							break;
+					}
+					candidate = previous[candidate & (window - 1)];
+				}
+			}
+
+			if (best_length >= min_match)
+			{
+				write_match(bits, best_length, best_distance);
+				for (int k = 0; k < best_length; k++, i++)
+				{
+					if (i + min_match <= n)
+						insert(i);
+				}
+			}
+			else
+			{
+				write_literal(bits, data[i]);
+				if (i + min_match <= n)
+					insert(i);
+				i++;
+			}
+		}
+
+		write_literal(bits, 256);
+		bits.flush();
+
+		uint32_t a = 1, b = 0;
+		for (auto byte : data)
+		{
+			a = (a + byte) % 65521;
+			b = (b + a) % 65521;
+		}
+		uint32_t adler = (b << 16) | a;
+		for (int shift = 24; shift >= 0; shift -= 8)
+			bits.bytes.push_back(static_cast<uint8_t>(adler >> shift));
+
+		return bits.bytes;
+	}
+
+	inline std::array<uint32_t, 256> make_crc_table()
+	{
+		std::array<uint32_t, 256> table;
+		for (uint32_t n = 0; n < 256; n++)
+		{
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+		return table;
+	}
+
+	inline uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0)
+	{
+		static const auto table = make_crc_table();
+
+		crc = ~crc;
+		for (size_t i = 0; i < size; i++)
+			crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	inline void write_chunk(std::ostream& out, const char* type, const std::vector<uint8_t>& payload)
+	{
+		uint8_t header[8];
+		auto size = static_cast<uint32_t>(payload.size());
+		for (int k = 0; k < 4; k++)
+		{
+			header[k] = static_cast<uint8_t>(size >> (24 - 8 * k));
+			header[4 + k] = static_cast<uint8_t>(type[k]);
+		}
+
+		auto crc = crc32(header + 4, 4);
+		crc = crc32(payload.data(), payload.size(), crc);
+
+		uint8_t footer[4];
+		for (int k = 0; k < 4; k++)
+			footer[k] = static_cast<uint8_t>(crc >> (24 - 8 * k));
+
+		out.write(reinterpret_cast<const char*>(header), 8);
+		out.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+		out.write(reinterpret_cast<const char*>(footer), 4);
+	}
+
+	inline int paeth(int a, int b, int c)
+	{
+		int p = a + b - c;
+		int pa = std::abs(p - a);
+		int pb = std::abs(p - b);
+		int pc = std::abs(p - c);
+		if (pa <= pb && pa <= pc) return a;
+		if (pb <= pc) return b;
+		return c;
+	}
+}
+
+// Write 8-bit RGB pixels, rows from top to bottom, as a PNG
+inline bool write_png(std::ostream& out, const uint8_t* rgb, int width, int height)
+{
+	using namespace png_writer;
+
+	const size_t stride = static_cast<size_t>(width) * 3;
+
+	// Filter every row, keeping the filter with the smallest sum of absolute values
+	std::vector<uint8_t> filtered;
+	filtered.reserve((stride + 1) * height);
+	std::vector<uint8_t> candidate(stride);
+	std::vector<uint8_t> best(stride);
+	const std::vector<uint8_t> zero_row(stride, 0);
+
+	for (int y = 0; y < height; y++)
+	{
+		const uint8_t* row = rgb + y * stride;
+		const uint8_t* above = y > 0 ? row - stride : zero_row.data();
+		long best_score = -1;
+		int best_filter = 0;
+
+		for (int filter = 0; filter < 5; filter++)
+		{
+			long score = 0;
+			for (size_t x = 0; x < stride; x++)
+			{
+				int left = x >= 3 ? row[x - 3] : 0;
+				int up = above[x];
+				int up_left = x >= 3 ? above[x - 3] : 0;
+				int predicted = filter == 0 ? 0 : filter == 1 ? left : filter == 2 ? up : filter == 3 ? (left + up) / 2 : paeth(left, up, up_left);
+				candidate[x] = static_cast<uint8_t>(row[x] - predicted);
+				score += std::abs(static_cast<int8_t>(candidate[x]));
+			}
+
+			if (best_score < 0 || score < best_score)
+			{
+				best_score = score;
+				best_filter = filter;
+				best.swap(candidate);
+			}
+		}
+
+		filtered.push_back(static_cast<uint8_t>(best_filter));
+		filtered.insert(filtered.end(), best.begin(), best.end());
+	}
+
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	out.write(reinterpret_cast<const char*>(signature), 8);
+
+	std::vector<uint8_t> header(13, 0);
+	for (int k = 0; k < 4; k++)
+	{
+		header[k] = static_cast<uint8_t>(width >> (24 - 8 * k));
+		header[4 + k] = static_cast<uint8_t>(height >> (24 - 8 * k));
+	}
+	header[8] = 8;  // Bit depth
+	header[9] = 2;  // Colour type RGB
+
+	write_chunk(out, "IHDR", header);
+	write_chunk(out, "IDAT", zlib_compress(filtered));
+	write_chunk(out, "IEND", {});
+
+	return static_cast<bool>(out);
+}
+
+#endif
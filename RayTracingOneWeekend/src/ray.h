@@ -3,23 +3,26 @@
 
 #include "vec3.h"
 
+#include <cmath>
+#include <limits>
+
 // Ray class (esentially a line in 3-dimensions)
 class ray 
 {
 public:
 	ray() {}
 	// Create a ray with an origin and direction
-	ray(const point3& origin, const vec3& direction, double time = 0.0) : orig(origin), dir(direction), tm(time) {}
+	ray(const point3& origin, const vec3& direction, real time = 0.0) : orig(origin), dir(direction), tm(time) {}
 
 	// Get the origin of a ray
 	point3 origin() const { return orig; }
 	// Get the direction of a ray
 	vec3 direction() const { return dir; }
 	// Get the time ray was created
-	double time() const{ return tm; }
+	real time() const{ return tm; }
 
 	// Get the point on a ray t away from the origin
-	point3 at(double t) const 
+	point3 at(real t) const 
 	{
 		return orig + t * dir;
 	}
@@ -27,7 +30,30 @@ public:
 public:
 	point3 orig;
 	vec3 dir;
-	double tm;
+	real tm;
 };
 
+// Largest rounding error of a few arithmetic operations on values no bigger than magnitude
+inline real rounding_error(real magnitude)
+{
+	return 8 * std::numeric_limits<real>::epsilon() * magnitude;
+}
+
+inline real rounding_error(const vec3& v)
+{
+	return rounding_error(fmax(fabs(v.x()), fmax(fabs(v.y()), fabs(v.z()))));
+}
+
+// Move a point on a surface off it along the normal n, to the side that direction leaves from, far enough that a ray
+// starting there cannot hit the surface again. p_error bounds how far each coordinate of p may be from the true
+// surface and the offset also covers the rounding of the move itself. Even an exact point moves a little, otherwise the
+// t of a ray leaving a surface through the origin can underflow to 0
+inline point3 offset_ray_origin(const point3& p, const vec3& n, const vec3& direction, real p_error)
+{
+	const real minimum_offset = 128 * std::numeric_limits<real>::epsilon();
+	const vec3 normal = dot(n, direction) < 0 ? -n : n;
+	const auto error = fmax(p_error, minimum_offset) + rounding_error(p);
+	return p + error * (fabs(normal.x()) + fabs(normal.y()) + fabs(normal.z())) * normal;
+}
+
 #endif
\ No newline at end of file
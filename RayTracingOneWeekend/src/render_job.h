@@ -0,0 +1,319 @@
+#ifndef RENDER_JOB_H
+#define RENDER_JOB_H
+
+#include "rtweekend.h"
+#include "image_writer.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Everything about how an image is rendered
+struct render_settings
+{
+	int image_width = 600;
+	int image_height = 600;
+	// Samples per pixel, the most any pixel takes when sampling adaptively
+	int samples_per_pixel = 200;
+	// Adaptive sampling stops a pixel once its relative standard error falls below the threshold, 0 turns it off
+	int min_samples_per_pixel = 32;
+	double adaptive_threshold = 0.02;
+	// Most surfaces a path can hit
+	int max_depth = 50;
+	// Bounces before Russian roulette may end a path
+	int rr_min_depth = 5;
+	// Trace camera rays for blocks of pixels together as packets
+	bool packet_camera_rays = true;
+	// Sample lights directly from diffuse surfaces, weighting them against scattered rays with multiple importance sampling
+	bool sample_lights = true;
+	// Filter textures over each ray's footprint from their mip maps, rather than always reading the full size image
+	bool mip_mapping = true;
+};
+
+// Where the camera is and how it is focused
+struct camera_settings
+{
+	point3 lookfrom = point3(0, 0, 1);
+	point3 lookat = point3(0, 0, 0);
+	vec3 vup = vec3(0, 1, 0);
+	double vfov = 40.0;
+	double aperture = 0.0;
+	double focus_distance = 10.0;
+};
+
+// One image to render: which scene, how, from where and to which file
+struct render_job
+{
+	std::string scene = "cornell_box";
+	// Model the cornell_mesh scene loads, OBJ or binary PLY
+	std::string mesh_path = "model.obj";
+	// Seed for every random number used to build the scene and render it
+	uint64_t seed = 0;
+
+	render_settings settings;
+	// Until a height is given images are square
+	bool height_given = false;
+	// Width and height of the square tiles handed to each thread
+	int tile_size = 16;
+
+	// Camera settings the job gives replace the scene's own
+	camera_settings camera;
+	bool has_lookfrom = false;
+	bool has_lookat = false;
+	bool has_vup = false;
+	bool has_vfov = false;
+	bool has_aperture = false;
+	bool has_focus_distance = false;
+
+	// "-" writes to stdout. The format comes from the path's extension unless one is given
+	std::string output_path = "-";
+	image_format output_format = image_format::ppm;
+	bool format_given = false;
+	// Optional image of how many samples each pixel took
+	std::string heatmap_path;
+	// Optional image of how long each tile took to render
+	std::string tile_heatmap_path;
+
+	camera_settings camera_for(const camera_settings& scene_camera) const
+	{
+		auto result = scene_camera;
+		if (has_lookfrom) result.lookfrom = camera.lookfrom;
+		if (has_lookat) result.lookat = camera.lookat;
+		if (has_vup) result.vup = camera.vup;
+		if (has_vfov) result.vfov = camera.vfov;
+		if (has_aperture) result.aperture = camera.aperture;
+		if (has_focus_distance) result.focus_distance = camera.focus_distance;
+		return result;
+	}
+
+	image_format format() const
+	{
+		return format_given || output_path == "-" ? output_format : image_format_from_path(output_path);
+	}
+};
+
+// Value parsers for options, each returns false unless the whole of text is a valid value
+inline bool parse_option_value(const std::string& text, double& value)
+{
+	if (text.empty())
+		return false;
+
+	char* end;
+	errno = 0;
+	value = std::strtod(text.c_str(), &end);
+	return errno == 0 && *end == '\0';
+}
+
+inline bool parse_option_value(const std::string& text, int& value)
+{
+	if (text.empty())
+		return false;
+
+	char* end;
+	errno = 0;
+	auto v = std::strtol(text.c_str(), &end, 10);
+	value = static_cast<int>(v);
+	return errno == 0 && *end == '\0' && v == value;
+}
+
+inline bool parse_option_value(const std::string& text, uint64_t& value)
+{
+	if (text.empty() || text[0] == '-')
+		return false;
+
+	char* end;
+	errno = 0;
+	value = std::strtoull(text.c_str(), &end, 10);
+	return errno == 0 && *end == '\0';
+}
+
+// Three comma separated numbers, "x,y,z"
+inline bool parse_option_value(const std::string& text, vec3& value)
+{
+	auto first = text.find(',');
+	auto second = first == std::string::npos ? first : text.find(',', first + 1);
+	if (second == std::string::npos)
+		return false;
+
+	double x = 0, y = 0, z = 0;
+	if (!parse_option_value(text.substr(0, first), x) || !parse_option_value(text.substr(first + 1, second - first - 1), y) ||
+		!parse_option_value(text.substr(second + 1), z))
+		return false;
+
+	value = vec3(x, y, z);
+	return true;
+}
+
+inline void print_usage(std::ostream& out, const char* program)
+{
+	out << "Usage: " << program << " [options]\n"
+		"  -o, --output <path>        Image to write, - for stdout (default -)\n"
+		"  --format <p3|ppm|png|pfm>  Image format, otherwise taken from the output's extension\n"
+		"  --heatmap <path>           Also write an image of how many samples each pixel took\n"
+		"  --tile-heatmap <path>      Also write an image of how long each tile took to render\n"
+		"  --scene <name>             random, two_spheres, two_perlin_spheres, earth, simple_light, cornell_box\n"
+		"                             or cornell_mesh, or their numbers 1 to 7 (default cornell_box)\n"
+		"  --mesh <path>              OBJ or binary PLY model for cornell_mesh (default model.obj)\n"
+		"  --seed <n>                 Seed for building the scene and sampling (default 0)\n"
+		"  --width <n>, --height <n>  Image size in pixels, square unless a height is given (default 600)\n"
+		"  --spp <n>                  Most samples per pixel (default 200)\n"
+		"  --min-spp <n>              Samples every pixel takes before adaptive sampling may stop it (default 32)\n"
+		"  --threshold <x>            Relative error adaptive sampling stops at, 0 turns it off (default 0.02)\n"
+		"  --max-depth <n>            Most surfaces a path can hit (default 50)\n"
+		"  --rr-depth <n>             Bounces before Russian roulette (default 5)\n"
+		"  --tile-size <n>            Size of the tiles handed to threads (default 16)\n"
+		"  --lookfrom <x,y,z>, --lookat <x,y,z>, --vup <x,y,z>, --vfov <degrees>, --aperture <x>, --focus-distance <x>\n"
+		"                             Camera, anything not given comes from the scene\n"
+		"  --no-packets               Trace camera rays one at a time\n"
+		"  --no-light-sampling        Only find lights by scattering\n"
+		"  --no-mip-maps              Look image textures up at full size however far away they are\n"
+		"  --threads <n>              Render threads, 0 for one per hardware thread (default 0)\n"
+		"  --trace <path>             Write a timeline of every thread's work as Chrome trace JSON, for Perfetto\n"
+		"  --perf-counters            Count cycles, instructions, cache and branch misses while rendering (Linux)\n"
+		"  --jobs <path>              Render every job in a file, one per line written as the options above.\n"
+		"                             Options given on the command line are the defaults for every job\n";
+}
+
+// Read the option at args[a] and its value into job, leaving a on the last argument used. Returns false, after saying
+// why, if the option is unknown or its value is missing or bad
+inline bool parse_job_option(const std::vector<std::string>& args, size_t& a, render_job& job)
+{
+	const auto& option = args[a];
+
+	// Options that take no value
+	if (option == "--no-packets")
+	{
+		job.settings.packet_camera_rays = false;
+		return true;
+	}
+	if (option == "--no-light-sampling")
+	{
+		job.settings.sample_lights = false;
+		return true;
+	}
+	if (option == "--no-mip-maps")
+	{
+		job.settings.mip_mapping = false;
+		return true;
+	}
+
+	if (a + 1 >= args.size())
+	{
+		std::cerr << "ERROR: Unknown option or missing value '" << option << "'.\n";
+		return false;
+	}
+	const auto& value = args[++a];
+
+	bool ok = true;
+	if (option == "-o" || option == "--output") job.output_path = value;
+	else if (option == "--format") ok = job.format_given = image_format_from_name(value, job.output_format);
+	else if (option == "--heatmap") job.heatmap_path = value;
+	else if (option == "--tile-heatmap") job.tile_heatmap_path = value;
+	else if (option == "--scene") job.scene = value;
+	else if (option == "--mesh") job.mesh_path = value;
+	else if (option == "--seed") ok = parse_option_value(value, job.seed);
+	else if (option == "--width")
+	{
+		// Images stay square until a height is given
+		ok = parse_option_value(value, job.settings.image_width) && job.settings.image_width > 0;
+		if (!job.height_given)
+			job.settings.image_height = job.settings.image_width;
+	}
+	else if (option == "--height") ok = job.height_given = parse_option_value(value, job.settings.image_height) && job.settings.image_height > 0;
+	else if (option == "--spp") ok = parse_option_value(value, job.settings.samples_per_pixel) && job.settings.samples_per_pixel > 0;
+	else if (option == "--min-spp") ok = parse_option_value(value, job.settings.min_samples_per_pixel) && job.settings.min_samples_per_pixel > 0;
+	else if (option == "--threshold") ok = parse_option_value(value, job.settings.adaptive_threshold) && job.settings.adaptive_threshold >= 0;
+	else if (option == "--max-depth") ok = parse_option_value(value, job.settings.max_depth) && job.settings.max_depth >= 0;
+	else if (option == "--rr-depth") ok = parse_option_value(value, job.settings.rr_min_depth) && job.settings.rr_min_depth >= 0;
+	else if (option == "--tile-size") ok = parse_option_value(value, job.tile_size) && job.tile_size > 0;
+	else if (option == "--lookfrom") ok = job.has_lookfrom = parse_option_value(value, job.camera.lookfrom);
+	else if (option == "--lookat") ok = job.has_lookat = parse_option_value(value, job.camera.lookat);
+	else if (option == "--vup") ok = job.has_vup = parse_option_value(value, job.camera.vup);
+	else if (option == "--vfov") ok = job.has_vfov = parse_option_value(value, job.camera.vfov) && job.camera.vfov > 0 && job.camera.vfov < 180;
+	else if (option == "--aperture") ok = job.has_aperture = parse_option_value(value, job.camera.aperture) && job.camera.aperture >= 0;
+	else if (option == "--focus-distance") ok = job.has_focus_distance = parse_option_value(value, job.camera.focus_distance) && job.camera.focus_distance > 0;
+	else
+	{
+		std::cerr << "ERROR: Unknown option '" << option << "'.\n";
+		return false;
+	}
+
+	if (!ok)
+		std::cerr << "ERROR: Bad value '" << value << "' for " << option << ".\n";
+	return ok;
+}
+
+// Split a line of a job file into arguments at spaces. Double quotes keep spaces in an argument and # starts a comment
+inline std::vector<std::string> split_job_line(const std::string& line)
+{
+	std::vector<std::string> args;
+	std::string current;
+	bool in_argument = false, quoted = false;
+
+	for (auto c : line)
+	{
+		if (c == '"')
+		{
+			quoted = !quoted;
+			in_argument = true;
+		}
+		else if (!quoted && c == '#')
+		{
+			break;
+		}
+		else if (!quoted && (c == ' ' || c == '\t' || c == '\r'))
+		{
+			if (in_argument)
+				args.push_back(current);
+			current.clear();
+			in_argument = false;
+		}
+		else
+		{
+			current += c;
+			in_argument = true;
+		}
+	}
+	if (in_argument)
+		args.push_back(current);
+
+	return args;
+}
+
+// Read a job file, each line that is not blank or a comment is one job. Every job starts from base
+inline bool read_job_file(const std::string& path, const render_job& base, std::vector<render_job>& jobs)
+{
+	std::ifstream in(path);
+	if (!in)
+	{
+		std::cerr << "ERROR: Could not open job file '" << path << "'.\n";
+		return false;
+	}
+
+	std::string line;
+	for (int line_number = 1; std::getline(in, line); line_number++)
+	{
+		auto args = split_job_line(line);
+		if (args.empty())
+			continue;
+
+		auto job = base;
+		for (size_t a = 0; a < args.size(); a++)
+		{
+			if (!parse_job_option(args, a, job))
+			{
+				std::cerr << "ERROR: In job on line " << line_number << " of '" << path << "'.\n";
+				return false;
+			}
+		}
+		jobs.push_back(job);
+	}
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef RENDER_STATS_H
+#define RENDER_STATS_H
+
+#include "rtweekend.h"
+#include "vec3.h"
+#include "perf_counters.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <initializer_list>
+#include <iomanip>
+#include <ostream>
+#include <vector>
+
+// Counts of the work a render does, to see where its time goes. Each thread counts into its own render_stats, so
+// counting is a plain increment, and the workers' counts are summed once the render is done. Defining RT_NO_STATS
+// compiles every count out
+enum class stat_counter
+{
+	camera_rays, bounce_rays, shadow_rays,
+	bvh_nodes, box_tests, list_tests,
+	sphere_tests, moving_sphere_tests, rect_tests, triangle_tests, instance_tests,
+	lambertian_scatters, metal_scatters, dielectric_scatters, light_scatters,
+	paths_missed, paths_depth_capped, paths_absorbed, paths_roulette,
+	count
+};
+
+struct render_stats
+{
+	static const int counter_count = static_cast<int>(stat_counter::count);
+	// Rays are also counted by the bounce they were traced for, the last bucket holds every deeper one
+	static const int depth_buckets = 16;
+
+	uint64_t counters[counter_count] = {};
+	uint64_t rays_by_depth[depth_buckets] = {};
+	// Hardware counts over the work, when they are read
+	perf_sample hardware;
+
+	uint64_t operator[](stat_counter counter) const { return counters[static_cast<int>(counter)]; }
+
+	uint64_t rays() const { return (*this)[stat_counter::camera_rays] + (*this)[stat_counter::bounce_rays] + (*this)[stat_counter::shadow_rays]; }
+
+	void add(const render_stats& other)
+	{
+		for (int i = 0; i < counter_count; i++)
+			counters[i] += other.counters[i];
+		for (int i = 0; i < depth_buckets; i++)
+			rays_by_depth[i] += other.rays_by_depth[i];
+		hardware.add(other.hardware);
+	}
+
+	void reset() { *this = render_stats(); }
+
+	// Write a summary of the counts for a render that took seconds
+	void print(std::ostream& out, double seconds) const;
+	void print_hardware(std::ostream& out) const;
+};
+
+#ifdef RT_NO_STATS
+const bool stats_enabled = false;
+#else
+const bool stats_enabled = true;
+#endif
+
+// The calling thread's counts
+inline render_stats& thread_render_stats()
+{
+	thread_local render_stats stats;
+	return stats;
+}
+
+inline void count_stat(stat_counter counter, uint64_t amount = 1)
+{
+#ifndef RT_NO_STATS
+	thread_render_stats().counters[static_cast<int>(counter)] += amount;
+#endif
+}
+
+// Count a ray traced for the given bounce of a path, 0 for camera rays
+inline void count_ray(stat_counter kind, int depth)
+{
+#ifndef RT_NO_STATS
+	auto& stats = thread_render_stats();
+	stats.counters[static_cast<int>(kind)]++;
+	stats.rays_by_depth[std::min(depth, render_stats::depth_buckets - 1)]++;
+#endif
+}
+
+void render_stats::print(std::ostream& out, double seconds) const
+{
+	out << "Render: " << seconds << "s";
+	if (!stats_enabled)
+	{
+		out << ", statistics compiled out\n";
+		print_hardware(out);
+		return;
+	}
+
+	auto total = rays();
+	auto per_ray = [&](stat_counter counter) { return total > 0 ? static_cast<double>((*this)[counter]) / total : 0.0; };
+	auto share = [&](stat_counter counter, uint64_t of) { return of > 0 ? 100.0 * (*this)[counter] / of : 0.0; };
+
+	auto flags = out.flags();
+	auto precision = out.precision();
+	out << std::fixed << std::setprecision(2);
+
+	out << ", " << (seconds > 0 ? total / seconds / 1e6 : 0.0) << " Mrays/s\n";
+	out << "Rays: " << total << ", " << (*this)[stat_counter::camera_rays] << " camera, " << (*this)[stat_counter::bounce_rays] << " bounce, "
+		<< (*this)[stat_counter::shadow_rays] << " shadow\n";
+
+	out << "Rays by depth:";
+	int deepest = depth_buckets - 1;
+	while (deepest > 0 && rays_by_depth[deepest] == 0)
+		deepest--;
+	for (int depth = 0; depth <= deepest; depth++)
+		out << ' ' << depth << (depth == depth_buckets - 1 ? "+" : "") << ':' << rays_by_depth[depth];
+	out << '\n';
+
+	out << "Per ray: " << per_ray(stat_counter::bvh_nodes) << " BVH nodes, " << per_ray(stat_counter::box_tests) << " box tests, "
+		<< per_ray(stat_counter::list_tests) << " list scans\n";
+
+	// Only the kinds of primitive and material the scene has
+	struct named_counter { const char* name; stat_counter counter; };
+	auto print_counters = [&](const char* title, std::initializer_list<named_counter> counters) {
+		out << title;
+		bool any = false;
+		for (const auto& c : counters)
+		{
+			if ((*this)[c.counter] == 0)
+				continue;
+			out << (any ? ", " : " ") << (*this)[c.counter] << ' ' << c.name << " (" << per_ray(c.counter) << "/ray)";
+			any = true;
+		}
+		out << (any ? "\n" : " none\n");
+	};
+	print_counters("Primitive tests:", {
+		{ "sphere", stat_counter::sphere_tests }, { "moving sphere", stat_counter::moving_sphere_tests }, { "rectangle", stat_counter::rect_tests },
+		{ "triangle", stat_counter::triangle_tests }, { "instance", stat_counter::instance_tests } });
+	print_counters("Scatters:", {
+		{ "lambertian", stat_counter::lambertian_scatters }, { "metal", stat_counter::metal_scatters },
+		{ "dielectric", stat_counter::dielectric_scatters }, { "light", stat_counter::light_scatters } });
+
+	auto paths = (*this)[stat_counter::paths_missed] + (*this)[stat_counter::paths_depth_capped] + (*this)[stat_counter::paths_absorbed] +
+		(*this)[stat_counter::paths_roulette];
+	out << "Paths: " << paths << ", " << share(stat_counter::paths_missed, paths) << "% missed, " << share(stat_counter::paths_depth_capped, paths)
+		<< "% hit the depth cap, " << share(stat_counter::paths_absorbed, paths) << "% absorbed, " << share(stat_counter::paths_roulette, paths)
+		<< "% ended by roulette\n";
+	print_hardware(out);
+
+	out.flags(flags);
+	out.precision(precision);
+}
+
+void render_stats::print_hardware(std::ostream& out) const
+{
+	if (hardware.empty())
+		return;
+
+	auto flags = out.flags();
+	auto precision = out.precision();
+	out << std::fixed << std::setprecision(2);
+
+	auto total = rays();
+	out << "Hardware: " << hardware[perf_sample::cycles] << " cycles, " << hardware[perf_sample::instructions] << " instructions, "
+		<< hardware.ipc() << " IPC, " << hardware[perf_sample::cache_misses] << " cache misses, " << hardware[perf_sample::branch_misses]
+		<< " branch misses\n";
+	if (total > 0)
+	{
+		out << "Hardware per ray: " << static_cast<double>(hardware[perf_sample::cycles]) / total << " cycles, "
+			<< static_cast<double>(hardware[perf_sample::cache_misses]) / total << " cache misses, "
+			<< static_cast<double>(hardware[perf_sample::branch_misses]) / total << " branch misses\n";
+	}
+
+	out.flags(flags);
+	out.precision(precision);
+}
+
+// Colour every tile of an image by how long it took to render, from blue for no time to red for the slowest tile.
+// tile_seconds holds one entry per tile in rows of tiles_x
+inline std::vector<colour> tile_heatmap(const std::vector<double>& tile_seconds, int tile_size, int image_width, int image_height)
+{
+	const int tiles_x = (image_width + tile_size - 1) / tile_size;
+	auto slowest = tile_seconds.empty() ? 0.0 : *std::max_element(tile_seconds.begin(), tile_seconds.end());
+
+	std::vector<colour> heatmap(static_cast<size_t>(image_width) * image_height);
+	for (int j = 0; j < image_height; j++)
+	{
+		for (int i = 0; i < image_width; i++)
+		{
+			auto t = slowest > 0 ? tile_seconds[(j / tile_size) * tiles_x + i / tile_size] / slowest : 0.0;
+			// Squared so the ramp is even once the writer gamma corrects it
+			heatmap[j * image_width + i] = colour(t * t, 0, (1 - t) * (1 - t));
+		}
+	}
+
+	return heatmap;
+}
+
+#endif
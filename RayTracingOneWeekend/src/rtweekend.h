@@ -2,9 +2,37 @@
 #define RTWEEKEND_H
 
 #include <cmath>
+#include <cstdint>
 #include <limits>
 #include <memory>
-#include <cstdlib>
+
+// Use SSE wherever the target supports it unless RT_NO_SIMD is defined
+#if !defined(RT_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define RT_USE_SSE
+#endif
+
+// AVX widens the sphere soup's leaf test to 8 spheres when the target has it
+#if defined(RT_USE_SSE) && defined(__AVX__)
+#define RT_USE_AVX
+#endif
+
+// RT_SIMD_VEC3 pads vec3 to four lanes and implements it with SSE for floats or AVX for doubles,
+// where the target has them. Otherwise vec3 is three scalars
+#if defined(RT_SIMD_VEC3) && defined(RT_USE_SSE) && defined(RT_SINGLE_PRECISION)
+#define RT_VEC3_SIMD
+#define RT_VEC3_SSE
+#elif defined(RT_SIMD_VEC3) && defined(RT_USE_AVX) && !defined(RT_SINGLE_PRECISION)
+#define RT_VEC3_SIMD
+#define RT_VEC3_AVX
+#endif
+
+// Scalar type of all geometry and shading, double unless RT_SINGLE_PRECISION is defined. Single precision halves the
+// size of vectors, rays and primitives, ray origins are offset from surfaces so it does not cause self-intersection
+#ifdef RT_SINGLE_PRECISION
+using real = float;
+#else
+using real = double;
+#endif
 
 // Usings
 using std::shared_ptr;
@@ -12,18 +40,115 @@ using std::make_shared;
 using std::sqrt;
 
 // Constants
-const double infinity = std::numeric_limits<double>::infinity();
-const double pi = 3.1415926535897932385;
+const real infinity = std::numeric_limits<real>::infinity();
+const real pi = static_cast<real>(3.1415926535897932385);
 
 // Utility functions
-inline double degrees_to_radians(double degrees)
+inline real degrees_to_radians(real degrees)
 {
 	return degrees * pi / 180.0;
 }
 
+// Mix a 64-bit value into a well distributed hash (splitmix64 finaliser)
+inline uint64_t hash_uint64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ull;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+// Number of bits set in a mask
+inline int bit_count(unsigned int mask)
+{
+	int count = 0;
+	for (; mask; mask &= mask - 1)
+		count++;
+	return count;
+}
+
+// PCG32 random number generator, small and fast with 2^63 selectable streams
+class pcg32
+{
+public:
+	pcg32() { seed(0x853c49e6748fea9bull, 0xda3e39cb94b95bdbull); }
+	pcg32(uint64_t initial_state, uint64_t stream) { seed(initial_state, stream); }
+
+	void seed(uint64_t initial_state, uint64_t stream)
+	{
+		state = 0;
+		inc = (stream << 1u) | 1u;
+		next_uint();
+		state += initial_state;
+		next_uint();
+	}
+
+	uint32_t next_uint()
+	{
+		uint64_t old_state = state;
+		state = old_state * 6364136223846793005ull + inc;
+		auto xorshifted = static_cast<uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+		auto rot = static_cast<uint32_t>(old_state >> 59u);
+		return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+	}
+
+	// Returns a random real in [0,1)
+	double next_double()
+	{
+		return next_uint() * (1.0 / 4294967296.0);
+	}
+
+private:
+	uint64_t state;
+	uint64_t inc;
+};
+
+// Per thread random state. Each sample keys the generator by (seed, pixel, sample, bounce) so the random
+// sequence a path sees does not depend on which thread renders it or in what order
+struct random_context
+{
+	pcg32 generator;
+	uint64_t sample_key = 0;
+};
+
+inline uint64_t& random_seed_value()
+{
+	static uint64_t seed = 0;
+	return seed;
+}
+
+inline random_context& thread_random_context()
+{
+	thread_local random_context context;
+	return context;
+}
+
+// Set the seed for the whole render and restart the calling thread's sequence from it
+inline void set_random_seed(uint64_t seed)
+{
+	random_seed_value() = seed;
+	thread_random_context().generator.seed(hash_uint64(seed), 0);
+}
+
+// Key the calling thread's generator to a sample of a pixel, starting on the stream of the camera ray
+inline void begin_random_sample(uint64_t pixel, uint64_t sample)
+{
+	auto& context = thread_random_context();
+	context.sample_key = hash_uint64(hash_uint64(random_seed_value() ^ hash_uint64(pixel)) ^ sample);
+	context.generator.seed(context.sample_key, 0);
+}
+
+// Move the calling thread's generator to the stream for a bounce of the current sample. Stream 0 is the camera
+// ray's, so no bounce reuses the numbers that placed the ray in the pixel
+inline void set_random_bounce(int bounce)
+{
+	auto& context = thread_random_context();
+	context.generator.seed(context.sample_key, static_cast<uint64_t>(bounce) + 1);
+}
+
 inline double random_double() {
 	// Returns a random real in [0,1).
-	return rand() / (RAND_MAX + 1.0);
+	return thread_random_context().generator.next_double();
 }
 
 inline double random_double(double min, double max) {
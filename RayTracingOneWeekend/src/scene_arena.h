@@ -0,0 +1,164 @@
+#ifndef SCENE_ARENA_H
+#define SCENE_ARENA_H
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// A bump allocator that owns the objects of a scene. Each kind of object has its own pool of large blocks so the
+// primitives, materials and textures each sit together in memory. Freeing a single object does nothing, the blocks
+// are all released when the arena is destroyed, so the arena must outlive every pointer it makes. Not thread safe,
+// scenes are built on one thread
+class scene_arena
+{
+public:
+	enum pool_kind
+	{
+		primitives,
+		materials,
+		textures,
+		other,
+		pool_count
+	};
+
+	// Objects and bytes handed out by one pool, bytes include the shared_ptr control blocks and alignment padding
+	struct pool_stats
+	{
+		size_t objects = 0;
+		size_t bytes = 0;
+		size_t blocks = 0;
+	};
+
+	scene_arena(size_t block_size = 64 * 1024) : block_size(block_size) {}
+
+	scene_arena(const scene_arena&) = delete;
+	scene_arena& operator=(const scene_arena&) = delete;
+
+	// Construct an object in the pool for its kind, the object and its reference count share one allocation
+	template <typename T, typename... Args>
+	shared_ptr<T> make(Args&&... args);
+
+	void* allocate(size_t bytes, size_t alignment, pool_kind pool);
+
+	const pool_stats& stats(pool_kind pool) const { return pools[pool].stats; }
+	void print_stats(std::ostream& out) const;
+
+	static const char* pool_name(pool_kind pool);
+
+	// Pick the pool for a type from the base class it derives from
+	template <typename T>
+	static pool_kind pool_for()
+	{
+		return std::is_base_of<hittable, T>::value ? primitives :
+			std::is_base_of<material, T>::value ? materials :
+			std::is_base_of<texture, T>::value ? textures : other;
+	}
+
+	// Standard allocator interface over one pool so std::allocate_shared can place objects in the arena
+	template <typename T>
+	struct allocator
+	{
+		using value_type = T;
+
+		scene_arena* arena;
+		pool_kind pool;
+
+		allocator(scene_arena* arena, pool_kind pool) : arena(arena), pool(pool) {}
+		template <typename U>
+		allocator(const allocator<U>& other) : arena(other.arena), pool(other.pool) {}
+
+		T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T), pool)); }
+		void deallocate(T*, size_t) {}
+
+		template <typename U>
+		bool operator==(const allocator<U>& other) const { return arena == other.arena && pool == other.pool; }
+		template <typename U>
+		bool operator!=(const allocator<U>& other) const { return !(*this == other); }
+	};
+
+private:
+	struct pool
+	{
+		std::vector<std::unique_ptr<unsigned char[]>> blocks;
+		unsigned char* next = nullptr;
+		size_t remaining = 0;
+		pool_stats stats;
+	};
+
+	size_t block_size;
+	pool pools[pool_count];
+};
+
+template <typename T, typename... Args>
+shared_ptr<T> scene_arena::make(Args&&... args)
+{
+	auto pool = pool_for<T>();
+	pools[pool].stats.objects++;
+	return std::allocate_shared<T>(allocator<T>(this, pool), std::forward<Args>(args)...);
+}
+
+// Take the next aligned bytes from the pool's current block, starting a new block once it is full.
+// Anything bigger than a block gets a block of its own
+void* scene_arena::allocate(size_t bytes, size_t alignment, pool_kind kind)
+{
+	auto& p = pools[kind];
+
+	auto padding = (alignment - reinterpret_cast<uintptr_t>(p.next) % alignment) % alignment;
+	if (!p.next || padding + bytes > p.remaining)
+	{
+		auto size = bytes + alignment > block_size ? bytes + alignment : block_size;
+		p.blocks.emplace_back(new unsigned char[size]);
+		p.next = p.blocks.back().get();
+		p.remaining = size;
+		p.stats.blocks++;
+		padding = (alignment - reinterpret_cast<uintptr_t>(p.next) % alignment) % alignment;
+	}
+
+	auto result = p.next + padding;
+	p.next += padding + bytes;
+	p.remaining -= padding + bytes;
+	p.stats.bytes += padding + bytes;
+	return result;
+}
+
+const char* scene_arena::pool_name(pool_kind pool)
+{
+	switch (pool)
+	{
+	case primitives: return "primitives";
+	case materials: return "materials";
+	case textures: return "textures";
+	default: return "other";
+	}
+}
+
+// One line per pool that has been used
+void scene_arena::print_stats(std::ostream& out) const
+{
+	for (int i = 0; i < pool_count; i++)
+	{
+		const auto& s = pools[i].stats;
+		if (s.objects == 0)
+			continue;
+
+		out << "Arena " << pool_name(static_cast<pool_kind>(i)) << ": " << s.objects << " objects, " << s.bytes << " bytes in "
+			<< s.blocks << (s.blocks == 1 ? " block\n" : " blocks\n");
+	}
+}
+
+// Construct an object in the arena when there is one, otherwise on the heap
+template <typename T, typename... Args>
+shared_ptr<T> arena_make(scene_arena* arena, Args&&... args)
+{
+	return arena ? arena->make<T>(std::forward<Args>(args)...) : make_shared<T>(std::forward<Args>(args)...);
+}
+
+#endif
@@ -4,22 +4,80 @@
 #include "hittable.h"
 #include "vec3.h"
 
+#include <utility>
+
+// Find the nearest root in [t_min, t_max] of a ray against a sphere. The second root is found from the first so it does
+// not suffer cancellation (Haines et al., "Precision Improvements for Ray/Sphere Intersection", Ray Tracing Gems)
+inline bool intersect_sphere(const point3& centre, real radius, const ray& r, real t_min, real t_max, real& t)
+{
+	vec3 oc = r.origin() - centre;
+	auto a = r.direction().length_squared();
+	auto half_b = dot(oc, r.direction());
+	auto c = oc.length_squared() - radius * radius;
+
+#ifdef RT_SINGLE_PRECISION
+	// half_b^2 - a*c rewritten with the offset from the centre to the point where the ray passes closest, as both terms
+	// of the usual form are large and nearly equal for big spheres. Double precision has enough bits left over not to need it
+	vec3 closest = oc - (half_b / a) * r.direction();
+	auto discriminant = a * (radius * radius - closest.length_squared());
+#else
+	auto discriminant = half_b * half_b - a * c;
+#endif
+	if (discriminant < 0) return false;
+
+	// q takes the sign of -half_b so the sum never cancels, the roots are q/a and c/q
+	auto q = -half_b - std::copysign(sqrt(discriminant), half_b);
+	if (q == 0) return false;
+	auto root0 = c / q;
+	auto root1 = q / a;
+	if (root0 > root1)
+		std::swap(root0, root1);
+
+	// Find nearest root that lies in acceptable range
+	t = root0;
+	if (t < t_min || t_max < t)
+	{
+		t = root1;
+		if (t < t_min || t_max < t)
+			return false;
+	}
+
+	return true;
+}
+
+// Move a point found along a ray onto the surface of a sphere, giving the unit outward normal there. The point is then
+// within rounding_error(centre) + rounding_error(radius) of the surface whatever the error in the ray's t was
+inline point3 project_to_sphere(const point3& p, const point3& centre, real radius, vec3& outward_normal)
+{
+	outward_normal = unit_vector(p - centre);
+	return centre + radius * outward_normal;
+}
+
+// uv_scale of a sphere's uvs, taken at the equator where u runs 2 pi r and v runs pi r
+inline real sphere_uv_scale(real radius)
+{
+	return 1 / (sqrt(static_cast<real>(2)) * pi * radius);
+}
+
 // A sphere class with a centre and radius that is hittable
 class sphere : public hittable
 {
 public:
-	sphere(point3 cen, double r, shared_ptr<material> m) : centre(cen), radius(r), mat_ptr(m) {}
+	sphere(point3 cen, real r, shared_ptr<material> m) : centre(cen), radius(r), mat_ptr(m) {}
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override;
+	virtual real pdf_value(const point3& origin, const vec3& direction) const override;
+	virtual vec3 random(const point3& origin) const override;
+	virtual shared_ptr<material> light_material() const override { return mat_ptr; }
 
 public:
 	point3 centre;
-	double radius;
+	real radius;
 	shared_ptr<material> mat_ptr;
 
 private:
-	static void get_sphere_uv(const point3& p, double& u, double& v)
+	static void get_sphere_uv(const point3& p, real& u, real& v)
 	{
 		auto theta = acos(-p.y());
 		auto phi = atan2(-p.z(), p.x()) + pi;
@@ -30,42 +88,67 @@ private:
 };
 
 // The hit function for a sphere
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool sphere::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
-	// Basic math to find if ray hits sphere
-	vec3 oc = r.origin() - centre;
-	auto a = r.direction().length_squared();
-	auto half_b = dot(oc, r.direction());
-	auto c = oc.length_squared() - radius * radius;
-
-	auto discriminant = half_b * half_b - a * c;
-	if (discriminant < 0) return false;
-	auto sqrtd = sqrt(discriminant);
+	count_stat(stat_counter::sphere_tests);
 
-	// Find nearest root that lies in acceptable range
-	auto root = (-half_b - sqrtd) / a;
-	if (root < t_min || t_max < root)
-	{
-		root = (-half_b + sqrtd) / a;
-		if (root < t_min || t_max < root)
-			return false;
-	}
+	real root;
+	if (!intersect_sphere(centre, radius, r, t_min, t_max, root))
+		return false;
 
 	rec.t = root;
-	rec.p = r.at(rec.t);
-	vec3 outward_normal = (rec.p - centre) / radius;
+	vec3 outward_normal;
+	rec.p = project_to_sphere(r.at(rec.t), centre, radius, outward_normal);
+	rec.p_error = rounding_error(centre) + rounding_error(radius);
 	rec.set_face_normal(r, outward_normal);
 	get_sphere_uv(outward_normal, rec.u, rec.v);
-	rec.mat_ptr = mat_ptr;
+	rec.uv_scale = sphere_uv_scale(radius);
+	rec.mat_ptr = mat_ptr.get();
 
 	return true;
 }
 
 // Create a boudning box around a sphere
-bool sphere::bounding_box(double time0, double time1, aabb& output_box) const
+bool sphere::bounding_box(real time0, real time1, aabb& output_box) const
 {
 	output_box = aabb(centre - vec3(radius, radius, radius), centre + vec3(radius, radius, radius));
 	return true;
 }
 
+// Directions are picked uniformly in the cone the sphere fills as seen from origin, which is empty from inside the sphere
+real sphere::pdf_value(const point3& origin, const vec3& direction) const
+{
+	hit_record rec;
+	auto distance_squared = (centre - origin).length_squared();
+	if (distance_squared <= radius * radius || !this->hit(ray(origin, direction), 0, infinity, rec))
+		return 0.0;
+
+	auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+	auto solid_angle = 2 * pi * (1 - cos_theta_max);
+
+	return 1 / solid_angle;
+}
+
+vec3 sphere::random(const point3& origin) const
+{
+	vec3 direction = centre - origin;
+	auto distance_squared = direction.length_squared();
+	if (distance_squared <= radius * radius)
+		return random_unit_vector();
+
+	// A direction in the cone around +z
+	auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+	auto z = 1 + random_double() * (cos_theta_max - 1);
+	auto phi = 2 * pi * random_double();
+	auto sin_theta = sqrt(1 - z * z);
+
+	// Rotate it to be around the direction to the centre
+	vec3 w = unit_vector(direction);
+	vec3 a = fabs(w.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+	vec3 v = unit_vector(cross(w, a));
+	vec3 u = cross(w, v);
+
+	return cos(phi) * sin_theta * u + sin(phi) * sin_theta * v + z * w;
+}
+
 #endif
\ No newline at end of file
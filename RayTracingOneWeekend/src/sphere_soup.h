@@ -0,0 +1,474 @@
+#ifndef SPHERE_SOUP_H
+#define SPHERE_SOUP_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "bvh_builder.h"
+#include "bvh4.h"
+#include "material.h"
+#include "sphere.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#if defined(RT_USE_AVX)
+#include <immintrin.h>
+#elif defined(RT_USE_SSE)
+#include <xmmintrin.h>
+#endif
+
+// A large set of spheres, still or moving, stored as structure of arrays under their own 4-wide BVH. Leaves hold up to
+// leaf_size spheres next to each other in the arrays, so a whole leaf is tested at once with SIMD. Candidates the
+// float test finds are confirmed with the same test as sphere::hit and only the closest hit has its normal and uv worked out
+class sphere_soup : public hittable
+{
+public:
+	sphere_soup() {}
+
+	void add(const point3& centre, real radius, shared_ptr<material> mat);
+	void add(const point3& centre0, const point3& centre1, real time0, real time1, real radius, shared_ptr<material> mat);
+
+	// Build the BVH over every sphere added, moving spheres are bounded over [time0, time1]
+	void build(real time0, real time1);
+
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual int hit_packet(const ray rays[packet_size], int ray_mask, real t_min, real closest[packet_size], hit_record recs[packet_size]) const override;
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override;
+
+	size_t size() const { return radius.size() - padding; }
+
+public:
+	// Centre at time t is base + t * velocity
+	std::vector<float> base_x, base_y, base_z;
+	std::vector<float> velocity_x, velocity_y, velocity_z;
+	std::vector<float> radius;
+	std::vector<uint32_t> material_id;
+	std::vector<shared_ptr<material>> materials;
+	// Per material, whether hits need their u and v
+	std::vector<uint8_t> material_uses_uv;
+
+	std::vector<bvh4_node> nodes;
+	aabb box;
+	double sah_cost = 0;
+
+	static const int leaf_size = 8;
+
+private:
+	// The ray broadcast for the SIMD leaf test
+	struct soup_ray;
+
+	uint32_t find_material(const shared_ptr<material>& mat);
+	int candidate_mask(const soup_ray& sr, uint32_t first, uint32_t count) const;
+#ifdef RT_USE_SSE
+	static int candidate_test(__m128 ocx, __m128 ocy, __m128 ocz, __m128 dx, __m128 dy, __m128 dz, __m128 r, __m128 a, __m128 inv_a,
+		__m128 t_lower, __m128 t_upper);
+#endif
+	bool hit_sphere(uint32_t i, const ray& r, real t_min, real t_max, real& t) const;
+	void set_hit_record(uint32_t i, const ray& r, real t, hit_record& rec) const;
+	void pad();
+
+	static void get_sphere_uv(const point3& p, real& u, real& v)
+	{
+		auto theta = acos(-p.y());
+		auto phi = atan2(-p.z(), p.x()) + pi;
+
+		u = phi / (2 * pi);
+		v = theta / pi;
+	}
+
+	std::unordered_map<const material*, uint32_t> material_index;
+	// Spheres on the end of the arrays that only exist so SIMD loads past the last leaf stay in bounds
+	size_t padding = 0;
+};
+
+struct sphere_soup::soup_ray
+{
+	soup_ray() {}
+	soup_ray(const ray& r, real t_min, real t_max)
+	{
+		auto a = r.direction().length_squared();
+		ox = static_cast<float>(r.origin().x());
+		oy = static_cast<float>(r.origin().y());
+		oz = static_cast<float>(r.origin().z());
+		dx = static_cast<float>(r.direction().x());
+		dy = static_cast<float>(r.direction().y());
+		dz = static_cast<float>(r.direction().z());
+		time = static_cast<float>(r.time());
+		a_f = static_cast<float>(a);
+		inv_a = static_cast<float>(1.0 / a);
+		// Leave room for the error of the float test, the exact test decides
+		t_lower = static_cast<float>(t_min * 0.999 - 1e-3);
+		set_t_upper(t_max);
+	}
+
+	void set_t_upper(real t_max)
+	{
+		t_upper = static_cast<float>(t_max * 1.001 + 1e-3);
+	}
+
+	float ox, oy, oz;
+	float dx, dy, dz;
+	float time;
+	float a_f, inv_a;
+	float t_lower, t_upper;
+};
+
+void sphere_soup::add(const point3& centre, real r, shared_ptr<material> mat)
+{
+	add(centre, centre, 0.0, 1.0, r, mat);
+}
+
+void sphere_soup::add(const point3& centre0, const point3& centre1, real time0, real time1, real r, shared_ptr<material> mat)
+{
+	// Adding after a build, drop the padding first
+	for (; padding > 0; padding--)
+	{
+		base_x.pop_back(); base_y.pop_back(); base_z.pop_back();
+		velocity_x.pop_back(); velocity_y.pop_back(); velocity_z.pop_back();
+		radius.pop_back();
+		material_id.pop_back();
+	}
+
+	auto velocity = time1 > time0 ? (centre1 - centre0) / (time1 - time0) : vec3(0, 0, 0);
+	auto base = centre0 - time0 * velocity;
+
+	base_x.push_back(static_cast<float>(base.x()));
+	base_y.push_back(static_cast<float>(base.y()));
+	base_z.push_back(static_cast<float>(base.z()));
+	velocity_x.push_back(static_cast<float>(velocity.x()));
+	velocity_y.push_back(static_cast<float>(velocity.y()));
+	velocity_z.push_back(static_cast<float>(velocity.z()));
+	radius.push_back(static_cast<float>(r));
+	material_id.push_back(find_material(mat));
+}
+
+uint32_t sphere_soup::find_material(const shared_ptr<material>& mat)
+{
+	auto found = material_index.find(mat.get());
+	if (found != material_index.end())
+		return found->second;
+
+	auto id = static_cast<uint32_t>(materials.size());
+	materials.push_back(mat);
+	material_uses_uv.push_back(mat->uses_uv());
+	material_index[mat.get()] = id;
+	return id;
+}
+
+void sphere_soup::build(real time0, real time1)
+{
+	nodes.clear();
+	auto count = size();
+	if (count == 0)
+		return;
+
+	trace_scope trace("Build sphere BVH", "bvh", "spheres", static_cast<int64_t>(count));
+	std::vector<bvh_build_primitive> build;
+	build.resize(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		vec3 r(radius[i], radius[i], radius[i]);
+		point3 base(base_x[i], base_y[i], base_z[i]);
+		vec3 velocity(velocity_x[i], velocity_y[i], velocity_z[i]);
+		auto c0 = base + time0 * velocity;
+		auto c1 = base + time1 * velocity;
+
+		build[i].bounds = surrounding_box(aabb(c0 - r, c0 + r), aabb(c1 - r, c1 + r));
+		build[i].centroid = 0.5 * (build[i].bounds.min() + build[i].bounds.max());
+		build[i].index = static_cast<uint32_t>(i);
+	}
+
+	std::vector<linear_bvh_node> binary;
+	// A leaf tests four or eight spheres in the time it takes to test one, so fuller leaves are worth it
+	sah_bvh_builder builder(leaf_size);
+	builder.intersection_cost = 0.25;
+	sah_cost = builder.build(build, binary);
+	bvh4::collapse_tree(binary, nodes);
+
+	// Put the spheres in leaf order
+	auto reorder = [&](auto& values) {
+		auto copy = values;
+		for (size_t i = 0; i < count; i++)
+			values[i] = copy[build[i].index];
+	};
+	reorder(base_x); reorder(base_y); reorder(base_z);
+	reorder(velocity_x); reorder(velocity_y); reorder(velocity_z);
+	reorder(radius);
+	reorder(material_id);
+
+	pad();
+
+	box = aabb(point3(binary[0].bounds_min[0], binary[0].bounds_min[1], binary[0].bounds_min[2]),
+		point3(binary[0].bounds_max[0], binary[0].bounds_max[1], binary[0].bounds_max[2]));
+}
+
+// NaN spheres never pass the float test
+void sphere_soup::pad()
+{
+	const float nan = std::numeric_limits<float>::quiet_NaN();
+	for (; padding < static_cast<size_t>(leaf_size); padding++)
+	{
+		base_x.push_back(nan); base_y.push_back(nan); base_z.push_back(nan);
+		velocity_x.push_back(0); velocity_y.push_back(0); velocity_z.push_back(0);
+		radius.push_back(nan);
+		material_id.push_back(0);
+	}
+}
+
+#ifdef RT_USE_SSE
+// Float test of four ray and sphere pairs given the offsets of the ray origins from the sphere centres, returns a bit for each pair that might hit
+int sphere_soup::candidate_test(__m128 ocx, __m128 ocy, __m128 ocz, __m128 dx, __m128 dy, __m128 dz, __m128 r, __m128 a, __m128 inv_a,
+	__m128 t_lower, __m128 t_upper)
+{
+	auto half_b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+	auto c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_mul_ps(r, r));
+	auto b2 = _mm_mul_ps(half_b, half_b);
+	auto ac = _mm_mul_ps(a, c);
+	auto discriminant = _mm_sub_ps(b2, ac);
+
+	// Both terms are large and close for small distant spheres, allow for their rounding
+	auto abs_ac = _mm_andnot_ps(_mm_set1_ps(-0.0f), ac);
+	auto tolerance = _mm_mul_ps(_mm_set1_ps(1e-5f), _mm_add_ps(b2, abs_ac));
+	auto possible = _mm_cmpge_ps(discriminant, _mm_sub_ps(_mm_setzero_ps(), tolerance));
+
+	auto sqrtd = _mm_sqrt_ps(_mm_max_ps(discriminant, _mm_setzero_ps()));
+	auto t_near = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), half_b), sqrtd), inv_a);
+	auto t_far = _mm_mul_ps(_mm_add_ps(_mm_sub_ps(_mm_setzero_ps(), half_b), sqrtd), inv_a);
+	possible = _mm_and_ps(possible, _mm_cmpge_ps(t_far, t_lower));
+	possible = _mm_and_ps(possible, _mm_cmple_ps(t_near, t_upper));
+
+	return _mm_movemask_ps(possible);
+}
+#endif
+
+// Float test of up to leaf_size spheres starting at first, returns a bit for every sphere the ray might hit. Larger
+// leaves are tested leaf_size spheres at a time by the caller
+int sphere_soup::candidate_mask(const soup_ray& sr, uint32_t first, uint32_t count) const
+{
+	int mask = 0;
+
+#if defined(RT_USE_AVX)
+	const __m256 time = _mm256_set1_ps(sr.time);
+	auto ocx = _mm256_sub_ps(_mm256_set1_ps(sr.ox), _mm256_add_ps(_mm256_loadu_ps(&base_x[first]), _mm256_mul_ps(time, _mm256_loadu_ps(&velocity_x[first]))));
+	auto ocy = _mm256_sub_ps(_mm256_set1_ps(sr.oy), _mm256_add_ps(_mm256_loadu_ps(&base_y[first]), _mm256_mul_ps(time, _mm256_loadu_ps(&velocity_y[first]))));
+	auto ocz = _mm256_sub_ps(_mm256_set1_ps(sr.oz), _mm256_add_ps(_mm256_loadu_ps(&base_z[first]), _mm256_mul_ps(time, _mm256_loadu_ps(&velocity_z[first]))));
+	auto r = _mm256_loadu_ps(&radius[first]);
+
+	auto half_b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, _mm256_set1_ps(sr.dx)), _mm256_mul_ps(ocy, _mm256_set1_ps(sr.dy))),
+		_mm256_mul_ps(ocz, _mm256_set1_ps(sr.dz)));
+	auto c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_mul_ps(r, r));
+	auto b2 = _mm256_mul_ps(half_b, half_b);
+	auto ac = _mm256_mul_ps(_mm256_set1_ps(sr.a_f), c);
+	auto discriminant = _mm256_sub_ps(b2, ac);
+
+	// Both terms are large and close for small distant spheres, allow for their rounding
+	auto abs_ac = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), ac);
+	auto tolerance = _mm256_mul_ps(_mm256_set1_ps(1e-5f), _mm256_add_ps(b2, abs_ac));
+	auto possible = _mm256_cmp_ps(discriminant, _mm256_sub_ps(_mm256_setzero_ps(), tolerance), _CMP_GE_OQ);
+
+	auto sqrtd = _mm256_sqrt_ps(_mm256_max_ps(discriminant, _mm256_setzero_ps()));
+	auto inv_a = _mm256_set1_ps(sr.inv_a);
+	auto t_near = _mm256_mul_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_setzero_ps(), half_b), sqrtd), inv_a);
+	auto t_far = _mm256_mul_ps(_mm256_add_ps(_mm256_sub_ps(_mm256_setzero_ps(), half_b), sqrtd), inv_a);
+	possible = _mm256_and_ps(possible, _mm256_cmp_ps(t_far, _mm256_set1_ps(sr.t_lower), _CMP_GE_OQ));
+	possible = _mm256_and_ps(possible, _mm256_cmp_ps(t_near, _mm256_set1_ps(sr.t_upper), _CMP_LE_OQ));
+
+	mask = _mm256_movemask_ps(possible);
+#elif defined(RT_USE_SSE)
+	const __m128 time = _mm_set1_ps(sr.time);
+	for (uint32_t g = 0; g < count; g += 4)
+	{
+		auto i = first + g;
+		auto ocx = _mm_sub_ps(_mm_set1_ps(sr.ox), _mm_add_ps(_mm_loadu_ps(&base_x[i]), _mm_mul_ps(time, _mm_loadu_ps(&velocity_x[i]))));
+		auto ocy = _mm_sub_ps(_mm_set1_ps(sr.oy), _mm_add_ps(_mm_loadu_ps(&base_y[i]), _mm_mul_ps(time, _mm_loadu_ps(&velocity_y[i]))));
+		auto ocz = _mm_sub_ps(_mm_set1_ps(sr.oz), _mm_add_ps(_mm_loadu_ps(&base_z[i]), _mm_mul_ps(time, _mm_loadu_ps(&velocity_z[i]))));
+
+		mask |= candidate_test(ocx, ocy, ocz, _mm_set1_ps(sr.dx), _mm_set1_ps(sr.dy), _mm_set1_ps(sr.dz), _mm_loadu_ps(&radius[i]),
+			_mm_set1_ps(sr.a_f), _mm_set1_ps(sr.inv_a), _mm_set1_ps(sr.t_lower), _mm_set1_ps(sr.t_upper)) << g;
+	}
+#else
+	// Without SIMD every sphere goes straight to the exact test
+	mask = (1 << leaf_size) - 1;
+#endif
+
+	return count < static_cast<uint32_t>(leaf_size) ? mask & ((1 << count) - 1) : mask;
+}
+
+// The exact test sphere::hit uses, giving only the root
+bool sphere_soup::hit_sphere(uint32_t i, const ray& r, real t_min, real t_max, real& t) const
+{
+	point3 centre = point3(base_x[i], base_y[i], base_z[i]) + r.time() * vec3(velocity_x[i], velocity_y[i], velocity_z[i]);
+	return intersect_sphere(centre, radius[i], r, t_min, t_max, t);
+}
+
+// Fill in a hit found by hit_sphere
+void sphere_soup::set_hit_record(uint32_t i, const ray& r, real t, hit_record& rec) const
+{
+	point3 centre = point3(base_x[i], base_y[i], base_z[i]) + r.time() * vec3(velocity_x[i], velocity_y[i], velocity_z[i]);
+
+	rec.t = t;
+	vec3 outward_normal;
+	rec.p = project_to_sphere(r.at(rec.t), centre, radius[i], outward_normal);
+	rec.p_error = rounding_error(centre) + rounding_error(static_cast<real>(radius[i]));
+	rec.set_face_normal(r, outward_normal);
+	if (material_uses_uv[material_id[i]])
+	{
+		get_sphere_uv(outward_normal, rec.u, rec.v);
+		rec.uv_scale = sphere_uv_scale(radius[i]);
+	}
+	else
+	{
+		rec.u = rec.v = rec.uv_scale = 0;
+	}
+	rec.mat_ptr = materials[material_id[i]].get();
+}
+
+// Walk the tree like bvh4, testing whole leaves at once. Leaves of spheres with coincident centres can hold more than
+// leaf_size, they are tested leaf_size at a time
+bool sphere_soup::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	soup_ray sr(r, t_min, t_max);
+	int64_t closest_sphere = -1;
+	real closest = t_max;
+
+	bvh4::traverse(nodes, r, t_min, t_max, [&](uint32_t first, uint32_t count, real) {
+		count_stat(stat_counter::sphere_tests, count);
+		for (uint32_t start = first; start < first + count; start += leaf_size)
+		{
+			int mask = candidate_mask(sr, start, std::min<uint32_t>(leaf_size, first + count - start));
+			for (uint32_t lane = 0; mask; lane++, mask >>= 1)
+			{
+				real t;
+				if ((mask & 1) && hit_sphere(start + lane, r, t_min, closest, t))
+				{
+					closest_sphere = start + lane;
+					closest = t;
+					sr.set_t_upper(t);
+				}
+			}
+		}
+		return closest;
+	});
+
+	if (closest_sphere < 0)
+		return false;
+
+	set_hit_record(static_cast<uint32_t>(closest_sphere), r, closest, rec);
+	return true;
+}
+
+// Walk the tree once for the packet. With SSE each sphere of a leaf is tested against four of the packet's rays at
+// a time, otherwise every ray that reaches a leaf tests it on its own
+int sphere_soup::hit_packet(const ray rays[packet_size], int ray_mask, real t_min, real closest[packet_size], hit_record recs[packet_size]) const
+{
+	if (nodes.empty() || ray_mask == 0)
+		return 0;
+
+	const bvh4::ray_packet packet(rays);
+	int64_t closest_sphere[packet_size];
+	soup_ray srs[packet_size];
+	for (int k = 0; k < packet_size; k++)
+	{
+		closest_sphere[k] = -1;
+		srs[k] = soup_ray(rays[k], t_min, closest[k]);
+	}
+
+	auto exact_test = [&](uint32_t i, int k) {
+		real t;
+		if (hit_sphere(i, rays[k], t_min, closest[k], t))
+		{
+			closest_sphere[k] = i;
+			closest[k] = t;
+			srs[k].set_t_upper(t);
+		}
+	};
+
+#ifdef RT_USE_SSE
+	const int groups = bvh4::packet_groups;
+	__m128 origin[3][groups], direction[3][groups], time[groups], a[groups], inv_a[groups], t_lower[groups];
+	for (int g = 0; g < groups; g++)
+	{
+		const soup_ray* sr = &srs[4 * g];
+		origin[0][g] = _mm_setr_ps(sr[0].ox, sr[1].ox, sr[2].ox, sr[3].ox);
+		origin[1][g] = _mm_setr_ps(sr[0].oy, sr[1].oy, sr[2].oy, sr[3].oy);
+		origin[2][g] = _mm_setr_ps(sr[0].oz, sr[1].oz, sr[2].oz, sr[3].oz);
+		direction[0][g] = _mm_setr_ps(sr[0].dx, sr[1].dx, sr[2].dx, sr[3].dx);
+		direction[1][g] = _mm_setr_ps(sr[0].dy, sr[1].dy, sr[2].dy, sr[3].dy);
+		direction[2][g] = _mm_setr_ps(sr[0].dz, sr[1].dz, sr[2].dz, sr[3].dz);
+		time[g] = _mm_setr_ps(sr[0].time, sr[1].time, sr[2].time, sr[3].time);
+		a[g] = _mm_setr_ps(sr[0].a_f, sr[1].a_f, sr[2].a_f, sr[3].a_f);
+		inv_a[g] = _mm_setr_ps(sr[0].inv_a, sr[1].inv_a, sr[2].inv_a, sr[3].inv_a);
+		t_lower[g] = _mm_setr_ps(sr[0].t_lower, sr[1].t_lower, sr[2].t_lower, sr[3].t_lower);
+	}
+
+	bvh4::traverse_packet(nodes, packet, ray_mask, t_min, closest, [&](uint32_t first, uint32_t count, int leaf_mask) {
+		count_stat(stat_counter::sphere_tests, count * bit_count(leaf_mask));
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			auto r = _mm_set1_ps(radius[i]);
+			for (int g = 0; g < groups; g++)
+			{
+				int lanes = (leaf_mask >> (4 * g)) & 15;
+				if (!lanes)
+					continue;
+
+				const soup_ray* sr = &srs[4 * g];
+				auto ocx = _mm_sub_ps(origin[0][g], _mm_add_ps(_mm_set1_ps(base_x[i]), _mm_mul_ps(time[g], _mm_set1_ps(velocity_x[i]))));
+				auto ocy = _mm_sub_ps(origin[1][g], _mm_add_ps(_mm_set1_ps(base_y[i]), _mm_mul_ps(time[g], _mm_set1_ps(velocity_y[i]))));
+				auto ocz = _mm_sub_ps(origin[2][g], _mm_add_ps(_mm_set1_ps(base_z[i]), _mm_mul_ps(time[g], _mm_set1_ps(velocity_z[i]))));
+				auto t_upper = _mm_setr_ps(sr[0].t_upper, sr[1].t_upper, sr[2].t_upper, sr[3].t_upper);
+
+				int mask = lanes & candidate_test(ocx, ocy, ocz, direction[0][g], direction[1][g], direction[2][g], r, a[g], inv_a[g], t_lower[g], t_upper);
+				for (int lane = 0; mask; lane++, mask >>= 1)
+				{
+					if (mask & 1)
+						exact_test(i, 4 * g + lane);
+				}
+			}
+		}
+	});
+#else
+	bvh4::traverse_packet(nodes, packet, ray_mask, t_min, closest, [&](uint32_t first, uint32_t count, int leaf_mask) {
+		count_stat(stat_counter::sphere_tests, count * bit_count(leaf_mask));
+		for (int k = 0; k < packet_size; k++)
+		{
+			if (!(leaf_mask & (1 << k)))
+				continue;
+
+			for (uint32_t start = first; start < first + count; start += leaf_size)
+			{
+				int mask = candidate_mask(srs[k], start, std::min<uint32_t>(leaf_size, first + count - start));
+				for (uint32_t lane = 0; mask; lane++, mask >>= 1)
+				{
+					if (mask & 1)
+						exact_test(start + lane, k);
+				}
+			}
+		}
+	});
+#endif
+
+	int hit_mask = 0;
+	for (int k = 0; k < packet_size; k++)
+	{
+		if (closest_sphere[k] < 0)
+			continue;
+
+		set_hit_record(static_cast<uint32_t>(closest_sphere[k]), rays[k], closest[k], recs[k]);
+		hit_mask |= 1 << k;
+	}
+
+	return hit_mask;
+}
+
+bool sphere_soup::bounding_box(real time0, real time1, aabb& output_box) const
+{
+	output_box = box;
+	return !nodes.empty();
+}
+
+#endif
@@ -4,12 +4,21 @@
 #include "rtweekend.h"
 #include "rtw_stb_image.h"
 #include "perlin.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
 
 // Basic texture with ability to find the colour at a specific point
 class texture
 {
 public:
-	virtual colour value(double u, double v, const point3& p) const = 0;
+	virtual colour value(real u, real v, const point3& p) const = 0;
+	// The colour averaged over a footprint around (u, v) that many uv units wide, textures that are not filtered ignore it
+	virtual colour value(real u, real v, const point3& p, real footprint) const { return value(u, v, p); }
+	// False when value ignores u and v, so hits do not need to work them out
+	virtual bool uses_uv() const { return true; }
 };
 
 // A solid colour texture
@@ -19,13 +28,15 @@ public:
 	solid_colour() {}
 	solid_colour(colour c) : colour_value(c) {}
 
-	solid_colour(double red, double green, double blue) : solid_colour(colour(red, green, blue)) {}
+	solid_colour(real red, real green, real blue) : solid_colour(colour(red, green, blue)) {}
 
-	virtual colour value(double u, double v, const vec3& p) const override
+	virtual colour value(real u, real v, const vec3& p) const override
 	{
 		return colour_value;
 	}
 
+	virtual bool uses_uv() const override { return false; }
+
 private:
 	colour colour_value;
 };
@@ -40,7 +51,7 @@ public:
 	checker_texture(colour c1, colour c2) : even(make_shared<solid_colour>(c1)), odd(make_shared<solid_colour>(c2)) {}
 
 	// Get the colour value at a point
-	virtual colour value(double u, double v, const point3& p) const override
+	virtual colour value(real u, real v, const point3& p) const override
 	{
 		auto sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
 		if (sines < 0)
@@ -49,6 +60,17 @@ public:
 			return even->value(u, v, p);
 	}
 
+	virtual colour value(real u, real v, const point3& p, real footprint) const override
+	{
+		auto sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
+		if (sines < 0)
+			return odd->value(u, v, p, footprint);
+		else
+			return even->value(u, v, p, footprint);
+	}
+
+	virtual bool uses_uv() const override { return odd->uses_uv() || even->uses_uv(); }
+
 public:
 	shared_ptr<texture> odd;
 	shared_ptr<texture> even;
@@ -59,70 +81,186 @@ class noise_texture : public texture
 {
 public:
 	noise_texture() {}
-	noise_texture(double sc) : scale(sc) {}
+	noise_texture(real sc) : scale(sc) {}
 
-	virtual colour value(double u, double v, const point3& p) const override
+	virtual colour value(real u, real v, const point3& p) const override
 	{
 		//return colour(1, 1, 1) * noise.turb(scale * p);
 		return colour(1, 1, 1) * 0.5 * (1 + sin(scale * p.z() + 10 * noise.turb(p)));
 	}
 
+	virtual bool uses_uv() const override { return false; }
+
 public:
 	perlin noise;
-	double scale;
+	real scale;
 };
 
+// An image looked up through a pyramid of mip maps, each half the size of the one before. Levels are stored in 4x4
+// tiles of one cache line each, so the texels a lookup blends are nearly always in one line, and a lookup reads the level
+// whose texels are about as wide as its footprint, so distant lookups touch few lines and average out detail too fine to
+// see rather than picking from it at random
 class image_texture : public texture
 {
 public:
-	const static int bytes_per_pixel = 3;
+	image_texture() {}
+	image_texture(const char* filename);
+
+	virtual colour value(real u, real v, const vec3& p) const override { return value(u, v, p, 0); }
+	virtual colour value(real u, real v, const vec3& p, real footprint) const override;
 
-	image_texture() : data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
+	int width() const { return levels.empty() ? 0 : levels[0].width; }
+	int height() const { return levels.empty() ? 0 : levels[0].height; }
+	int level_count() const { return static_cast<int>(levels.size()); }
 
-	image_texture(const char* filename)
+	static const int tile_size = 4;
+
+private:
+	// The fourth byte pads a texel to 4 bytes so a tile fills a 64 byte line
+	struct texel
 	{
-		auto components_per_pixel = bytes_per_pixel;
+		uint8_t r, g, b, pad;
+	};
 
-		data = stbi_load(filename, &width, &height, &components_per_pixel, components_per_pixel);
+	struct alignas(64) texel_tile
+	{
+		texel texels[tile_size * tile_size];
+	};
 
-		if (!data)
-		{
-			std::cerr << "ERROR: Could not open image texture file '" << filename << "'.\n";
-			width = height = 0;
-		}
+	struct mip_level
+	{
+		int width = 0, height = 0;
+		int tiles_x = 0;
+		std::vector<texel_tile> tiles;
+
+		mip_level(int width, int height);
+
+		texel& at(int x, int y) { return tiles[(y / tile_size) * tiles_x + x / tile_size].texels[(y % tile_size) * tile_size + x % tile_size]; }
+		const texel& at(int x, int y) const { return tiles[(y / tile_size) * tiles_x + x / tile_size].texels[(y % tile_size) * tile_size + x % tile_size]; }
+	};
 
-		bytes_per_scanline = bytes_per_pixel * width;
+	// The level blended between the four texels around (u, v), in bytes
+	static colour bilinear(const mip_level& level, real u, real v);
+
+	std::vector<mip_level> levels;
+	// Texels of the first level across one uv unit, sqrt(width * height) to take the mean of both directions
+	real texels_per_uv = 0;
+};
+
+image_texture::mip_level::mip_level(int width, int height)
+	: width(width), height(height), tiles_x((width + tile_size - 1) / tile_size),
+	tiles(static_cast<size_t>(tiles_x) * ((height + tile_size - 1) / tile_size))
+{
+}
+
+image_texture::image_texture(const char* filename)
+{
+	trace_scope trace("Load texture", "texture");
+	const int bytes_per_pixel = 3;
+	int image_width, image_height;
+	auto components_per_pixel = bytes_per_pixel;
+
+	auto data = stbi_load(filename, &image_width, &image_height, &components_per_pixel, components_per_pixel);
+
+	if (!data)
+	{
+		std::cerr << "ERROR: Could not open image texture file '" << filename << "'.\n";
+		return;
 	}
 
-	~image_texture()
+	levels.emplace_back(image_width, image_height);
+	auto& base = levels[0];
+	for (int y = 0; y < image_height; y++)
 	{
-		delete data;
+		for (int x = 0; x < image_width; x++)
+		{
+			auto pixel = data + (static_cast<size_t>(y) * image_width + x) * bytes_per_pixel;
+			base.at(x, y) = texel{ pixel[0], pixel[1], pixel[2], 0 };
+		}
 	}
+	stbi_image_free(data);
+	texels_per_uv = sqrt(static_cast<real>(image_width) * image_height);
 
-	virtual colour value(double u, double v, const vec3& p) const override
+	// Each texel of a level is the rounded average of the 2x2 texels it covers in the one before. The last row or
+	// column of a level with an odd size is left out
+	trace_scope mip_trace("Build mip maps", "texture");
+	while (levels.back().width > 1 || levels.back().height > 1)
 	{
-		if (data == nullptr)
-			return colour(0,1,1);
+		const auto& previous = levels.back();
+		mip_level next(std::max(1, previous.width / 2), std::max(1, previous.height / 2));
+		for (int y = 0; y < next.height; y++)
+		{
+			int y0 = std::min(2 * y, previous.height - 1), y1 = std::min(2 * y + 1, previous.height - 1);
+			for (int x = 0; x < next.width; x++)
+			{
+				int x0 = std::min(2 * x, previous.width - 1), x1 = std::min(2 * x + 1, previous.width - 1);
+				const texel* corners[4] = { &previous.at(x0, y0), &previous.at(x1, y0), &previous.at(x0, y1), &previous.at(x1, y1) };
+				int r = 2, g = 2, b = 2;
+				for (auto corner : corners)
+				{
+					r += corner->r;
+					g += corner->g;
+					b += corner->b;
+				}
+				next.at(x, y) = texel{ static_cast<uint8_t>(r / 4), static_cast<uint8_t>(g / 4), static_cast<uint8_t>(b / 4), 0 };
+			}
+		}
+		levels.push_back(std::move(next));
+	}
+}
 
-		u = clamp(u, 0.0, 1.0);
-		v = 1.0 - clamp(v, 0.0, 1.0);
+colour image_texture::bilinear(const mip_level& level, real u, real v)
+{
+	// Texel centres are half a texel in from their edges, lookups past the outer centres take the edge texels
+	auto x = u * level.width - 0.5;
+	auto y = v * level.height - 0.5;
+	auto fx = floor(x), fy = floor(y);
+	auto tx = x - fx, ty = y - fy;
 
-		auto i = static_cast<int>(u * width);
-		auto j = static_cast<int>(v * height);
+	int x0 = static_cast<int>(fx), y0 = static_cast<int>(fy);
+	int x1 = std::min(x0 + 1, level.width - 1), y1 = std::min(y0 + 1, level.height - 1);
+	x0 = std::max(x0, 0);
+	y0 = std::max(y0, 0);
+	x1 = std::max(x1, 0);
+	y1 = std::max(y1, 0);
 
-		if (i >= width) i = width - 1;
-		if (j >= height) j = height - 1;
+	auto blend = [](const texel& a, const texel& b, real t) {
+		return colour(a.r + t * (b.r - a.r), a.g + t * (b.g - a.g), a.b + t * (b.b - a.b));
+	};
+	auto top = blend(level.at(x0, y0), level.at(x1, y0), tx);
+	auto bottom = blend(level.at(x0, y1), level.at(x1, y1), tx);
+	return top + ty * (bottom - top);
+}
 
-		const auto colour_scale = 1.0 / 255.0;
-		auto pixel = data + j * bytes_per_scanline + i * bytes_per_pixel;
+// Trilinear, blending the two levels whose texels are nearest the footprint's width
+colour image_texture::value(real u, real v, const vec3& p, real footprint) const
+{
+	if (levels.empty())
+		return colour(0,1,1);
 
-		return colour(colour_scale * pixel[0], colour_scale * pixel[1], colour_scale * pixel[2]);
-	}
+	u = clamp(u, 0.0, 1.0);
+	v = 1.0 - clamp(v, 0.0, 1.0);
 
-private:
-	unsigned char* data;
-	int width, height;
-	int bytes_per_scanline;
-};
+	const auto colour_scale = 1.0 / 255.0;
+
+	// Each level up halves the texels across the footprint, so the level is their log2. The exponent gives the finer
+	// level and the mantissa how far the width is towards the next, blending linearly in width between them
+	auto texels = footprint * texels_per_uv;
+	if (!(texels > 1))
+		return colour_scale * bilinear(levels[0], u, v);
+
+	int exponent;
+	auto mantissa = frexp(texels, &exponent);
+	int fine = exponent - 1;
+	int last = level_count() - 1;
+	if (fine >= last)
+		return colour_scale * bilinear(levels[last], u, v);
+
+	// texels is 2^fine * (1 + t)
+	auto t = 2 * mantissa - 1;
+	auto a = bilinear(levels[fine], u, v);
+	auto b = bilinear(levels[fine + 1], u, v);
+	return colour_scale * (a + t * (b - a));
+}
 
-#endif
\ No newline at end of file
+#endif
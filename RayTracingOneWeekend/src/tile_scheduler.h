@@ -0,0 +1,173 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include "trace.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A rectangular block of pixels [x0, x1) x [y0, y1) rendered as one unit of work
+struct tile
+{
+	int x0, y0;
+	int x1, y1;
+};
+
+// A fixed pool of worker threads that render an image tile by tile.
+// Each worker owns a deque of tiles, takes work from the front of its own deque and steals from the back of
+// the other workers' deques once it runs dry. The threads persist between calls to run().
+class tile_scheduler
+{
+public:
+	using tile_function = std::function<void(const tile&, int worker)>;
+
+	// Create the pool, a thread count of 0 uses one thread per hardware thread
+	tile_scheduler(int thread_count = 0);
+	~tile_scheduler();
+
+	tile_scheduler(const tile_scheduler&) = delete;
+	tile_scheduler& operator=(const tile_scheduler&) = delete;
+
+	// Split the image into tiles of tile_size x tile_size pixels and block until work has been called on every one
+	void run(int image_width, int image_height, int tile_size, const tile_function& work);
+
+	int thread_count() const { return static_cast<int>(workers.size()); }
+
+private:
+	struct work_queue
+	{
+		std::mutex lock;
+		std::deque<tile> tiles;
+	};
+
+	void worker_loop(int index);
+	bool pop_tile(int index, tile& t);
+	bool steal_tile(int index, tile& t);
+
+private:
+	std::vector<std::thread> workers;
+	std::vector<work_queue> queues;
+
+	// Guards everything below, used to start a frame and to wait for it to finish
+	std::mutex state_mutex;
+	std::condition_variable start_cv;
+	std::condition_variable done_cv;
+	const tile_function* job = nullptr;
+	unsigned long long generation = 0;
+	int busy_workers = 0;
+	bool stopping = false;
+};
+
+tile_scheduler::tile_scheduler(int thread_count) : queues(thread_count > 0 ? thread_count : std::max(1u, std::thread::hardware_concurrency()))
+{
+	for (int i = 0; i < static_cast<int>(queues.size()); i++)
+		workers.emplace_back(&tile_scheduler::worker_loop, this, i);
+}
+
+tile_scheduler::~tile_scheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(state_mutex);
+		stopping = true;
+	}
+	start_cv.notify_all();
+
+	for (auto& worker : workers)
+		worker.join();
+}
+
+void tile_scheduler::run(int image_width, int image_height, int tile_size, const tile_function& work)
+{
+	tile_size = std::max(1, tile_size);
+
+	// Deal the tiles out round robin so every worker starts with a spread of the image
+	size_t next_queue = 0;
+	for (int y = 0; y < image_height; y += tile_size)
+	{
+		for (int x = 0; x < image_width; x += tile_size)
+		{
+			tile t{ x, y, std::min(x + tile_size, image_width), std::min(y + tile_size, image_height) };
+			auto& queue = queues[next_queue];
+			std::lock_guard<std::mutex> lock(queue.lock);
+			queue.tiles.push_back(t);
+			next_queue = (next_queue + 1) % queues.size();
+		}
+	}
+
+	std::unique_lock<std::mutex> lock(state_mutex);
+	job = &work;
+	busy_workers = thread_count();
+	generation++;
+	start_cv.notify_all();
+
+	done_cv.wait(lock, [this] { return busy_workers == 0; });
+	job = nullptr;
+}
+
+void tile_scheduler::worker_loop(int index)
+{
+	unsigned long long seen_generation = 0;
+	name_trace_thread("worker " + std::to_string(index));
+
+	while (true)
+	{
+		const tile_function* work;
+		{
+			std::unique_lock<std::mutex> lock(state_mutex);
+			start_cv.wait(lock, [&] { return stopping || generation != seen_generation; });
+			if (stopping)
+				return;
+			seen_generation = generation;
+			work = job;
+		}
+
+		// No tiles are added while a frame is running, so once every queue is empty this worker is done
+		tile t;
+		while (pop_tile(index, t) || steal_tile(index, t))
+			(*work)(t, index);
+
+		std::lock_guard<std::mutex> lock(state_mutex);
+		if (--busy_workers == 0)
+			done_cv.notify_all();
+	}
+}
+
+// Take the next tile from the worker's own queue
+bool tile_scheduler::pop_tile(int index, tile& t)
+{
+	auto& queue = queues[index];
+	std::lock_guard<std::mutex> lock(queue.lock);
+	if (queue.tiles.empty())
+		return false;
+
+	t = queue.tiles.front();
+	queue.tiles.pop_front();
+	return true;
+}
+
+// Take a tile from the far end of another worker's queue
+bool tile_scheduler::steal_tile(int index, tile& t)
+{
+	auto count = static_cast<int>(queues.size());
+	for (int offset = 1; offset < count; offset++)
+	{
+		auto& victim = queues[(index + offset) % count];
+		std::lock_guard<std::mutex> lock(victim.lock);
+		if (victim.tiles.empty())
+			continue;
+
+		t = victim.tiles.back();
+		victim.tiles.pop_back();
+		return true;
+	}
+
+	return false;
+}
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A timeline of what every thread did, written as Chrome trace event JSON for Perfetto or chrome://tracing.
+// Tracing is off until start_trace is called. Each thread records into a buffer of its own, so recording an event
+// never waits on another thread, only a thread's first event takes a lock to register its buffer
+struct trace_event
+{
+	// Names and categories are string literals, so events only hold pointers to them
+	const char* name;
+	const char* category;
+	int64_t start_ns;
+	int64_t duration_ns;
+	// Up to two integer arguments, unused ones have no name
+	const char* arg_names[2];
+	int64_t args[2];
+};
+
+struct trace_buffer
+{
+	int thread_id = 0;
+	std::string thread_name;
+	std::vector<trace_event> events;
+};
+
+struct trace_state
+{
+	std::atomic<bool> enabled{ false };
+	std::chrono::steady_clock::time_point origin;
+
+	// Guards the list of buffers, not what is in them
+	std::mutex buffers_mutex;
+	std::vector<std::unique_ptr<trace_buffer>> buffers;
+};
+
+inline trace_state& global_trace()
+{
+	static trace_state state;
+	return state;
+}
+
+inline bool tracing()
+{
+	return global_trace().enabled.load(std::memory_order_relaxed);
+}
+
+// Nanoseconds since tracing started
+inline int64_t trace_now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - global_trace().origin).count();
+}
+
+inline void start_trace()
+{
+	auto& state = global_trace();
+	state.origin = std::chrono::steady_clock::now();
+	state.enabled = true;
+}
+
+// The calling thread's buffer, registered the first time it is asked for
+inline trace_buffer& thread_trace_buffer()
+{
+	thread_local trace_buffer* buffer = nullptr;
+	if (!buffer)
+	{
+		auto& state = global_trace();
+		std::lock_guard<std::mutex> lock(state.buffers_mutex);
+		state.buffers.emplace_back(new trace_buffer());
+		buffer = state.buffers.back().get();
+		buffer->thread_id = static_cast<int>(state.buffers.size());
+		buffer->thread_name = "thread " + std::to_string(buffer->thread_id);
+	}
+	return *buffer;
+}
+
+// Name the calling thread's track in the timeline
+inline void name_trace_thread(const std::string& name)
+{
+	if (tracing())
+		thread_trace_buffer().thread_name = name;
+}
+
+// Records the time from its construction to its destruction as one event on the calling thread's track
+class trace_scope
+{
+public:
+	trace_scope(const char* name, const char* category, const char* arg0 = nullptr, int64_t value0 = 0, const char* arg1 = nullptr, int64_t value1 = 0)
+		: event{ name, category, tracing() ? trace_now() : -1, 0, { arg0, arg1 }, { value0, value1 } }
+	{
+	}
+
+	~trace_scope()
+	{
+		if (event.start_ns < 0)
+			return;
+
+		event.duration_ns = trace_now() - event.start_ns;
+		thread_trace_buffer().events.push_back(event);
+	}
+
+	trace_scope(const trace_scope&) = delete;
+	trace_scope& operator=(const trace_scope&) = delete;
+
+private:
+	trace_event event;
+};
+
+// Write every thread's events. Call it once the threads have stopped recording, as their buffers are read without
+// taking any lock
+inline bool write_trace(const std::string& path)
+{
+	std::ofstream out(path);
+	if (!out)
+	{
+		std::cerr << "ERROR: Could not write trace '" << path << "'.\n";
+		return false;
+	}
+
+	auto& state = global_trace();
+	std::lock_guard<std::mutex> lock(state.buffers_mutex);
+
+	// Times are in microseconds, written to the nanosecond
+	auto microseconds = [](int64_t ns) {
+		char text[32];
+		std::snprintf(text, sizeof(text), "%lld.%03d", static_cast<long long>(ns / 1000), static_cast<int>(ns % 1000));
+		return std::string(text);
+	};
+
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	bool first = true;
+	for (const auto& buffer : state.buffers)
+	{
+		out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->thread_id
+			<< ",\"args\":{\"name\":\"" << buffer->thread_name << "\"}}";
+		first = false;
+
+		for (const auto& event : buffer->events)
+		{
+			out << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"" << event.category << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->thread_id
+				<< ",\"ts\":" << microseconds(event.start_ns) << ",\"dur\":" << microseconds(event.duration_ns);
+			if (event.arg_names[0])
+			{
+				out << ",\"args\":{\"" << event.arg_names[0] << "\":" << event.args[0];
+				if (event.arg_names[1])
+					out << ",\"" << event.arg_names[1] << "\":" << event.args[1];
+				out << '}';
+			}
+			out << '}';
+		}
+	}
+	out << "\n]}\n";
+
+	if (!out)
+	{
+		std::cerr << "ERROR: Could not write trace '" << path << "'.\n";
+		return false;
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,457 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "bvh_builder.h"
+#include "bvh4.h"
+#include "material.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#ifdef RT_USE_SSE
+#include <xmmintrin.h>
+#endif
+
+// Indexed triangles. Normals and uvs are optional, when present there is one per position and the triangles index all three alike
+struct mesh_data
+{
+	std::vector<point3> positions;
+	std::vector<vec3> normals;
+	// Two per vertex
+	std::vector<real> uvs;
+	// Three per triangle, wound counter clockwise seen from the front
+	std::vector<uint32_t> indices;
+
+	size_t triangle_count() const { return indices.size() / 3; }
+
+	// Check every array has the right size and every index is in range
+	bool validate() const;
+};
+
+bool mesh_data::validate() const
+{
+	if (indices.size() % 3 != 0)
+	{
+		std::cerr << "ERROR: Mesh has " << indices.size() << " indices, not a multiple of three.\n";
+		return false;
+	}
+	if (!normals.empty() && normals.size() != positions.size())
+	{
+		std::cerr << "ERROR: Mesh has " << normals.size() << " normals for " << positions.size() << " positions.\n";
+		return false;
+	}
+	if (!uvs.empty() && uvs.size() != 2 * positions.size())
+	{
+		std::cerr << "ERROR: Mesh has " << uvs.size() / 2 << " uvs for " << positions.size() << " positions.\n";
+		return false;
+	}
+	for (auto index : indices)
+	{
+		if (index >= positions.size())
+		{
+			std::cerr << "ERROR: Mesh index " << index << " is out of range of " << positions.size() << " positions.\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+// A triangle mesh under its own 4-wide BVH. Like sphere_soup, each leaf holds up to leaf_size triangles whose first vertex
+// and edges are copied into float arrays in leaf order, so a whole leaf is tested at once with SIMD. The float test only
+// rejects triangles it can prove are missed, candidates are confirmed with a Moller-Trumbore test on the mesh's own vertices.
+// The mesh is built once and can be placed any number of times with instance
+class triangle_mesh : public hittable
+{
+public:
+	triangle_mesh() {}
+	triangle_mesh(mesh_data data, shared_ptr<material> mat);
+
+	// Replace the triangles and build the BVH over them
+	void set_mesh(mesh_data data);
+
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const override;
+	virtual int hit_packet(const ray rays[packet_size], int ray_mask, real t_min, real closest[packet_size], hit_record recs[packet_size]) const override;
+	virtual bool bounding_box(real time0, real time1, aabb& output_box) const override;
+
+	size_t size() const { return mesh.triangle_count(); }
+
+public:
+	// Triangles are reordered into leaf order by the build
+	mesh_data mesh;
+	shared_ptr<material> mat_ptr;
+
+	// First vertex and the two edges from it of every triangle, plus padding
+	std::vector<float> v0_x, v0_y, v0_z;
+	std::vector<float> e1_x, e1_y, e1_z;
+	std::vector<float> e2_x, e2_y, e2_z;
+
+	std::vector<bvh4_node> nodes;
+	aabb box;
+	double sah_cost = 0;
+
+	static const int leaf_size = 8;
+
+private:
+	// The ray rounded to float for the SIMD leaf test
+	struct mesh_ray;
+
+	void build();
+	int candidate_mask(const mesh_ray& mr, uint32_t first, uint32_t count) const;
+	bool hit_triangle(uint32_t i, const ray& r, real t_min, real t_max, real& t, real& b1, real& b2) const;
+	void set_hit_record(uint32_t i, const ray& r, real t, real b1, real b2, hit_record& rec) const;
+
+	point3 vertex(uint32_t i, int corner) const { return mesh.positions[mesh.indices[3 * i + corner]]; }
+};
+
+struct triangle_mesh::mesh_ray
+{
+	mesh_ray() {}
+	mesh_ray(const ray& r, real t_min, real t_max)
+	{
+		ox = static_cast<float>(r.origin().x());
+		oy = static_cast<float>(r.origin().y());
+		oz = static_cast<float>(r.origin().z());
+		dx = static_cast<float>(r.direction().x());
+		dy = static_cast<float>(r.direction().y());
+		dz = static_cast<float>(r.direction().z());
+		d_norm = fabs(dx) + fabs(dy) + fabs(dz);
+		o_norm = fabs(ox) + fabs(oy) + fabs(oz);
+		t_lower = float_round_down(t_min);
+		set_t_upper(t_max);
+	}
+
+	void set_t_upper(real t_max)
+	{
+		t_upper = float_round_up(t_max);
+	}
+
+	float ox, oy, oz;
+	float dx, dy, dz;
+	// Sums of the absolute components, scale the error bounds
+	float d_norm, o_norm;
+	float t_lower, t_upper;
+};
+
+triangle_mesh::triangle_mesh(mesh_data data, shared_ptr<material> mat) : mat_ptr(mat)
+{
+	set_mesh(std::move(data));
+}
+
+void triangle_mesh::set_mesh(mesh_data data)
+{
+	mesh = std::move(data);
+	nodes.clear();
+	sah_cost = 0;
+	if (mesh.validate())
+	{
+		trace_scope trace("Build mesh BVH", "bvh", "triangles", static_cast<int64_t>(mesh.triangle_count()));
+		build();
+	}
+}
+
+void triangle_mesh::build()
+{
+	auto count = mesh.triangle_count();
+	if (count == 0)
+		return;
+
+	std::vector<bvh_build_primitive> build;
+	build.resize(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		auto i32 = static_cast<uint32_t>(i);
+		auto p0 = vertex(i32, 0), p1 = vertex(i32, 1), p2 = vertex(i32, 2);
+		build[i].bounds = aabb(component_min(p0, component_min(p1, p2)), component_max(p0, component_max(p1, p2)));
+		build[i].centroid = 0.5 * (build[i].bounds.min() + build[i].bounds.max());
+		build[i].index = i32;
+	}
+
+	std::vector<linear_bvh_node> binary;
+	// A leaf tests four or eight triangles in the time it takes to test one, so fuller leaves are worth it
+	sah_bvh_builder builder(leaf_size);
+	builder.intersection_cost = 0.25;
+	sah_cost = builder.build(build, binary);
+	bvh4::collapse_tree(binary, nodes);
+
+	// Put the triangles in leaf order
+	std::vector<uint32_t> indices(mesh.indices.size());
+	for (size_t i = 0; i < count; i++)
+	{
+		for (int corner = 0; corner < 3; corner++)
+			indices[3 * i + corner] = mesh.indices[3 * build[i].index + corner];
+	}
+	mesh.indices.swap(indices);
+
+	// NaN triangles on the end keep SIMD loads past the last leaf in bounds and never pass the float test
+	const float nan = std::numeric_limits<float>::quiet_NaN();
+	for (auto values : { &v0_x, &v0_y, &v0_z, &e1_x, &e1_y, &e1_z, &e2_x, &e2_y, &e2_z })
+		values->assign(count + leaf_size, nan);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		auto i32 = static_cast<uint32_t>(i);
+		auto p0 = vertex(i32, 0);
+		auto e1 = vertex(i32, 1) - p0;
+		auto e2 = vertex(i32, 2) - p0;
+		v0_x[i] = static_cast<float>(p0.x()); v0_y[i] = static_cast<float>(p0.y()); v0_z[i] = static_cast<float>(p0.z());
+		e1_x[i] = static_cast<float>(e1.x()); e1_y[i] = static_cast<float>(e1.y()); e1_z[i] = static_cast<float>(e1.z());
+		e2_x[i] = static_cast<float>(e2.x()); e2_y[i] = static_cast<float>(e2.y()); e2_z[i] = static_cast<float>(e2.z());
+	}
+
+	box = aabb(point3(binary[0].bounds_min[0], binary[0].bounds_min[1], binary[0].bounds_min[2]),
+		point3(binary[0].bounds_max[0], binary[0].bounds_max[1], binary[0].bounds_max[2]));
+}
+
+// Float Moller-Trumbore test of up to leaf_size triangles starting at first, returns a bit for every triangle the ray
+// might hit. Far from the triangle or at grazing angles float rounding can move the barycentrics a long way, so every
+// bound is widened by an estimate of its error and triangles the ray is too close to parallel to judge are always kept
+int triangle_mesh::candidate_mask(const mesh_ray& mr, uint32_t first, uint32_t count) const
+{
+	int mask = 0;
+
+#ifdef RT_USE_SSE
+	const __m128 sign_bit = _mm_set1_ps(-0.0f);
+	auto abs = [&](__m128 x) { return _mm_andnot_ps(sign_bit, x); };
+	auto norm = [&](__m128 x, __m128 y, __m128 z) { return _mm_add_ps(_mm_add_ps(abs(x), abs(y)), abs(z)); };
+
+	const __m128 dx = _mm_set1_ps(mr.dx), dy = _mm_set1_ps(mr.dy), dz = _mm_set1_ps(mr.dz);
+	const __m128 d_norm = _mm_set1_ps(mr.d_norm);
+	const __m128 o_norm = _mm_set1_ps(mr.o_norm);
+	const __m128 one = _mm_set1_ps(1.0f);
+	// Comfortably more than the rounding of the handful of operations behind each value
+	const __m128 k = _mm_set1_ps(16 * std::numeric_limits<float>::epsilon());
+
+	for (uint32_t g = 0; g < count; g += 4)
+	{
+		auto i = first + g;
+		auto e1x = _mm_loadu_ps(&e1_x[i]), e1y = _mm_loadu_ps(&e1_y[i]), e1z = _mm_loadu_ps(&e1_z[i]);
+		auto e2x = _mm_loadu_ps(&e2_x[i]), e2y = _mm_loadu_ps(&e2_y[i]), e2z = _mm_loadu_ps(&e2_z[i]);
+		auto v0x = _mm_loadu_ps(&v0_x[i]), v0y = _mm_loadu_ps(&v0_y[i]), v0z = _mm_loadu_ps(&v0_z[i]);
+		auto tx = _mm_sub_ps(_mm_set1_ps(mr.ox), v0x);
+		auto ty = _mm_sub_ps(_mm_set1_ps(mr.oy), v0y);
+		auto tz = _mm_sub_ps(_mm_set1_ps(mr.oz), v0z);
+
+		// p = d x e2, q = t x e1
+		auto px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+		auto py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+		auto pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+		auto qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+		auto qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+		auto qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+
+		auto det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+		auto inv_det = _mm_div_ps(one, det);
+		auto u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+		auto v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+		auto t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+		// Each triple product is off by at most k times the product of its vectors' sizes, then divided by det. The
+		// origin and first vertex were rounded to float before being subtracted, so their sizes count towards t's
+		auto e1n = norm(e1x, e1y, e1z), e2n = norm(e2x, e2y, e2z);
+		auto tn = _mm_add_ps(_mm_add_ps(norm(tx, ty, tz), o_norm), norm(v0x, v0y, v0z));
+		auto abs_inv_det = abs(inv_det);
+		auto s = _mm_mul_ps(_mm_mul_ps(k, tn), abs_inv_det);
+		auto det_error = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(k, e1n), _mm_mul_ps(d_norm, e2n)), abs_inv_det);
+		auto u_error = _mm_add_ps(_mm_mul_ps(s, _mm_mul_ps(d_norm, e2n)), _mm_mul_ps(abs(u), det_error));
+		auto v_error = _mm_add_ps(_mm_mul_ps(s, _mm_mul_ps(d_norm, e1n)), _mm_mul_ps(abs(v), det_error));
+		auto t_error = _mm_add_ps(_mm_mul_ps(s, _mm_mul_ps(e1n, e2n)), _mm_mul_ps(abs(t), det_error));
+
+		auto possible = _mm_cmpge_ps(u, _mm_sub_ps(_mm_setzero_ps(), u_error));
+		possible = _mm_and_ps(possible, _mm_cmpge_ps(v, _mm_sub_ps(_mm_setzero_ps(), v_error)));
+		possible = _mm_and_ps(possible, _mm_cmple_ps(_mm_add_ps(u, v), _mm_add_ps(one, _mm_add_ps(u_error, v_error))));
+		possible = _mm_and_ps(possible, _mm_cmpge_ps(_mm_add_ps(t, t_error), _mm_set1_ps(mr.t_lower)));
+		possible = _mm_and_ps(possible, _mm_cmple_ps(_mm_sub_ps(t, t_error), _mm_set1_ps(mr.t_upper)));
+		// Nearly parallel, including det of 0. NaN padding fails this as well
+		possible = _mm_or_ps(possible, _mm_cmpge_ps(det_error, one));
+
+		mask |= _mm_movemask_ps(possible) << g;
+	}
+#else
+	// Without SIMD every triangle goes straight to the exact test
+	mask = (1 << leaf_size) - 1;
+#endif
+
+	return mask & ((1 << count) - 1);
+}
+
+// Moller-Trumbore on the mesh's vertices, b1 and b2 are the barycentric weights of the second and third vertices
+bool triangle_mesh::hit_triangle(uint32_t i, const ray& r, real t_min, real t_max, real& t, real& b1, real& b2) const
+{
+	auto p0 = vertex(i, 0);
+	auto e1 = vertex(i, 1) - p0;
+	auto e2 = vertex(i, 2) - p0;
+
+	auto p = cross(r.direction(), e2);
+	auto det = dot(e1, p);
+	if (det == 0)
+		return false;
+	auto inv_det = 1 / det;
+
+	auto tvec = r.origin() - p0;
+	b1 = dot(tvec, p) * inv_det;
+	if (b1 < 0 || b1 > 1)
+		return false;
+
+	auto q = cross(tvec, e1);
+	b2 = dot(r.direction(), q) * inv_det;
+	if (b2 < 0 || b1 + b2 > 1)
+		return false;
+
+	t = dot(e2, q) * inv_det;
+	return !(t < t_min || t_max < t);
+}
+
+// Fill in a hit found by hit_triangle. The point is rebuilt from the barycentrics so it lies on the triangle to within
+// the rounding of that sum, wherever along the ray the test put it
+void triangle_mesh::set_hit_record(uint32_t i, const ray& r, real t, real b1, real b2, hit_record& rec) const
+{
+	auto b0 = 1 - b1 - b2;
+	auto i0 = mesh.indices[3 * i], i1 = mesh.indices[3 * i + 1], i2 = mesh.indices[3 * i + 2];
+	const auto& p0 = mesh.positions[i0];
+	const auto& p1 = mesh.positions[i1];
+	const auto& p2 = mesh.positions[i2];
+
+	auto largest = [](const vec3& v) { return fmax(fabs(v.x()), fmax(fabs(v.y()), fabs(v.z()))); };
+
+	rec.t = t;
+	rec.p = b0 * p0 + b1 * p1 + b2 * p2;
+	rec.p_error = rounding_error(fabs(b0) * largest(p0) + fabs(b1) * largest(p1) + fabs(b2) * largest(p2));
+
+	// Which side was hit comes from the geometric normal, a smooth normal is turned to match it
+	auto geometric_normal = cross(p1 - p0, p2 - p0);
+	rec.set_face_normal(r, unit_vector(geometric_normal));
+	if (!mesh.normals.empty())
+	{
+		auto smooth = unit_vector(b0 * mesh.normals[i0] + b1 * mesh.normals[i1] + b2 * mesh.normals[i2]);
+		rec.normal = dot(smooth, rec.normal) < 0 ? -smooth : smooth;
+	}
+
+	if (!mesh.uvs.empty())
+	{
+		rec.u = b0 * mesh.uvs[2 * i0] + b1 * mesh.uvs[2 * i1] + b2 * mesh.uvs[2 * i2];
+		rec.v = b0 * mesh.uvs[2 * i0 + 1] + b1 * mesh.uvs[2 * i1 + 1] + b2 * mesh.uvs[2 * i2 + 1];
+	}
+	else
+	{
+		rec.u = b1;
+		rec.v = b2;
+	}
+
+	// Both areas are doubled, barycentrics cover half a unit square
+	real uv_area = 1;
+	if (!mesh.uvs.empty())
+	{
+		uv_area = fabs((mesh.uvs[2 * i1] - mesh.uvs[2 * i0]) * (mesh.uvs[2 * i2 + 1] - mesh.uvs[2 * i0 + 1]) -
+			(mesh.uvs[2 * i2] - mesh.uvs[2 * i0]) * (mesh.uvs[2 * i1 + 1] - mesh.uvs[2 * i0 + 1]));
+	}
+	auto area = geometric_normal.length();
+	rec.uv_scale = area > 0 ? sqrt(uv_area / area) : 0;
+	rec.mat_ptr = mat_ptr.get();
+}
+
+// Walk the tree like bvh4, testing whole leaves at once. Leaves of coincident triangles can hold more than leaf_size,
+// they are tested leaf_size at a time
+bool triangle_mesh::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+	mesh_ray mr(r, t_min, t_max);
+	int64_t closest_triangle = -1;
+	real closest = t_max;
+	real closest_b1 = 0, closest_b2 = 0;
+
+	bvh4::traverse(nodes, r, t_min, t_max, [&](uint32_t first, uint32_t count, real) {
+		count_stat(stat_counter::triangle_tests, count);
+		for (uint32_t start = first; start < first + count; start += leaf_size)
+		{
+			int mask = candidate_mask(mr, start, std::min<uint32_t>(leaf_size, first + count - start));
+			for (uint32_t lane = 0; mask; lane++, mask >>= 1)
+			{
+				real t, b1, b2;
+				if ((mask & 1) && hit_triangle(start + lane, r, t_min, closest, t, b1, b2))
+				{
+					closest_triangle = start + lane;
+					closest = t;
+					closest_b1 = b1;
+					closest_b2 = b2;
+					mr.set_t_upper(t);
+				}
+			}
+		}
+		return closest;
+	});
+
+	if (closest_triangle < 0)
+		return false;
+
+	set_hit_record(static_cast<uint32_t>(closest_triangle), r, closest, closest_b1, closest_b2, rec);
+	return true;
+}
+
+// Walk the tree once for the packet, every ray that reaches a leaf tests it on its own
+int triangle_mesh::hit_packet(const ray rays[packet_size], int ray_mask, real t_min, real closest[packet_size], hit_record recs[packet_size]) const
+{
+	if (nodes.empty() || ray_mask == 0)
+		return 0;
+
+	const bvh4::ray_packet packet(rays);
+	int64_t closest_triangle[packet_size];
+	real closest_b1[packet_size], closest_b2[packet_size];
+	mesh_ray mrs[packet_size];
+	for (int k = 0; k < packet_size; k++)
+	{
+		closest_triangle[k] = -1;
+		mrs[k] = mesh_ray(rays[k], t_min, closest[k]);
+	}
+
+	bvh4::traverse_packet(nodes, packet, ray_mask, t_min, closest, [&](uint32_t first, uint32_t count, int leaf_mask) {
+		count_stat(stat_counter::triangle_tests, count * bit_count(leaf_mask));
+		for (int k = 0; k < packet_size; k++)
+		{
+			if (!(leaf_mask & (1 << k)))
+				continue;
+
+			for (uint32_t start = first; start < first + count; start += leaf_size)
+			{
+				int mask = candidate_mask(mrs[k], start, std::min<uint32_t>(leaf_size, first + count - start));
+				for (uint32_t lane = 0; mask; lane++, mask >>= 1)
+				{
+					real t, b1, b2;
+					if ((mask & 1) && hit_triangle(start + lane, rays[k], t_min, closest[k], t, b1, b2))
+					{
+						closest_triangle[k] = start + lane;
+						closest[k] = t;
+						closest_b1[k] = b1;
+						closest_b2[k] = b2;
+						mrs[k].set_t_upper(t);
+					}
+				}
+			}
+		}
+	});
+
+	int hit_mask = 0;
+	for (int k = 0; k < packet_size; k++)
+	{
+		if (closest_triangle[k] < 0)
+			continue;
+
+		set_hit_record(static_cast<uint32_t>(closest_triangle[k]), rays[k], closest[k], closest_b1[k], closest_b2[k], recs[k]);
+		hit_mask |= 1 << k;
+	}
+
+	return hit_mask;
+}
+
+bool triangle_mesh::bounding_box(real time0, real time1, aabb& output_box) const
+{
+	output_box = box;
+	return !nodes.empty();
+}
+
+#endif
@@ -4,21 +4,107 @@
 #include <cmath>
 #include <iostream>
 
+#if defined(RT_VEC3_SSE)
+#include <xmmintrin.h>
+#elif defined(RT_VEC3_AVX)
+#include <immintrin.h>
+#endif
+
 using std::sqrt;
 
-// 3-dimensional vector class
+#ifdef RT_VEC3_SIMD
+// The few register operations vec3 is built from, over four lanes of which the last is always 0
+namespace vec3_lanes
+{
+#if defined(RT_VEC3_SSE)
+	using lanes = __m128;
+
+	inline lanes zero() { return _mm_setzero_ps(); }
+	inline lanes set(float x, float y, float z) { return _mm_setr_ps(x, y, z, 0); }
+	inline lanes broadcast(float t) { return _mm_set1_ps(t); }
+	inline lanes add(lanes a, lanes b) { return _mm_add_ps(a, b); }
+	inline lanes sub(lanes a, lanes b) { return _mm_sub_ps(a, b); }
+	inline lanes mul(lanes a, lanes b) { return _mm_mul_ps(a, b); }
+	inline lanes min(lanes a, lanes b) { return _mm_min_ps(a, b); }
+	inline lanes max(lanes a, lanes b) { return _mm_max_ps(a, b); }
+	inline lanes negate(lanes a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+
+	// Sum of all lanes in every lane
+	inline lanes sum(lanes a)
+	{
+		a = _mm_add_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_add_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+	}
+
+	inline float first(lanes a) { return _mm_cvtss_f32(a); }
+
+	// (y, z, x, 0) and (z, x, y, 0), the two rotations a cross product needs
+	inline lanes rotate_left(lanes a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1)); }
+	inline lanes rotate_right(lanes a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 0, 2)); }
+#elif defined(RT_VEC3_AVX)
+	using lanes = __m256d;
+
+	inline lanes zero() { return _mm256_setzero_pd(); }
+	inline lanes set(double x, double y, double z) { return _mm256_setr_pd(x, y, z, 0); }
+	inline lanes broadcast(double t) { return _mm256_set1_pd(t); }
+	inline lanes add(lanes a, lanes b) { return _mm256_add_pd(a, b); }
+	inline lanes sub(lanes a, lanes b) { return _mm256_sub_pd(a, b); }
+	inline lanes mul(lanes a, lanes b) { return _mm256_mul_pd(a, b); }
+	inline lanes min(lanes a, lanes b) { return _mm256_min_pd(a, b); }
+	inline lanes max(lanes a, lanes b) { return _mm256_max_pd(a, b); }
+	inline lanes negate(lanes a) { return _mm256_xor_pd(a, _mm256_set1_pd(-0.0)); }
+
+	// Sum of all lanes in every lane
+	inline lanes sum(lanes a)
+	{
+		a = _mm256_add_pd(a, _mm256_permute_pd(a, 0x5));
+		return _mm256_add_pd(a, _mm256_permute2f128_pd(a, a, 0x01));
+	}
+
+	inline double first(lanes a) { return _mm256_cvtsd_f64(a); }
+
+	inline lanes combine(__m128d low, __m128d high) { return _mm256_insertf128_pd(_mm256_castpd128_pd256(low), high, 1); }
+
+	// AVX cannot shuffle one register across its two halves, so build the rotations from the 128-bit halves
+	inline lanes rotate_left(lanes a)
+	{
+		auto low = _mm256_castpd256_pd128(a);
+		auto high = _mm256_extractf128_pd(a, 1);
+		return combine(_mm_shuffle_pd(low, high, 1), _mm_unpacklo_pd(low, _mm_setzero_pd()));
+	}
+	inline lanes rotate_right(lanes a)
+	{
+		auto low = _mm256_castpd256_pd128(a);
+		auto high = _mm256_extractf128_pd(a, 1);
+		return combine(_mm_unpacklo_pd(high, low), _mm_shuffle_pd(low, _mm_setzero_pd(), 1));
+	}
+#endif
+}
+#endif
+
+// 3-dimensional vector class. With RT_VEC3_SIMD it is padded to four aligned lanes and its operators work on all of them at once
 class vec3
 {
 public:
+#ifdef RT_VEC3_SIMD
+	// Create an empty vec3
+	vec3() : v(vec3_lanes::zero()) {}
+	// Create a vec3 with values
+	vec3(real e0, real e1, real e2) : v(vec3_lanes::set(e0, e1, e2)) {}
+
+	explicit vec3(vec3_lanes::lanes lanes) : v(lanes) {}
+	vec3_lanes::lanes lanes() const { return v; }
+#else
 	// Create an empty vec3
 	vec3() : e{ 0,0,0 } {}
 	// Create a vec3 with values
-	vec3(double e0, double e1, double e2) : e{ e0, e1, e2 } {}
+	vec3(real e0, real e1, real e2) : e{ e0, e1, e2 } {}
+#endif
 
 	// Methods for getting x, y and z of a vec 3
-	double x() const { return e[0]; }
-	double y() const { return e[1]; }
-	double z() const { return e[2]; }
+	real x() const { return e[0]; }
+	real y() const { return e[1]; }
+	real z() const { return e[2]; }
 
 	// Determines if vector is close to 0
 	bool near_zero() const 
@@ -32,55 +118,81 @@ public:
 		return vec3(random_double(), random_double(), random_double());
 	}
 
-	inline static vec3 random(double min, double max)
+	inline static vec3 random(real min, real max)
 	{
 		return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
 	}
 
 	// Get the negative of a vector
+#ifdef RT_VEC3_SIMD
+	vec3 operator-() const { return vec3(vec3_lanes::negate(lanes())); }
+#else
 	vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
+#endif
 	// Get the value in specified position as a constant
-	double operator[](int i) const { return e[i]; }
+	real operator[](int i) const { return e[i]; }
 	// Get a pointer to the value at the specified position
-	double& operator[](int i) { return e[i]; }
+	real& operator[](int i) { return e[i]; }
 
 	// Multiplication of a vector by a real number
-	vec3& operator*=(const double t)
+	vec3& operator*=(const real t)
 	{
+#ifdef RT_VEC3_SIMD
+		v = vec3_lanes::mul(v, vec3_lanes::broadcast(t));
+#else
 		e[0] *= t;
 		e[1] *= t;
 		e[2] *= t;
+#endif
 		return *this;
 	}
 
 	// Addition of two vectors
 	vec3& operator+=(const vec3& v) {
+#ifdef RT_VEC3_SIMD
+		this->v = vec3_lanes::add(this->v, v.v);
+#else
 		e[0] += v.e[0];
 		e[1] += v.e[1];
 		e[2] += v.e[2];
+#endif
 		return *this;
 	}
 
 	// Division of a vector by a 
-	vec3& operator/=(const double t)
+	vec3& operator/=(const real t)
 	{
 		return *this *= 1 / t;
 	}
 
 	// Return the length of the vector
-	double length() const 
+	real length() const 
 	{
 		return sqrt(length_squared());
 	}
 
 	// Return the squared length of the vector
-	double length_squared() const 
+	real length_squared() const 
 	{
+#ifdef RT_VEC3_SIMD
+		auto v = lanes();
+		return vec3_lanes::first(vec3_lanes::sum(vec3_lanes::mul(v, v)));
+#else
 		return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
+#endif
 	}
 
 public:
-	double e[3];
+#ifdef RT_VEC3_SIMD
+	// The fourth lane is padding and always 0. The components are read through e, which the compilers this builds with allow
+	union
+	{
+		vec3_lanes::lanes v;
+		real e[4];
+	};
+#else
+	real e[3];
+#endif
 };
 
 // Type aliases for vec3
@@ -96,6 +208,31 @@ inline std::ostream& operator<<(std::ostream& out, const vec3& v)
 	return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
+#ifdef RT_VEC3_SIMD
+// Return the addition of two vec3 as a vec3
+inline vec3 operator+(const vec3& u, const vec3& v)
+{
+	return vec3(vec3_lanes::add(u.lanes(), v.lanes()));
+}
+
+// Return the subtraction of two vec3 as a vec3
+inline vec3 operator-(const vec3& u, const vec3& v)
+{
+	return vec3(vec3_lanes::sub(u.lanes(), v.lanes()));
+}
+
+// Return the multiplication of two vec3 as a vec3
+inline vec3 operator*(const vec3& u, const vec3& v)
+{
+	return vec3(vec3_lanes::mul(u.lanes(), v.lanes()));
+}
+
+// Return the multiplication of a vec3 and a real as a vec3
+inline vec3 operator*(real t, const vec3& v)
+{
+	return vec3(vec3_lanes::mul(vec3_lanes::broadcast(t), v.lanes()));
+}
+#else
 // Return the addition of two vec3 as a vec3
 inline vec3 operator+(const vec3& u, const vec3& v) 
 {
@@ -114,39 +251,50 @@ inline vec3 operator*(const vec3& u, const vec3& v)
 	return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-// Return the multiplication of a vec3 and a double as a vec3
-inline vec3 operator*(double t, const vec3& v)
+// Return the multiplication of a vec3 and a real as a vec3
+inline vec3 operator*(real t, const vec3& v)
 {
 	return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
+#endif
 
 
-// Return the multiplication of a vec3 and a double as a vec3
-inline vec3 operator*(const vec3& v, double t)
+// Return the multiplication of a vec3 and a real as a vec3
+inline vec3 operator*(const vec3& v, real t)
 {
 	return t * v;
 }
 
-// Return the division of a vec3 by a double as a vec3
-inline vec3 operator/(vec3 v, double t)
+// Return the division of a vec3 by a real as a vec3
+inline vec3 operator/(vec3 v, real t)
 {
 	return (1 / t) * v;
 }
 
-// Return the dot product of two vec3 as a double
-inline double dot(const vec3& u, const vec3& v)
+// Return the dot product of two vec3 as a real
+inline real dot(const vec3& u, const vec3& v)
 {
+#ifdef RT_VEC3_SIMD
+	return vec3_lanes::first(vec3_lanes::sum(vec3_lanes::mul(u.lanes(), v.lanes())));
+#else
 	return u.e[0] * v.e[0]
 		+ u.e[1] * v.e[1]
 		+ u.e[2] * v.e[2];
+#endif
 }
 
 // Return the cross product of two vec 3 as a new vec3
 inline vec3 cross(const vec3& u, const vec3& v)
 {
+#ifdef RT_VEC3_SIMD
+	using namespace vec3_lanes;
+	auto a = u.lanes(), b = v.lanes();
+	return vec3(sub(mul(rotate_left(a), rotate_right(b)), mul(rotate_right(a), rotate_left(b))));
+#else
 	return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
 		u.e[2] * v.e[0] - u.e[0] * v.e[2],
 		u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+#endif
 }
 
 // Return the unit vector of a vec3 as a new vec3
@@ -155,6 +303,26 @@ inline vec3 unit_vector(vec3 v)
 	return v / v.length();
 }
 
+// Return the smaller of each pair of components as a vec3
+inline vec3 component_min(const vec3& u, const vec3& v)
+{
+#ifdef RT_VEC3_SIMD
+	return vec3(vec3_lanes::min(u.lanes(), v.lanes()));
+#else
+	return vec3(fmin(u.e[0], v.e[0]), fmin(u.e[1], v.e[1]), fmin(u.e[2], v.e[2]));
+#endif
+}
+
+// Return the larger of each pair of components as a vec3
+inline vec3 component_max(const vec3& u, const vec3& v)
+{
+#ifdef RT_VEC3_SIMD
+	return vec3(vec3_lanes::max(u.lanes(), v.lanes()));
+#else
+	return vec3(fmax(u.e[0], v.e[0]), fmax(u.e[1], v.e[1]), fmax(u.e[2], v.e[2]));
+#endif
+}
+
 // Return a random point in a unit sphere as a vec3
 inline vec3 random_in_unit_sphere()
 {
@@ -179,11 +347,11 @@ inline vec3 reflect(const vec3& v, const vec3& n)
 }
 
 // Return the direction of a refracted ray as a vec3
-inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat)
+inline vec3 refract(const vec3& uv, const vec3& n, real etai_over_etat)
 {
-	auto cos_theta = fmin(dot(-uv, n), 1.0);
+	auto cos_theta = fmin(dot(-uv, n), real(1));
 	vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
-	vec3 r_out_parallel = -sqrt(fabs(1.0 - r_out_perp.length_squared())) * n;
+	vec3 r_out_parallel = -sqrt(fabs(1 - r_out_perp.length_squared())) * n;
 	return r_out_perp + r_out_parallel;
 }
 
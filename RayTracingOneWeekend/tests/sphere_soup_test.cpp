@@ -0,0 +1,101 @@
+// Checks sphere_soup against testing every sphere one by one, for spheres whose centres all coincide. The BVH cannot
+// split them by position, so they end up in leaves of leaf_size or more that the soup has to walk in full
+
+#include "rtweekend.h"
+#include "material.h"
+#include "sphere.h"
+#include "sphere_soup.h"
+
+#include <cstdio>
+#include <vector>
+
+// The nearest hit of r on any of the spheres, tested one by one
+static bool brute_force_hit(const std::vector<real>& radii, const ray& r, real& closest)
+{
+    bool hit = false;
+    closest = infinity;
+    for (auto radius : radii)
+    {
+        real t;
+        if (intersect_sphere(point3(0, 0, 0), radius, r, 0.001, closest, t))
+        {
+            closest = t;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+static bool same_hit(bool expected_hit, real expected_t, bool hit, real t)
+{
+    return expected_hit == hit && (!hit || fabs(expected_t - t) <= 1e-4 * expected_t);
+}
+
+// Compare single rays and packets of rays against the brute force hits, returns the number that differ
+static int check_concentric(int sphere_count, int ray_count)
+{
+    auto mat = make_shared<lambertian>(colour(0.5, 0.5, 0.5));
+    sphere_soup soup;
+    std::vector<real> radii;
+    for (int i = 1; i <= sphere_count; i++)
+    {
+        radii.push_back(static_cast<real>(i));
+        soup.add(point3(0, 0, 0), radii.back(), mat);
+    }
+    soup.build(0, 1);
+
+    std::vector<ray> rays;
+    for (int i = 0; i < ray_count; i++)
+    {
+        auto extent = static_cast<double>(sphere_count) * 1.5;
+        point3 origin(random_double(-extent, extent), random_double(-extent, extent), random_double(-extent, extent));
+        rays.emplace_back(origin, random_unit_vector());
+    }
+
+    int failures = 0;
+    for (const auto& r : rays)
+    {
+        real expected_t, t = 0;
+        bool expected_hit = brute_force_hit(radii, r, expected_t);
+        hit_record rec;
+        bool hit = soup.hit(r, 0.001, infinity, rec);
+        if (hit)
+            t = rec.t;
+        if (!same_hit(expected_hit, expected_t, hit, t))
+            failures++;
+    }
+
+    const int lanes = hittable::packet_size;
+    for (size_t first = 0; first + lanes <= rays.size(); first += lanes)
+    {
+        real closest[lanes];
+        hit_record recs[lanes];
+        for (int k = 0; k < lanes; k++)
+            closest[k] = infinity;
+
+        int hits = soup.hit_packet(&rays[first], (1 << lanes) - 1, 0.001, closest, recs);
+        for (int k = 0; k < lanes; k++)
+        {
+            real expected_t;
+            bool expected_hit = brute_force_hit(radii, rays[first + k], expected_t);
+            if (!same_hit(expected_hit, expected_t, (hits >> k) & 1, recs[k].t))
+                failures++;
+        }
+    }
+
+    std::printf("%d concentric spheres, %d rays: %d wrong\n", sphere_count, ray_count, failures);
+    return failures;
+}
+
+int main()
+{
+    set_random_seed(1);
+
+    int failures = 0;
+    // Just over one leaf, many leaves, and more spheres than one node can count
+    failures += check_concentric(9, 4000);
+    failures += check_concentric(40, 4000);
+    failures += check_concentric(70000, 64);
+
+    return failures == 0 ? 0 : 1;
+}